@@ -0,0 +1,127 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+// Microbenchmark of the queue of postponed particles of BxGeneratorTTree:
+// deque sorted on every event (as before the multimap) vs time-ordered multimap.
+// The queue holds N particles, each event one particle is postponed (pushed back
+// with a time later than the current one) and the earliest one is taken.
+// No Geant4 or ROOT is needed, the particle is a stand-in of the same size as ParticleInfo.
+
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <algorithm>
+
+namespace {
+    /// Stand-in of BxGeneratorTTree::ParticleInfo: ids, energy, three 3-vectors, time, definition and weight
+    struct Particle {
+        int         event_id, p_index, status, pdg_code;
+        double      energy;
+        double      momentum[3], position[3];
+        double      time;
+        double      polarization[3];
+        const void* definition;
+        double      weight;
+    };
+
+    struct CompareByTime {
+        bool operator() (const Particle& p1, const Particle& p2) const { return p1.time < p2.time; }
+    };
+
+    double Now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + 1e-9 * ts.tv_nsec;
+    }
+
+    /// Decay-like time after the current one, the same sequence for both queues
+    double NextTime(double now, unsigned& seed) {
+        seed = seed * 1103515245u + 12345u;
+        return now + 1. + 1000. * ((seed >> 8) & 0xffff) / 65536.;
+    }
+
+    Particle MakeParticle(double time) {
+        Particle p = Particle();
+        p.time   = time;
+        p.weight = 1.;
+        return p;
+    }
+
+    /// Time per event in seconds of deque with std::sort before each event
+    double RunDeque(long nQueued, long nEvents) {
+        std::deque<Particle> queue;
+        unsigned seed = 1;
+        for (long i = 0; i < nQueued; ++i) queue.push_back(MakeParticle(NextTime(0., seed)));
+        double now = 0., checksum = 0.;
+        const double start = Now();
+        for (long e = 0; e < nEvents; ++e) {
+            queue.push_back(MakeParticle(NextTime(now, seed)));
+            std::sort(queue.begin(), queue.end(), CompareByTime());
+            now = queue.front().time;
+            checksum += now;
+            queue.pop_front();
+        }
+        const double time = (Now() - start) / nEvents;
+        if (checksum < 0.) std::printf("%g\n", checksum); // keeps the loop from being optimized out
+        return time;
+    }
+
+    /// Time per event in seconds of multimap keyed by time
+    double RunMultimap(long nQueued, long nEvents) {
+        typedef std::multimap<double, Particle> Queue;
+        Queue queue;
+        unsigned seed = 1;
+        for (long i = 0; i < nQueued; ++i) {
+            const Particle p = MakeParticle(NextTime(0., seed));
+            queue.insert(queue.upper_bound(p.time), std::make_pair(p.time, p));
+        }
+        double now = 0., checksum = 0.;
+        const double start = Now();
+        for (long e = 0; e < nEvents; ++e) {
+            const Particle p = MakeParticle(NextTime(now, seed));
+            queue.insert(queue.upper_bound(p.time), std::make_pair(p.time, p));
+            now = queue.begin()->first;
+            checksum += now;
+            queue.erase(queue.begin());
+        }
+        const double time = (Now() - start) / nEvents;
+        if (checksum < 0.) std::printf("%g\n", checksum);
+        return time;
+    }
+
+    void Usage(const char* name) {
+        std::printf("Usage: %s [-q queued] [-e events]\n", name);
+        std::printf("  -q  number of particles in queue (default 100000)\n");
+        std::printf("  -e  number of events (default 1000)\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    long nQueued = 100000;
+    long nEvents = 1000;
+    int option;
+    while ((option = getopt(argc, argv, "q:e:h")) != -1) {
+        switch (option) {
+            case 'q': nQueued = std::atol(optarg); break;
+            case 'e': nEvents = std::atol(optarg); break;
+            default : Usage(argv[0]); return option == 'h' ? 0 : 1;
+        }
+    }
+    if (nQueued < 0 || nEvents <= 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    const double deque    = RunDeque   (nQueued, nEvents);
+    const double multimap = RunMultimap(nQueued, nEvents);
+    std::printf("%ld queued particles, %ld events: deque+sort %10.3f us/event | multimap %10.3f us/event\n",
+                nQueued, nEvents, deque * 1e6, multimap * 1e6);
+    return 0;
+}
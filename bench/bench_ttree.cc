@@ -0,0 +1,144 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+// Benchmark of BxGeneratorTTree outside of g4bx2: for each macro a new generator is configured
+// by the macro, initialized and asked for primaries of empty G4Events until the end of input
+// or the given number of events. Events/s, particles/s and heap allocations per event are reported.
+// Only the generator is measured: no tracking, stacking or output file.
+// NOTE: ions need G4GenericIon with a process manager, i.e. a physics list, use light particles in input
+
+#include "BxGeneratorTTree.hh"
+#include "BxOutputVertex.hh"
+#include "BxLogger.hh"
+
+#include "G4RunManager.hh"
+#include "G4UImanager.hh"
+#include "G4Event.hh"
+#include "G4PrimaryVertex.hh"
+#include "G4ParticleTable.hh"
+#include "G4BosonConstructor.hh"
+#include "G4LeptonConstructor.hh"
+#include "G4MesonConstructor.hh"
+#include "G4BaryonConstructor.hh"
+
+#include "TStopwatch.h"
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+
+// -------------------------------------------------- //
+// Allocation counter: every operator new of the process is counted
+#if __cplusplus >= 201103L
+#define BX_THROW_BAD_ALLOC
+#define BX_NOTHROW noexcept
+#else
+#define BX_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define BX_NOTHROW throw()
+#endif
+
+namespace {
+    /// Updated atomically, since ROOT and background threads of generator allocate too
+    unsigned long long gNAllocations = 0;
+
+    unsigned long long NAllocations() { return __sync_fetch_and_add(&gNAllocations, 0ULL); }
+
+    void* CountedAlloc(size_t size) {
+        __sync_fetch_and_add(&gNAllocations, 1ULL);
+        void* p = std::malloc(size ? size : 1);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+}
+
+void* operator new  (size_t size) BX_THROW_BAD_ALLOC { return CountedAlloc(size); }
+void* operator new[](size_t size) BX_THROW_BAD_ALLOC { return CountedAlloc(size); }
+void  operator delete  (void* p) BX_NOTHROW { std::free(p); }
+void  operator delete[](void* p) BX_NOTHROW { std::free(p); }
+
+// -------------------------------------------------- //
+namespace {
+    void Usage(const char* name) {
+        std::printf("Usage: %s [-n events] [-v] macro.mac [macro2.mac ...]\n", name);
+        std::printf("  -n  maximal number of events per macro (default: until the end of input)\n");
+        std::printf("  -v  keep log of generator (default: warnings and errors only)\n");
+    }
+
+    void ConstructParticles() {
+        G4BosonConstructor  bosons;  bosons.ConstructParticle();
+        G4LeptonConstructor leptons; leptons.ConstructParticle();
+        G4MesonConstructor  mesons;  mesons.ConstructParticle();
+        G4BaryonConstructor baryons; baryons.ConstructParticle();
+        G4ParticleTable::GetParticleTable()->SetReadiness(true);
+    }
+
+    void RunMacro(const G4String& macro, Long64_t maxEvents) {
+        BxGeneratorTTree* generator = new BxGeneratorTTree;
+        if (G4UImanager::GetUIpointer()->ApplyCommand("/control/execute " + macro) != 0) {
+            std::printf("%-40s cannot execute macro\n", macro.data());
+            delete generator;
+            return;
+        }
+
+        TStopwatch stopwatch;
+        generator->Initialize();
+        const Double_t initTime = stopwatch.RealTime();
+
+        unsigned long long nParticles = 0;
+        Long64_t nEvents = 0;
+        const unsigned long long allocationsBefore = NAllocations();
+        stopwatch.Start();
+        for (; maxEvents < 0 || nEvents < maxEvents; ++nEvents) {
+            G4Event event(nEvents);
+            generator->BxGeneratePrimaries(&event);
+            if (event.IsAborted()) break;
+            for (G4int i = 0; i < event.GetNumberOfPrimaryVertex(); ++i) nParticles += event.GetPrimaryVertex(i)->GetNumberOfParticle();
+            BxOutputVertex::Get()->ClearAll();
+        }
+        const Double_t loopTime = std::max(1e-9, stopwatch.RealTime());
+        const unsigned long long allocations = NAllocations() - allocationsBefore;
+
+        std::printf("%-40s init %8.3f s | %10lld events %12.0f events/s | %12llu particles %12.0f particles/s | %8.1f allocations/event\n",
+                    macro.data(), initTime, nEvents, nEvents / loopTime, nParticles, nParticles / loopTime,
+                    nEvents > 0 ? Double_t(allocations) / nEvents : 0.);
+        // stats of generator are logged as routine messages
+        const BxLogger::Severity severity = BxLogger::GetSeverity();
+        BxLogger::SetSeverity(std::min(severity, BxLogger::routine));
+        generator->ReportStats("");
+        BxLogger::SetSeverity(severity);
+        delete generator;
+    }
+}
+
+int main(int argc, char** argv) {
+    Long64_t maxEvents = -1;
+    G4bool   verbose   = false;
+    int option;
+    while ((option = getopt(argc, argv, "n:vh")) != -1) {
+        switch (option) {
+            case 'n': maxEvents = std::atoll(optarg); break;
+            case 'v': verbose   = true;               break;
+            default : Usage(argv[0]); return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (!verbose) BxLogger::SetSeverity(BxLogger::warning);
+
+    // run manager is needed for AbortRun() at the end of input, it is never initialized
+    G4RunManager* runManager = new G4RunManager;
+    ConstructParticles();
+
+    for (int i = optind; i < argc; ++i) RunMacro(argv[i], maxEvents);
+
+    delete runManager;
+    return 0;
+}
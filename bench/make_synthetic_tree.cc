@@ -0,0 +1,109 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+// Writes TTree "events" with particle arrays for benchmarks of BxGeneratorTTree:
+//   n, pdg[n], energy[n] (MeV), px[n], py[n], pz[n] (unit vector), x[n], y[n], z[n] (m), t[n] (ns)
+// and extra_<k>[n] float branches which are not used by generator (they test branch pruning).
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TRandom3.h"
+#include "TMath.h"
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+
+namespace {
+    void Usage(const char* name) {
+        std::printf("Usage: %s [-e entries] [-m multiplicity] [-p] [-b extra_branches] [-c compression] [-s seed] output.root\n", name);
+        std::printf("  -e  number of entries (default 100000)\n");
+        std::printf("  -m  particles per entry (default 1), with -p it is the mean of Poisson distribution\n");
+        std::printf("  -b  number of extra float branches not used by generator (default 0)\n");
+        std::printf("  -c  ROOT compression setting, e.g. 1 (zlib level 1) or 404 (LZ4 level 4) (default 1)\n");
+        std::printf("  -s  random seed (default 12345)\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    Long64_t entries      = 100000;
+    Double_t multiplicity = 1.;
+    bool     poisson      = false;
+    int      nExtra       = 0;
+    int      compression  = 1;
+    UInt_t   seed         = 12345;
+
+    int option;
+    while ((option = getopt(argc, argv, "e:m:pb:c:s:h")) != -1) {
+        switch (option) {
+            case 'e': entries      = std::atoll(optarg); break;
+            case 'm': multiplicity = std::atof(optarg);  break;
+            case 'p': poisson      = true;               break;
+            case 'b': nExtra       = std::atoi(optarg);  break;
+            case 'c': compression  = std::atoi(optarg);  break;
+            case 's': seed         = std::atoi(optarg);  break;
+            default : Usage(argv[0]); return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || entries <= 0 || multiplicity <= 0.) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    TFile file(argv[optind], "RECREATE", "", compression);
+    if (file.IsZombie()) {
+        std::fprintf(stderr, "Cannot create %s\n", argv[optind]);
+        return 1;
+    }
+    TTree tree("events", "Synthetic events for BxGeneratorTTree benchmarks");
+
+    // arrays are allocated for 5 sigma above the mean, larger entries are truncated
+    const Int_t maxN = Int_t(multiplicity + 5. * TMath::Sqrt(multiplicity) + 10.);
+    Int_t n = 0;
+    std::vector<Int_t>    pdg(maxN);
+    std::vector<Double_t> energy(maxN), px(maxN), py(maxN), pz(maxN), x(maxN), y(maxN), z(maxN), t(maxN);
+    std::vector< std::vector<Float_t> > extra(nExtra, std::vector<Float_t>(maxN));
+
+    tree.Branch("n"     , &n         , "n/I"          );
+    tree.Branch("pdg"   , &pdg[0]    , "pdg[n]/I"     );
+    tree.Branch("energy", &energy[0] , "energy[n]/D"  );
+    tree.Branch("px"    , &px[0]     , "px[n]/D"      );
+    tree.Branch("py"    , &py[0]     , "py[n]/D"      );
+    tree.Branch("pz"    , &pz[0]     , "pz[n]/D"      );
+    tree.Branch("x"     , &x[0]      , "x[n]/D"       );
+    tree.Branch("y"     , &y[0]      , "y[n]/D"       );
+    tree.Branch("z"     , &z[0]      , "z[n]/D"       );
+    tree.Branch("t"     , &t[0]      , "t[n]/D"       );
+    for (int k = 0; k < nExtra; ++k) {
+        const std::string name = "extra_" + std::string(TString::Format("%d", k).Data());
+        tree.Branch(name.data(), &extra[k][0], (name + "[n]/F").data());
+    }
+
+    const Int_t codes[] = { 22, 11, -11, 13, 2112 };
+    TRandom3 random(seed);
+    for (Long64_t entry = 0; entry < entries; ++entry) {
+        n = poisson ? random.Poisson(multiplicity) : Int_t(multiplicity);
+        if (n > maxN) n = maxN;
+        for (Int_t i = 0; i < n; ++i) {
+            pdg[i]    = codes[random.Integer(5)];
+            energy[i] = random.Exp(2.);
+            random.Sphere(px[i], py[i], pz[i], 1.);
+            const Double_t r = 4. * TMath::Power(random.Rndm(), 1./3.);
+            random.Sphere(x[i], y[i], z[i], r);
+            t[i] = random.Exp(100.);
+            for (int k = 0; k < nExtra; ++k) extra[k][i] = random.Rndm();
+        }
+        tree.Fill();
+    }
+    tree.Write();
+    std::printf("%lld entries with %g particles on average and %d extra branches written to %s (%lld bytes)\n",
+                entries, poisson ? multiplicity : Double_t(Int_t(multiplicity)), nExtra, argv[optind], file.GetSize());
+    file.Close();
+    return 0;
+}
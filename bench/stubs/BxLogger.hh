@@ -0,0 +1,36 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxLogger_h
+#define BxLogger_h 1
+
+#include "globals.hh"
+
+#include <iostream>
+
+/// Stand-in for g4bx2 BxLogger: messages below severity are not formatted, fatal message exits after endlog
+class BxLogger {
+public:
+    enum Severity { debugging = -2, development = -1, trace = 0, routine, warning, error, fatal };
+
+    static Severity      GetSeverity() { return fSeverity; }
+    static void          SetSeverity(Severity severity) { fSeverity = severity; }
+    static std::ostream& GetStream(Severity severity, const char* name);
+    static void          EndLog(std::ostream& stream);
+
+private:
+    static Severity fSeverity;
+    static G4bool   fIsFatal;  ///< Fatal message is being written
+};
+
+std::ostream& endlog(std::ostream& stream);
+
+#define BxLog(sev) if (BxLogger::sev >= BxLogger::GetSeverity()) BxLogger::GetStream(BxLogger::sev, #sev)
+
+using namespace std;
+
+#endif
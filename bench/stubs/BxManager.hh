@@ -0,0 +1,19 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxManager_h
+#define BxManager_h 1
+
+#include "G4RunManager.hh"
+
+/// Stand-in for g4bx2 BxManager, the plain run manager of the benchmark
+class BxManager : public G4RunManager {
+public:
+    static BxManager* Get() { return static_cast<BxManager*>(G4RunManager::GetRunManager()); }
+};
+
+#endif
@@ -0,0 +1,72 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxOutputVertex_h
+#define BxOutputVertex_h 1
+
+#include "globals.hh"
+#include "G4ThreeVector.hh"
+
+#include <vector>
+
+/**
+ *  Stand-in for g4bx2 BxOutputVertex with the setters used by generators.
+ *  Daughters and users are collected into vectors as by the real one, so that their cost is measured.
+ */
+class BxOutputVertex {
+public:
+    static BxOutputVertex* Get();
+
+    struct Daughter {
+        G4int         id;
+        G4int         pdg;
+        G4double      energy;
+        G4ThreeVector direction;
+        G4ThreeVector position;
+        G4double      time;
+    };
+    struct User {
+        G4int    int1;
+        G4int    int2;
+        G4float  float1;
+        G4float  float2;
+        G4double value;
+    };
+
+    void SetEventID   (G4int a)                { fEventID = a; }
+    void SetGenerator (G4int a)                { fGenerator = a; }
+    void SetDId       (G4int a)                { fDaughter.id = a; }
+    void SetDPDG      (G4int a)                { fDaughter.pdg = a; }
+    void SetDEnergy   (G4double a)             { fDaughter.energy = a; }
+    void SetDDirection(const G4ThreeVector& a) { fDaughter.direction = a; }
+    void SetDPosition (const G4ThreeVector& a) { fDaughter.position = a; }
+    void SetDTime     (G4double a)             { fDaughter.time = a; }
+    void SetDaughters ()                       { fDaughters.push_back(fDaughter); }
+    void SetUserInt1  (G4int a)                { fUser.int1 = a; }
+    void SetUserInt2  (G4int a)                { fUser.int2 = a; }
+    void SetUserFloat1(G4float a)              { fUser.float1 = a; }
+    void SetUserFloat2(G4float a)              { fUser.float2 = a; }
+    void SetUserDouble(G4double a)             { fUser.value = a; }
+    void SetUsers     ()                       { fUsers.push_back(fUser); }
+
+    /// Called at the end of each event, as by event action of g4bx2
+    void ClearAll() { fDaughters.clear(); fUsers.clear(); fEventID = 0; }
+
+    size_t GetNDaughters() const { return fDaughters.size(); }
+
+private:
+    BxOutputVertex() : fEventID(0), fGenerator(0), fDaughter(), fUser(), fDaughters(), fUsers() {}
+
+    G4int                 fEventID;
+    G4int                 fGenerator;
+    Daughter              fDaughter;
+    User                  fUser;
+    std::vector<Daughter> fDaughters;
+    std::vector<User>     fUsers;
+};
+
+#endif
@@ -0,0 +1,30 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxReadParameters_h
+#define BxReadParameters_h 1
+
+#include "globals.hh"
+
+/// Stand-in for g4bx2 BxReadParameters, only flags set by BxGeneratorTTree
+class BxReadParameters {
+public:
+    static BxReadParameters* Get();
+
+    void   SetRDMDecay(G4bool a) { fRDMDecay = a; }
+    void   SetRDMChain(G4bool a) { fRDMChain = a; }
+    G4bool GetRDMDecay() const   { return fRDMDecay; }
+    G4bool GetRDMChain() const   { return fRDMChain; }
+
+private:
+    BxReadParameters() : fRDMDecay(false), fRDMChain(false) {}
+
+    G4bool fRDMDecay;
+    G4bool fRDMChain;
+};
+
+#endif
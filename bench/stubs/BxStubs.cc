@@ -0,0 +1,42 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "BxLogger.hh"
+#include "BxOutputVertex.hh"
+#include "BxReadParameters.hh"
+
+#include <cstdlib>
+
+BxLogger::Severity BxLogger::fSeverity = BxLogger::routine;
+G4bool             BxLogger::fIsFatal  = false;
+
+std::ostream& BxLogger::GetStream(Severity severity, const char* name) {
+    std::ostream& stream = (severity >= warning) ? std::cerr : std::cout;
+    if (severity == fatal) fIsFatal = true;
+    stream << name << ": ";
+    return stream;
+}
+
+void BxLogger::EndLog(std::ostream& stream) {
+    stream << std::endl;
+    if (fIsFatal) std::exit(1);
+}
+
+std::ostream& endlog(std::ostream& stream) {
+    BxLogger::EndLog(stream);
+    return stream;
+}
+
+BxOutputVertex* BxOutputVertex::Get() {
+    static BxOutputVertex instance;
+    return &instance;
+}
+
+BxReadParameters* BxReadParameters::Get() {
+    static BxReadParameters instance;
+    return &instance;
+}
@@ -0,0 +1,30 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxVGenerator_h
+#define BxVGenerator_h 1
+
+#include "globals.hh"
+#include "G4ThreeVector.hh"
+
+class G4Event;
+
+/// Stand-in for g4bx2 BxVGenerator
+class BxVGenerator {
+public:
+    BxVGenerator(const G4String& name) : fGeneratorName(name) {}
+    virtual ~BxVGenerator() {}
+
+    virtual void BxGeneratePrimaries(G4Event* event) = 0;
+
+    const G4String& GetGeneratorName() const { return fGeneratorName; }
+
+private:
+    G4String fGeneratorName;
+};
+
+#endif
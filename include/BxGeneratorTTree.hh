@@ -11,16 +11,31 @@
 #include "TChain.h"
 
 #include "BxVGenerator.hh"
+#include "BxGeneratorTTreeStats.hh"
+
+#include "G4RotationMatrix.hh"
 
 #include <vector>
 #include <map>
-#include <deque>
+#include <set>
+#include <string>
+#include <algorithm>
 
 class BxGeneratorTTreeMessenger;
 class TTreeFormula;
 class TTreeFormulaManager;
+class TThread;
+class TBranch;
 class G4Event;
 class G4ParticleGun;
+class G4ParticleDefinition;
+namespace CLHEP { class HepRandomEngine; }
+template <class T> class BxRingBuffer;
+class BxGeneratorTTreeSnapshotReader;
+class BxGeneratorTTreeJit;
+class BxGeneratorTTreeSampler;
+class BxGeneratorTTreeTruthWriter;
+class BxGeneratorTTreeTraceWriter;
 
 class BxGeneratorTTree : public BxVGenerator {
 public:
@@ -42,23 +57,31 @@ public:
      *  Set the TTree(Chain) name and path to input ROOT file(s).
      *  \param[in] treename Name of TTree. If TTree is in directory inside ROOT file, its name is "directory/treename"
      *  \ param filename Name of ROOT file with extension and path
+     *  \ param nEntries Number of entries in TTree if known, then file is not opened until it is read
+     */
+    void AddTree(const G4String& treename, const G4String& filename, Long64_t nEntries = -1);
+    
+    /**
+     *  Text file with path, size, modification time and number of entries of input files.
+     *  Entry counts of unchanged files are taken from it, the others are counted and saved there.
+     *  Default is none, i.e. all files with unknown entry counts are opened at initialization.
      */
-    void AddTree(const G4String& treename, const G4String& filename);
+    inline void SetMetadataFile(const G4String& filename) { fMetadataFileName = filename; }
     
     /// Set alias for expression, same as in TTree::SetAlias
     void SetAlias(const G4String& alias, const G4String& expression);
     
     /// Set the first entry to be processed.
-    inline void SetFirstEntry(const G4int a) { fFirstEntry = a; }
+    inline void SetFirstEntry(const Long64_t a) { fFirstEntry = a; }
 
     /// Get the first entry to be processed.
-    inline G4int GetFirstEntry() const { return fFirstEntry; }
+    inline Long64_t GetFirstEntry() const { return fFirstEntry; }
     
     /// Set the number of entries to be processed.
-    inline void SetNEntries(const G4int a) { fNEntries = a; }
+    inline void SetNEntries(const Long64_t a) { fNEntries = a; }
 
     /// Get the number of entries to be processed.
-    inline G4int GetNEntries() const { return fNEntries; }
+    inline Long64_t GetNEntries() const { return fNEntries; }
     
     /**
      *  Write info about primary particles to log.
@@ -67,6 +90,15 @@ public:
      */
     inline void SetLogPrimariesInfo(G4bool a) { fLogPrimariesInfo  = a; }
     
+    /// Log info about primary particles of every n-th event only. Default is 1, i.e. all events.
+    inline void SetLogPrimariesEvery(G4int n) { fLogPrimariesEvery = n > 0 ? n : 1; }
+    
+    /**
+     *  Write info about primary particles to text file by background thread instead of log.
+     *  Trace level of log is not needed then. Default is none.
+     */
+    inline void SetTraceFile(const G4String& filename) { fTraceFileName = filename; }
+    
     /**
      *  Write info about primary particles to output file.
      *  Default is true.
@@ -74,6 +106,141 @@ public:
      */
     inline void SetSavePrimariesInfo(G4bool a) { fSavePrimariesInfo = a; }
     
+    /**
+     *  Number of evaluated entries to be read ahead by background thread.
+     *  Default is 0, i.e. entries are read in the event loop thread.
+     */
+    inline void SetPrefetchDepth(G4int a) { fPrefetchDepth = a; }
+    
+    /// Get the number of entries to be read ahead.
+    inline G4int GetPrefetchDepth() const { return fPrefetchDepth; }
+    
+    /**
+     *  Share one reader between generators of all worker threads (G4MTRunManager).
+     *  Generator initialized first opens the Tree(Chain) and evaluates entries in background thread,
+     *  each worker takes the next entry from the common buffer when it needs one.
+     *  The reader is reference counted: if its generator is deleted first, it waits until the whole input
+     *  is in the buffer or all other generators are deleted, and the last generator deletes the buffer.
+     *  Default is false, i.e. each generator reads the whole range itself.
+     */
+    inline void SetSharedReader(G4bool a) { fSharedReader = a; }
+    
+    /**
+     *  Disable all branches which are not used by formulas.
+     *  Default is false: branches used only by code which is not seen by formulas would be disabled as well.
+     */
+    inline void SetPruneBranches(G4bool a) { fPruneBranches = a; }
+    
+    /// Set size of TTreeCache in bytes. Default is 0, i.e. ROOT default cache settings.
+    inline void SetCacheSize(Long64_t a) { fCacheSize = a; }
+    
+    /**
+     *  Replay primaries from snapshot file instead of Tree(Chain).
+     *  Formulas and Tree(Chain) are not used at all in this mode.
+     */
+    inline void SetSnapshotFile(const G4String& filename) { fSnapshotFileName = filename; }
+    
+    /**
+     *  Write truth of primaries to separate ROOT file by background thread (see BxGeneratorTTreeTruthWriter).
+     *  Generators of worker threads write to files with suffix "_t<thread id>".
+     *  Default is none. It doesn't depend on SetSavePrimariesInfo().
+     */
+    inline void SetTruthFile(const G4String& filename) { fTruthFileName = filename; }
+    
+    /// Switch on per-stage timers of generator (monotonic clock). Default is false, only counters are on.
+    inline void SetStatsTiming(G4bool a) { fStats.SetTiming(a); fReaderStats.SetTiming(a); }
+    
+    /// Log stats every n generated events, at the end of each run and of input. Default is 0, i.e. only on request.
+    inline void SetStatsEvery(G4int n) { fStatsEvery = n; }
+    
+    /**
+     *  Log counters, rates and per-stage times since initialization, and write them to file if filename is given.
+     *  In MT mode the master reports the sum of all worker generators (as of their last events),
+     *  generators of worker threads write to files with suffix "_t<thread id>".
+     */
+    void ReportStats(const G4String& filename);
+    
+    /**
+     *  Start run(s) with the number of events given by the input instead of /run/beamOn 2^31-1.
+     *  exact: entries to be processed are evaluated at initialization and the run has exactly one event
+     *  per entry with particles. Events of postponed particles take some of them, then the rest of input
+     *  is generated by extra streamed runs.
+     *  stream: events are generated until the end of input.
+     *  Pool mode is rejected, its input never ends.
+     *  Inputs with more than 2^31-1 events are processed in several runs. Sequential mode only.
+     */
+    void BeamOn(G4bool exact);
+    
+    /**
+     *  Generator-only run: evaluate all entries to be processed and write them to snapshot file.
+     *  No G4Event is generated.
+     */
+    void WriteSnapshot(const G4String& filename);
+    
+    /**
+     *  Directory for persistent indices of entries which pass "event_skip_if" condition.
+     *  Index is built once for the range of entries to be processed (shard, if any) and reused
+     *  by all jobs with the same files, aliases, condition and range. Empty string (default) means no index.
+     */
+    inline void SetSkipIndexDir(const G4String& dir) { fSkipIndexDir = dir; }
+    
+    /**
+     *  Evaluate expressions by functions compiled with Cling instead of TTreeFormula.
+     *  Expressions not supported by compiler are still interpreted. Default is false.
+     */
+    inline void SetJitBackend(G4bool a) { fJitBackend = a; }
+    
+    /// Compare compiled and interpreted values of all expressions on the first n entries.
+    inline void SetBackendCrossCheck(G4int n) { fCrossCheckEntries = n; }
+    
+    /**
+     *  Scan PDG codes of all entries to be processed by n threads at initialization
+     *  and create all needed ions before the first event. Default is 0, i.e. no scan.
+     */
+    inline void SetPrewarmIons(G4int n) { fPrewarmThreads = n; }
+    
+    /**
+     *  Process only shard index (0-based) of nShards of the range given by first_entry and n_entries.
+     *  Shards start at cluster boundaries and have about the same cost (number of entries plus particles).
+     *  Plan is read from planFile, or built and written there if file is missing or made for other input.
+     */
+    void SetShard(G4int index, G4int nShards, const G4String& planFile);
+    
+    /**
+     *  Draw entries of the range with probability proportional to the value of expression
+     *  instead of reading them one by one. Each drawn entry gets compensating weight
+     *  (mean weight over the range divided by weight of entry), which is set to primary particles.
+     *  Empty expression (default) means no sampling.
+     */
+    inline void SetSamplingWeight(const G4String& expression) { fSamplingWeight = expression; }
+    
+    /// Number of entries to be drawn. Default is 0, i.e. the number of entries in range.
+    inline void SetSamplingDraws(Long64_t n) { fSamplingDraws = n; }
+    
+    /// Directory for alias tables cached by chain, range and weight expression. Default is none (no cache).
+    inline void SetSamplingCacheDir(const G4String& dir) { fSamplingCacheDir = dir; }
+    
+    /**
+     *  Load the first n accepted entries into memory at initialization and generate events
+     *  by cycling over them without further reading of input. Default is 0, i.e. no pool.
+     */
+    inline void SetPoolSize(G4int n) { fPoolSize = n; }
+    
+    /// Rotate each event served from pool isotropically (momenta and polarizations). Default is true.
+    inline void SetPoolRotateIso(G4bool rotate) { fPoolRotateIso = rotate; }
+    
+    /// Shift times of each event served from pool by random value uniform in [0, shift). Default is 0.
+    inline void SetPoolTimeShift(G4double shift) { fPoolTimeShift = shift; }
+    
+    /**
+     *  Postponed particles closer in time than window to the previous one are generated in one G4Event,
+     *  with times relative to the first of them. Default is 0, i.e. only particles with equal times are grouped.
+     */
+    inline void SetCoincidenceWindow(G4double window) { fCoincidenceWindow = window; }
+    
+    /// Maximal time span of G4Event of postponed particles (detector gate), negative means no limit. Default is -1.
+    inline void SetCoincidenceGate(G4double gate) { fCoincidenceGate = gate; }
+    
     /// Configurator sub-class
     class SubEventConfigTTF; // forward declaration of nested class
     
@@ -89,14 +256,97 @@ public:
     
 private:
     TChain* fTreeChain;       
-    G4int   fCurrentEntry;    ///< Entry counter
-    G4int   fFirstEntry;      ///< First entry to be read.
-    G4int   fLastEntry;       ///< Last entry to be read.
-    G4int   fNEntries;        ///< Number of entries to be processed
+    Long64_t fCurrentEntry;   ///< Entry taken last by the event loop, postponed particles keep their own entries
+    Long64_t fReadEntry;      ///< Entry counter of reader
+    Long64_t fFirstEntry;     ///< First entry to be read.
+    Long64_t fLastEntry;      ///< Last entry to be read.
+    Long64_t fNEntries;       ///< Number of entries to be processed
     G4bool  fIsInitialized;   ///< Initialization flag
     
     G4bool  fLogPrimariesInfo;  ///< Flag to write info about primary particles to log
+    G4int   fLogPrimariesEvery; ///< Primaries of every n-th event are logged
     G4bool  fSavePrimariesInfo; ///< Flag to write info about primary particles to output file
+    G4bool  fUseOutputVertex;   ///< Flag that BxOutputVertex belongs to this thread, false in worker threads
+    G4bool  fMixedWeightsWarned; ///< Warning on particles with different weights in one G4Event is given
+    G4bool  fEndOfChain;        ///< Flag set by reader when the end of Tree(Chain) is reached
+    G4bool  fEndOfInput;        ///< Flag set when there are no more entries for this generator
+    G4bool  fCountEvents;       ///< Flag to count events to be generated at initialization
+    Long64_t fNEvents;          ///< Number of events counted at initialization, -1 if not counted
+    Long64_t fNGeneratedEvents; ///< Number of not aborted events generated so far
+    Long64_t fNPulledEntries;   ///< Number of entries with particles taken by the event loop so far
+    
+    G4int   fPrefetchDepth;     ///< Number of entries to be read ahead, 0 means no background reading
+    G4bool  fSharedReader;      ///< Flag to take entries from the reader shared by all threads
+    G4bool  fPruneBranches;     ///< Flag to disable branches not used by formulas
+    Long64_t fCacheSize;        ///< Size of TTreeCache in bytes, 0 means ROOT default
+    std::set<std::string> fCacheBranches; ///< Branches used by formulas, they are added to TTreeCache
+    
+    G4String fSnapshotFileName;                      ///< Snapshot file to replay primaries from
+    BxGeneratorTTreeSnapshotReader* fSnapshotReader; ///< Reader of snapshot file
+    
+    G4String fTruthFileName;                      ///< File for truth of primaries, empty if it is not written
+    BxGeneratorTTreeTruthWriter* fTruthWriter;    ///< Background writer of truth file
+    G4String fTraceFileName;                      ///< Text file for primaries info, empty if it goes to log
+    BxGeneratorTTreeTraceWriter* fTraceWriter;    ///< Background writer of trace file
+    
+    BxGeneratorTTreeStats fStats;        ///< Counters and per-stage timers of the event loop thread
+    BxGeneratorTTreeStats fReaderStats;  ///< Stats of the thread which reads entries, moved to fReaderTotals after each entry
+    BxGeneratorTTreeStats fReaderTotals; ///< Reader stats seen by other threads, guarded by stats mutex
+    G4int                 fStatsEvery;   ///< Stats are logged every n events, 0 means only on request
+    
+    G4String           fSkipIndexDir;      ///< Directory of skip index files
+    G4bool             fUseSkipIndex;      ///< Flag to iterate only over entries from skip index
+    std::vector<Long64_t> fAcceptedEntries; ///< Sorted entries which pass "event_skip_if" condition
+    size_t             fSkipIndexCursor;   ///< Position of the next entry to be read in fAcceptedEntries
+    
+    G4bool  fJitBackend;          ///< Flag to use compiled expressions
+    G4int   fCrossCheckEntries;   ///< Number of entries left to be cross-checked between backends
+    G4int   fCrossCheckMismatches;///< Number of mismatches found by cross-check
+    
+    G4int   fPrewarmThreads;      ///< Number of threads scanning PDG codes at initialization
+    
+    G4int    fShardIndex;         ///< Index of shard to be processed
+    G4int    fNShards;            ///< Number of shards, 0 means no sharding
+    G4String fShardPlanFile;      ///< Text file with shard boundaries
+    
+    /// Input file added by AddTree()
+    struct ChainFile {
+        G4String treename;
+        G4String filename;
+        Long64_t nEntries; ///< Number of entries, -1 if unknown
+    };
+    /// Cached properties of input file
+    struct FileMetadata {
+        Long64_t size;
+        Long64_t mtime;
+        Long64_t nEntries;
+    };
+    std::vector<ChainFile> fChainFiles;       ///< Files to be added to the chain at initialization
+    G4String               fMetadataFileName; ///< File with cached entry counts
+    
+    G4String  fSamplingWeight;    ///< Expression of sampling weight, empty if entries are not sampled
+    Long64_t  fSamplingDraws;     ///< Number of entries to be drawn, 0 means number of entries in range
+    G4String  fSamplingCacheDir;  ///< Directory of cached alias tables
+    BxGeneratorTTreeSampler* fSampler;       ///< Alias table of sampling weights, 0 if entries are not sampled
+    CLHEP::HepRandomEngine*  fSamplingEngine; ///< Random engine of draws
+    long      fSamplingSeed;      ///< Seed of fSamplingEngine, draws are replayed with it to count events
+    Long64_t  fNDrawn;            ///< Number of entries drawn so far
+    std::vector< std::pair<Long64_t, G4double> > fSampledEntries; ///< Block of drawn entries with compensating weights, sorted
+    size_t    fSampleCursor;      ///< Position of the next entry to be read in fSampledEntries
+    static const Long64_t kSamplingBlock = 1 << 20; ///< Number of draws made at once (16 MB)
+    G4double  fEntryWeight;       ///< Compensating weight of entry being read
+    
+    G4int     fPoolSize;          ///< Number of entries kept in memory, 0 means no pool
+    G4bool    fPoolRotateIso;     ///< Flag to rotate events served from pool
+    G4double  fPoolTimeShift;     ///< Upper limit of random time shift of events served from pool
+    size_t    fPoolCursor;        ///< Position of the next entry to be served from fPool
+    Long64_t  fPoolCycle;         ///< Number of completed cycles over fPool
+    Long64_t  fPoolEventIdStride; ///< Span of event ids in fPool, event ids of each cycle are shifted by it
+    G4int     fPoolMaxEventId;    ///< Largest event id in fPool, cycles start again from 0 before shifted ids exceed INT_MAX
+    G4double  fCoincidenceWindow; ///< Maximal time between postponed particles of one G4Event
+    G4double  fCoincidenceGate;   ///< Maximal time span of postponed particles of one G4Event, negative means no limit
+    G4double  fPostponedTimeOffset; ///< Time of the first postponed particle of current G4Event
+    std::map<G4int, G4ParticleDefinition*> fDefinitions; ///< Cache of resolved PDG codes, 0 for unknown ones
     
     G4ParticleGun* fParticleGun;
     
@@ -108,6 +358,7 @@ public:
     /// Holder of particles parameters
     struct ParticleInfo {
         G4int         event_id;     
+        Long64_t      entry;        ///< Tree(Chain) entry the particle (or its primary, if postponed) comes from
         G4int         p_index;      ///< Sequence number of primary particle in TTree entry
         G4int         status;       ///< Stacking mode status of particle
         G4int         pdg_code;     
@@ -116,11 +367,25 @@ public:
         G4ThreeVector position;     
         G4double      time;         
         G4ThreeVector polarization; 
+        const G4ParticleDefinition* definition; ///< Resolved definition of pdg_code, 0 if not resolved yet
+        G4double      weight;       ///< Weight of primary particle, 1 unless entries are sampled
     };
     
-    void  PushFrontParticleInfo(const ParticleInfo& particle_info) { fDequeParticleInfo.push_front(particle_info); }
-    void  PushBackParticleInfo (const ParticleInfo& particle_info) { fDequeParticleInfo.push_back(particle_info); }
+    /// Particles of single Tree(Chain) entry
+    struct EntryBatch {
+        Long64_t                  entry;
+        std::vector<ParticleInfo> particles;
+        
+        EntryBatch() : entry(-1), particles() {}
+        void swap(EntryBatch& other) { std::swap(entry, other.entry); particles.swap(other.particles); }
+    };
+    
+    /// Queue particle before (front) or after (back) already queued particles with the same time
+    void  PushFrontParticleInfo(const ParticleInfo& particle_info) { fParticleQueue.insert(fParticleQueue.lower_bound(particle_info.time), std::make_pair(particle_info.time, particle_info)); }
+    void  PushBackParticleInfo (const ParticleInfo& particle_info) { fParticleQueue.insert(fParticleQueue.upper_bound(particle_info.time), std::make_pair(particle_info.time, particle_info)); }
     const std::vector<ParticleInfo>& GetCurrentPrimaryParticlesInfo() const { return fCurrentParticlesInfo; }
+    /// Time subtracted from times of postponed particles of current G4Event for the particle gun
+    G4double GetPostponedTimeOffset() const { return fPostponedTimeOffset; }
     
     void PushFrontParticleInfo(G4int event_id, G4int p_index, G4int status,
         G4int pdg_code, G4double energy, const G4ThreeVector& momentum,
@@ -131,20 +396,125 @@ public:
         const G4ThreeVector& position, G4double time, const G4ThreeVector& polarization);
     
 private:
-    G4bool FillDequeFromEntry(G4int entry_number);
+    G4bool FillBatchFromEntry(Long64_t entry_number, std::vector<ParticleInfo>& particles);
+    
+    /// Build or load alias table of sampling weights
+    void SetupSampling();
+    
+    /// Draw the next block of entries into fSampledEntries, returns false if all draws are done
+    G4bool NextSampledBlock();
+    
+    /// Read the first fPoolSize accepted entries into fPool
+    void SetupPool();
+    
+    /// Copy of the next pool entry with fresh rotation and time shift
+    G4bool NextPoolEntry(EntryBatch& batch);
+    
+    /// Number of particles of entry given by n_particles without ones skipped by particle_skip_if, -1 if entry is skipped
+    Long64_t CountParticles(Long64_t entry_number);
+    
+    /// Number of entries to be processed which have particles
+    Long64_t CountEvents();
+    G4bool ReadNextEntry(EntryBatch& batch);
+    G4bool PullNextEntry(EntryBatch& batch);
+    
+    /// Move stats of reader stages to fReaderTotals, called by the thread which reads entries
+    void PublishReaderStats();
+    /// Store stats of worker generator for the master, called by the event loop thread
+    void PublishThreadStats();
+    /// Stats of this generator, or the sum of published stats of all worker generators if allThreads is true
+    BxGeneratorTTreeStats GetStats(G4bool allThreads) const;
+    
+    /// Column of field for n particles (scaled by unit), stride is 0 if value is the same for all particles
+    Double_t* PrepareColumn(SubEventConfigTTF& config, G4int field, G4int n, Double_t unit, G4bool forceColumn, G4int& stride);
+    
+    /**
+     *  Fill particles of sub-event, vector fields marked as uniform are evaluated and transformed once.
+     *  Momenta are rotated by rotation (product of event and sub-event rotations) in one pass,
+     *  particles with particle_rotate_iso get directions uniform on the sphere.
+     */
+    template <G4bool kUniformMomentum, G4bool kUniformPosition, G4bool kUniformPolarization>
+    void FillSubEvent(SubEventConfigTTF& config, G4int n, const G4RotationMatrix& rotation,
+        ParticleInfo& particle_info, G4int& total_p_index, std::vector<ParticleInfo>& particles);
+    
+    /// Add files to the chain with known entry counts, so that they are opened only when needed
+    void BuildChain();
+    void ReadMetadata(std::map<std::string, FileMetadata>& metadata) const;
+    void WriteMetadata(const std::map<std::string, FileMetadata>& metadata) const;
+    static Long64_t CountEntries(const G4String& treename, const G4String& filename);
+    
+    void SetupBranches();
+    /// Set TTreeCache for branches used by formulas and entries to be read, after the range is final
+    void SetupCache();
+    void CollectBranches(const G4String& expression, std::set<std::string>& branches, G4int depth = 0);
+    void CollectBranch(TBranch* branch, std::set<std::string>& branches);
+    
+    /// Hash of chain files, aliases and given expressions. Used as a key of cached files.
+    G4String GetChainHash(const std::vector<G4String>& expressions) const;
+    void   SetupSkipIndex();
+    Long64_t NextEntryNumber(Long64_t entry);
+    
+    /// Range of entries of single shard
+    struct ShardInfo {
+        Long64_t first;
+        Long64_t n;
+        G4double cost;
+        ShardInfo() : first(0), n(0), cost(0.) {}
+    };
+    /// Narrow the range to the shard, plan is built only if build is true. Returns false if the range is not narrowed.
+    G4bool SetupShard(G4bool build);
+    G4bool ReadShardPlan(const G4String& hash, std::vector<ShardInfo>& shards) const;
+    void   BuildShardPlan(std::vector<ShardInfo>& shards);
+    
+    /// Cached G4ParticleTable/G4IonTable lookup, must be called from the event loop thread only
+    G4ParticleDefinition* FindDefinition(G4int pdg_code);
+    void PrewarmIons();
+    
+    /// Open snapshot or Tree(Chain), set up formulas and start background reader if needed
+    void InitializeReader();
     
-    std::deque<ParticleInfo>  fDequeParticleInfo;
+    void StartPrefetch();
+    void StopPrefetch();
+    void ReleaseSharedReader();
+    void RunPrefetch();
+    static void* PrefetchThreadFunction(void* generator);
+    
+    /// Uniform random number from engine of the thread which evaluates entries
+    G4double UniformRand();
+    
+    /// n uniform random numbers from the same engine as UniformRand(), drawn in one call
+    void UniformRandArray(G4int n, G4double* values);
+    
+    /// Isotropic rotation given by Euler angles phi, theta, psi as in Hep3Vector::rotate()
+    G4RotationMatrix RandomRotation();
+    
+    /// Particles waiting to be generated, ordered by time. Insertion is O(log n), taking the earliest is O(1).
+    typedef std::multimap<G4double, ParticleInfo> ParticleQueue;
+    ParticleQueue             fParticleQueue;
     std::vector<ParticleInfo> fCurrentParticlesInfo;
+    EntryBatch                fEntryBatch;     ///< Buffer for particles of the next entry
+    std::vector<EntryBatch>   fPool;           ///< Entries served over and over in pool mode
     
-    //TODO: with C++11 change to lambda in BxGeneratorTTree.cc
-    struct ParticleInfoCompareByTime {
-        bool operator() (const ParticleInfo& p1, const ParticleInfo& p2) { return p1.time < p2.time; }
-    } particle_info_compare_by_time;
+    std::vector< std::vector<Double_t> > fColumns;  ///< Reusable per-field columns of sub-event, indexed by SubEventConfigTTF::EFormula
+    std::vector<Double_t>               fMomentumMag; ///< Reusable column of momentum magnitudes
+    std::vector<Double_t>               fScalars;     ///< Values of fields which are the same for all particles of sub-event
+    std::vector<G4double>               fRandoms;     ///< Reusable buffer of random numbers for directions of sub-event
+    
+    BxRingBuffer<EntryBatch>* fPrefetchBuffer; ///< Entries evaluated by background thread
+    TThread*                  fPrefetchThread; ///< Background reader
+    CLHEP::HepRandomEngine*   fPrefetchEngine; ///< Random engine of background reader
 };
 
 
 class BxGeneratorTTree::SubEventConfigTTF {
 public:
+    /// Formulas of sub-event in order of GetFormulas()
+    enum EFormula {
+        kSubEventRotateIso, kNParticles, kParticleSkip, kParticleRotateIso, kPdg, kEnergy,
+        kMomentumX, kMomentumY, kMomentumZ, kPositionX, kPositionY, kPositionZ, kTime,
+        kPolarizationX, kPolarizationY, kPolarizationZ, kNFormulas
+    };
+    
     SubEventConfigTTF(TChain*);
     virtual ~SubEventConfigTTF();
     
@@ -165,6 +535,7 @@ public:
     
     void SetSubEventRotateIso(const G4String& val) { fStringSubEventRotateIso = val; }
     void SetNParticles       (const G4String& val) { fStringNParticles        = val; }
+    const G4String& GetNParticles() const { return fStringNParticles; }
     void SetParticleSkip     (const G4String& val) { fStringParticleSkip      = val; }
     void SetParticleRotateIso(const G4String& val) { fStringParticleRotateIso = val; }
     void SetPdg              (const G4String& val) { fStringPdg               = val; }
@@ -182,6 +553,34 @@ public:
     
     void Initialize();
     
+    /// Compile expressions with given backend, unsupported ones stay interpreted
+    void SetupJit(BxGeneratorTTreeJit* jit);
+    
+    /// Number of particle instances in the current entry
+    Int_t GetNdata();
+    
+    /// Compare compiled and interpreted values on the current entry, returns number of mismatching formulas
+    G4int CrossCheck();
+    
+    /**
+     *  Evaluate formula for instances [0, n) into contiguous column.
+     *  Plain leaf references are copied from the leaf buffer as a whole,
+     *  formulas without multiplicity are evaluated once.
+     */
+    void EvalColumn(EFormula k, Int_t n, Double_t* column) const;
+    
+    /// Kind of field, classified by Initialize()
+    enum EFieldKind { kConstant, kEventScalar, kPerParticle };
+    
+    EFieldKind GetFieldKind (EFormula k) const { return EFieldKind(fFieldKinds[k]); }
+    G4bool     IsPerParticle(EFormula k) const { return fFieldKinds[k] == kPerParticle; }
+    G4bool     IsUniform(EFormula x, EFormula y, EFormula z) const { return !IsPerParticle(x) && !IsPerParticle(y) && !IsPerParticle(z); }
+    
+    /// Value of constant or event-scalar field for the current entry
+    Double_t   EvalScalar(EFormula k) const { return Eval(k, fFormulas[k], 0); }
+    
+    const TTreeFormula* GetFormula(EFormula k) const { return fFormulas[k]; }
+    
     Bool_t   EvalSubEventRotateIso(       ) const;
     Long64_t EvalNParticles       (       ) const;
     Bool_t   EvalParticleSkip     (Int_t i) const;
@@ -202,11 +601,27 @@ public:
     const TTreeFormulaManager* GetManager() const { return fTTFmanager; }
           TTreeFormulaManager* GetManager()       { return fTTFmanager; }
     
+    /// Append all formulas of sub-event to the vector
+    void GetFormulas(std::vector<TTreeFormula*>& formulas) const;
+    
     const G4String& LogMessage();
     
 private:
+    Double_t Eval  (EFormula k, TTreeFormula* formula, Int_t i) const;
+    Long64_t Eval64(EFormula k, TTreeFormula* formula, Int_t i) const;
+    
     TChain* fTreeChain;
     
+    BxGeneratorTTreeJit* fJit;        ///< Compiled backend, 0 if formulas are interpreted
+    std::vector<G4int>   fJitIndices; ///< Indices of compiled functions of formulas, -1 if formula is interpreted
+    G4bool               fAllJit;     ///< Flag that all formulas are compiled
+    
+    std::vector<TTreeFormula*> fFormulas;     ///< All formulas in order of EFormula
+    std::vector<G4bool>        fIsPlainLeaf;  ///< Flag that formula is just a reference to numeric leaf
+    std::vector<G4int>         fFieldKinds;   ///< EFieldKind of formulas
+    std::vector<Double_t>      fConstants;    ///< Values of constant formulas
+    G4int                      fNPerParticle; ///< Number of per-particle formulas
+    
     TTreeFormula* fFormulaSubEventRotateIso; ///< Formula of sub-event isotropic rotation flag
     TTreeFormula* fFormulaNParticles;        ///< Formula of number of particles in sub-event
     TTreeFormula* fFormulaParticleSkip;      ///< Formula of particle skipping flag
@@ -265,15 +680,28 @@ public:
     Bool_t IsSetEventId() { return fEventIdIsSet; }
     void SetEventId       (const G4String& val) { fStringEventId        = val; fEventIdIsSet = true; }
     void SetEventSkip     (const G4String& val) { fStringEventSkip      = val; }
+    const G4String& GetEventSkip() const { return fStringEventSkip; }
     void SetEventRotateIso(const G4String& val) { fStringEventRotateIso = val; }
     
-    void Initialize();
+    void Initialize(G4bool useJit = false);
+    
+    /// Read branches used by compiled expressions, call after TChain::LoadTree()
+    void PrepareEntry();
+    
+    /// Compare compiled and interpreted values on the current entry, returns number of mismatching formulas
+    G4int CrossCheck();
     
     Long64_t EvalEventId       ();
     Bool_t   EvalEventSkip     ();
     Bool_t   EvalEventRotateIso();
     
-    void CheckInOnEntry(G4int entry_number);
+    void CheckInOnEntry(Long64_t entry_number);
+    
+    /// Load entry and evaluate only event skipping flag
+    Bool_t EvalEventSkipOnEntry(Long64_t entry_number);
+    
+    /// Append all formulas of event and sub-events to the vector
+    void GetFormulas(std::vector<TTreeFormula*>& formulas) const;
     
     void Log();
     
@@ -281,6 +709,18 @@ private:
     TChain*       fTreeChain;
     G4bool        fEventIdIsSet;
     
+    BxGeneratorTTreeJit* fJit;          ///< Compiled backend, 0 if formulas are interpreted
+    G4int         fJitEventId;          ///< Index of compiled function of event id, -1 if interpreted
+    G4int         fJitEventSkip;        ///< Index of compiled function of event skipping flag, -1 if interpreted
+    G4int         fJitEventRotateIso;   ///< Index of compiled function of event rotation flag, -1 if interpreted
+    
+    G4bool        fIsConstEventId;        ///< Flag that event id is a number
+    G4bool        fIsConstEventSkip;      ///< Flag that event skipping flag is a number
+    G4bool        fIsConstEventRotateIso; ///< Flag that event rotation flag is a number
+    Double_t      fConstEventId;          ///< Value of constant event id
+    Double_t      fConstEventSkip;        ///< Value of constant event skipping flag
+    Double_t      fConstEventRotateIso;   ///< Value of constant event rotation flag
+    
     TTreeFormula* fFormulaEventId;        ///< Formula of event id
     TTreeFormula* fFormulaEventSkip;      ///< Formula of event skipping flag
     TTreeFormula* fFormulaEventRotateIso; ///< Formula of event isotropic rotation flag
@@ -0,0 +1,82 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeJit_h
+#define BxGeneratorTTreeJit_h 1
+
+#include "Rtypes.h"
+
+#include "globals.hh"
+
+#include <vector>
+#include <map>
+#include <string>
+
+class TChain;
+class TTree;
+class TLeaf;
+class TBranch;
+
+/**
+ *  Native backend for generator expressions.
+ *  Expression is translated to C++ function and compiled by Cling (ROOT 6 only).
+ *  Supported subset: numbers, leaves (with implicit instance index for arrays), aliases,
+ *  arithmetic, comparison and logical operators, ternary operator and common math functions.
+ *  Expressions with anything else (Sum$, explicit indices, ^, %, strings, ...) are not translated,
+ *  caller has to use TTreeFormula for them.
+ */
+class BxGeneratorTTreeJit {
+public:
+    BxGeneratorTTreeJit(TChain* chain);
+    ~BxGeneratorTTreeJit();
+
+    /// Translate and compile expression. Returns index of compiled function or -1 if expression is not supported.
+    G4int Add(const G4String& expression);
+
+    /// Read used branches for the current entry of chain (after TChain::LoadTree)
+    void LoadEntry();
+
+    /// Value of expression for instance i, 0 if instance is out of range (same as TTreeFormula)
+    Double_t Eval(G4int k, Int_t i) const {
+        if (i >= fNdata[k]) return 0.;
+        return fFunctions[k](fValues.empty() ? 0 : &fValues[0], i);
+    }
+
+    /// Number of instances for the set of expressions, indices < 0 are ignored
+    Int_t GetNdata(const std::vector<G4int>& expressions) const;
+
+    size_t GetNFunctions() const { return fFunctions.size(); }
+
+    static G4bool IsClose(Double_t a, Double_t b);
+
+private:
+    typedef Double_t (*Function)(const void* const* values, Int_t i);
+
+    G4bool Translate(const std::string& expression, std::string& code, std::vector<G4int>& leaves, G4int depth);
+    G4int  AddLeaf(const std::string& name);
+    void   ResolveLeaves();
+
+    TChain*                     fTreeChain;
+    G4int                       fId;          ///< Unique id of instance, used in names of compiled functions
+    G4int                       fTreeNumber;  ///< Number of tree in chain for which leaves are resolved
+    TTree*                      fTree;        ///< Tree for which leaves are resolved
+    Long64_t                    fLoadedEntry; ///< Local entry read to leaves buffers
+
+    std::map<std::string,G4int> fLeafIndex;   ///< Leaf name to index of leaf
+    std::vector<std::string>    fLeafNames;
+    std::vector<std::string>    fLeafTypes;   ///< Type names of leaves which compiled code relies on
+    std::vector<TLeaf*>         fLeaves;
+    std::vector<G4bool>         fLeafIsArray;
+    std::vector<TBranch*>       fBranches;    ///< Branches of leaves and their counters
+    std::vector<const void*>    fValues;      ///< Pointers to leaves buffers passed to compiled functions
+
+    std::vector<Function>           fFunctions;
+    std::vector< std::vector<G4int> > fFunctionLeaves; ///< Indices of leaves used by function
+    std::vector<Int_t>              fNdata;          ///< Number of instances of function for the loaded entry
+};
+
+#endif
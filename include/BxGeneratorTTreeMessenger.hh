@@ -8,6 +8,8 @@
 #ifndef BxGeneratorTTreeMessenger_h
 #define BxGeneratorTTreeMessenger_h 1
 
+#include "Rtypes.h"
+
 #include "G4UImessenger.hh"
 
 class BxGeneratorTTree;
@@ -35,14 +37,44 @@ class BxGeneratorTTreeMessenger: public G4UImessenger {
         
         void LogCmd(const G4String&, const G4String&, G4int, LogMode);
         
+        /// Parse 64-bit entry number or count, fatal if value is not a number
+        Long64_t ConvertToEntry(const G4String&, const G4String&);
+        
         BxGeneratorTTree*        fGenerator;
         G4UIdirectory*       	 fDirectory;
         G4UIcmdWithAString*  	 fAddTreeCmd;
 		G4UIcmdWithAString*  	 fSetAliasCmd;
-        G4UIcmdWithAnInteger*	 fFirstEntryCmd;
-        G4UIcmdWithAnInteger*	 fNEntriesCmd;
+        G4UIcmdWithAString*  	 fMetadataFileCmd;
+        G4UIcmdWithAString*  	 fFirstEntryCmd;
+        G4UIcmdWithAString*  	 fNEntriesCmd;
+        G4UIcmdWithAString*  	 fBeamOnCmd;
+        G4UIcmdWithAString*  	 fShardCmd;
         G4UIcmdWithABool*	     fLogPrimariesInfoCmd;
+        G4UIcmdWithAnInteger*	 fLogPrimariesEveryCmd;
+        G4UIcmdWithAString*  	 fTraceFileCmd;
         G4UIcmdWithABool*	     fSavePrimariesInfoCmd;
+        G4UIcmdWithAnInteger*	 fPrefetchDepthCmd;
+        G4UIcmdWithABool*	     fSharedReaderCmd;
+        G4UIcmdWithABool*	     fPruneBranchesCmd;
+        G4UIcmdWithAnInteger*	 fPoolSizeCmd;
+        G4UIcmdWithABool*	     fPoolRotateIsoCmd;
+        G4UIcmdWithAString*  	 fPoolTimeShiftCmd;
+        G4UIcmdWithAString*  	 fCoincidenceWindowCmd;
+        G4UIcmdWithAString*  	 fCoincidenceGateCmd;
+        G4UIcmdWithAString*  	 fSamplingWeightCmd;
+        G4UIcmdWithAString*  	 fSamplingDrawsCmd;
+        G4UIcmdWithAString*  	 fSamplingCacheDirCmd;
+        G4UIcmdWithAnInteger*	 fCacheSizeCmd;
+        G4UIcmdWithAString*  	 fWriteSnapshotCmd;
+        G4UIcmdWithAString*  	 fReadSnapshotCmd;
+        G4UIcmdWithAString*  	 fTruthFileCmd;
+        G4UIcmdWithAString*  	 fStatsCmd;
+        G4UIcmdWithABool*	     fStatsTimingCmd;
+        G4UIcmdWithAnInteger*	 fStatsEveryCmd;
+        G4UIcmdWithAString*  	 fSkipIndexDirCmd;
+        G4UIcmdWithAString*  	 fBackendCmd;
+        G4UIcmdWithAnInteger*	 fBackendCrossCheckCmd;
+        G4UIcmdWithAnInteger*	 fPrewarmIonsCmd;
         
         G4UIcmdWithAString*      fEventIdCmd;
         G4UIcmdWithAString*      fEventSkipCmd;
@@ -0,0 +1,60 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeSampler_h
+#define BxGeneratorTTreeSampler_h 1
+
+#include "Rtypes.h"
+
+#include "globals.hh"
+
+#include <vector>
+
+/**
+ *  Walker alias table over Tree(Chain) entries with non-negative weights.
+ *  Entry is drawn with probability proportional to its weight in O(1),
+ *  compensating weight of drawn entry is mean weight over the range divided by its weight,
+ *  so that weighted sums of drawn entries estimate sums over uniformly drawn entries.
+ */
+class BxGeneratorTTreeSampler {
+public:
+    BxGeneratorTTreeSampler();
+    ~BxGeneratorTTreeSampler();
+
+    /// Build table, nRange is the number of entries in range including entries with zero weight (not given)
+    void Build(const std::vector<Long64_t>& entries, const std::vector<Double_t>& weights, Long64_t nRange);
+
+    /// Read table from file, returns false if file is missing or made with other key
+    G4bool Load(const G4String& filename, const G4String& key);
+
+    /// Write table to file via BxGeneratorTTreeTmpFile, returns false if it is not written
+    G4bool Save(const G4String& filename, const G4String& key) const;
+
+    /// Index of drawn entry, u1 and u2 are independent uniform numbers in [0, 1)
+    size_t Draw(G4double u1, G4double u2) const {
+        size_t i = size_t(u1 * fEntries.size());
+        if (i >= fEntries.size()) i = fEntries.size() - 1;
+        return (u2 < fProbabilities[i]) ? i : size_t(fAliases[i]);
+    }
+
+    Long64_t GetEntry(size_t i)              const { return fEntries[i]; }
+    G4double GetCompensatingWeight(size_t i) const { return fTotalWeight / fNRange / fWeights[i]; }
+
+    size_t   GetSize()        const { return fEntries.size(); }
+    Long64_t GetNRange()      const { return fNRange; }
+    G4double GetTotalWeight() const { return fTotalWeight; }
+
+private:
+    std::vector<Long64_t> fEntries;       ///< Entries with positive weights
+    std::vector<Double_t> fWeights;       ///< Weights of entries
+    std::vector<Double_t> fProbabilities; ///< Probability to keep the entry of the column instead of its alias
+    std::vector<Long64_t> fAliases;       ///< Index of alias of the column
+    Long64_t              fNRange;        ///< Number of entries in range
+    G4double              fTotalWeight;
+};
+
+#endif
@@ -0,0 +1,112 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeSnapshot_h
+#define BxGeneratorTTreeSnapshot_h 1
+
+#include "BxGeneratorTTree.hh"
+
+#include <stdint.h>
+#include <fstream>
+#include <vector>
+
+/**
+ *  Flat binary file with evaluated primary particles of BxGeneratorTTree.
+ *  Layout: header, particle records of all entries one after another, entry index.
+ *  Energy of record is negative if kinetic energy has to be calculated from momentum magnitude
+ *  (see BxGeneratorTTree::FillBatchFromEntry), so file doesn't depend on particle table.
+ */
+namespace BxGeneratorTTreeSnapshot {
+    static const char     kMagic[8] = { 'B','x','T','T','S','n','a','p' };
+    static const uint32_t kVersion  = 2;
+
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t particleRecordSize;
+        uint32_t entryRecordSize;
+        uint32_t padding;
+        uint64_t nEntries;
+        uint64_t nParticles;
+        uint64_t particlesOffset; ///< Position of the first particle record in file
+        uint64_t entriesOffset;   ///< Position of the first entry record in file
+    };
+
+    struct ParticleRecord {
+        int32_t p_index;
+        int32_t status;
+        int32_t pdg_code;
+        int32_t padding;
+        double  energy;
+        double  momentum[3];
+        double  position[3];
+        double  time;
+        double  polarization[3];
+        double  weight;
+    };
+
+    struct EntryRecord {
+        int64_t  entry;
+        int64_t  event_id;
+        uint64_t firstParticle; ///< Index of the first particle record of entry
+        uint64_t nParticles;
+    };
+}
+
+/// Writes entries one by one, index and header are written by Close()
+class BxGeneratorTTreeSnapshotWriter {
+public:
+    BxGeneratorTTreeSnapshotWriter(const G4String& filename);
+    ~BxGeneratorTTreeSnapshotWriter();
+
+    void Write(const BxGeneratorTTree::EntryBatch& batch);
+    void Close();
+
+    uint64_t GetNEntries()   const { return fEntries.size(); }
+    uint64_t GetNParticles() const { return fNParticles; }
+
+private:
+    G4String                                              fFileName;
+    std::ofstream                                         fFile;
+    std::vector<BxGeneratorTTreeSnapshot::EntryRecord>    fEntries;
+    std::vector<BxGeneratorTTreeSnapshot::ParticleRecord> fRecords; ///< Buffer for records of single entry
+    uint64_t                                              fNParticles;
+};
+
+/// Memory-maps snapshot file and serves entries of the requested range
+class BxGeneratorTTreeSnapshotReader {
+public:
+    BxGeneratorTTreeSnapshotReader(const G4String& filename);
+    ~BxGeneratorTTreeSnapshotReader();
+
+    /// Serve entries with numbers in [first, first + n), n <= 0 means up to the end of file.
+    void SetRange(Long64_t first, Long64_t n);
+
+    /// Fill batch with the next entry. Returns false when range is over, endOfFile is set if there are no more entries in file.
+    G4bool Next(BxGeneratorTTree::EntryBatch& batch, G4bool& endOfFile);
+
+    uint64_t GetNEntries()   const { return fHeader->nEntries; }
+    uint64_t GetNParticles() const { return fHeader->nParticles; }
+
+    /// Number of entries not served yet in the requested range
+    uint64_t GetNEntriesLeft() const;
+    
+    /// Entry number of the last entry in file, -1 if file is empty
+    Long64_t GetLastEntry() const { return fHeader->nEntries ? fEntries[fHeader->nEntries - 1].entry : -1; }
+
+private:
+    G4String                                        fFileName;
+    void*                                           fMap;
+    size_t                                          fMapSize;
+    const BxGeneratorTTreeSnapshot::Header*         fHeader;
+    const BxGeneratorTTreeSnapshot::EntryRecord*    fEntries;
+    const BxGeneratorTTreeSnapshot::ParticleRecord* fParticles;
+    uint64_t                                        fCursor;  ///< Index of the next entry record
+    int64_t                                         fEndEntry; ///< Entries with numbers >= fEndEntry are not served
+};
+
+#endif
@@ -0,0 +1,81 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeStats_h
+#define BxGeneratorTTreeStats_h 1
+
+#include "Rtypes.h"
+
+#include "globals.hh"
+
+#include <time.h>
+
+/**
+ *  Counters and per-stage timers of BxGeneratorTTree.
+ *  Counters are always on, timers (monotonic clock) only if timing is switched on.
+ *  The object is not thread safe: each thread updates its own one, they are summed up with Add()
+ *  by BxGeneratorTTree under its mutex (reader stages kLoadTree and kEvaluate come from the reading thread).
+ */
+class BxGeneratorTTreeStats {
+public:
+    enum EStage {
+        kLoadTree, ///< TChain::LoadTree() or snapshot read
+        kEvaluate, ///< Evaluation of formulas and filling of particles of entry
+        kPull,     ///< Waiting for the next entry in event loop (includes reading without background reader)
+        kQueue,    ///< Time-ordered queue of particles
+        kGun,      ///< G4ParticleGun::GeneratePrimaryVertex()
+        kOutput,   ///< BxOutputVertex, log and truth writers
+        kNStages
+    };
+    enum ECounter {
+        kEntriesRead,    ///< Entries loaded from input
+        kEntriesSkipped, ///< Loaded entries without particles (event_skip_if, n_particles, particle_skip_if)
+        kEvents,         ///< Generated events
+        kParticles,      ///< Generated primary particles
+        kPostponed,      ///< Generated primary particles with non-zero stacking status
+        kNCounters
+    };
+
+    BxGeneratorTTreeStats();
+
+    void   SetTiming(G4bool on) { fTiming = on; }
+    G4bool IsTiming() const     { return fTiming; }
+
+    /// Start of timed stage, 0 if timing is off
+    Long64_t Start() const { return fTiming ? Now() : 0; }
+    /// End of timed stage started at start
+    void     Stop(EStage stage, Long64_t start) { if (fTiming) fTime[stage] += Now() - start; }
+    void     Count(ECounter counter, Long64_t n = 1) { fCount[counter] += n; }
+
+    Long64_t GetCount(ECounter counter) const { return fCount[counter]; }
+
+    /// Zero all counters and timers, rates are calculated from this moment
+    void   Reset();
+    /// Zero all counters and timers, start time is kept
+    void   Clear();
+    /// Add counters and timers of other, start time is the earlier one
+    void   Add(const BxGeneratorTTreeStats& other);
+    /// Write summary to log
+    void   Log() const;
+    /// Write "name value" lines to text file, returns false if file cannot be written
+    G4bool Dump(const G4String& filename) const;
+
+    /// Monotonic clock in ns
+    static Long64_t Now() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return Long64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+    }
+
+private:
+    G4bool   fTiming;
+    Long64_t fStartTime;
+    Long64_t fTime[kNStages];    ///< Time of stages in ns
+    Long64_t fCount[kNCounters];
+};
+
+#endif
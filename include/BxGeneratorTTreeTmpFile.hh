@@ -0,0 +1,39 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeTmpFile_h
+#define BxGeneratorTTreeTmpFile_h 1
+
+#include "globals.hh"
+
+/**
+ *  Temporary file next to cache file (chain metadata, skip index, shard plan, alias table).
+ *  It is written first and renamed to the cache file by Commit(), so that concurrent jobs never see
+ *  partially written file. Its name has host name and pid, so jobs on different nodes of a shared
+ *  filesystem don't write the same file. It is removed if it is not committed.
+ */
+class BxGeneratorTTreeTmpFile {
+public:
+    explicit BxGeneratorTTreeTmpFile(const G4String& filename);
+    ~BxGeneratorTTreeTmpFile();
+
+    /// Name of temporary file to be written
+    const G4String& GetName() const { return fTmpName; }
+
+    /// Rename temporary file to the cache file if it is written, otherwise remove it. Returns true if the file is published.
+    G4bool Commit(G4bool written);
+
+private:
+    BxGeneratorTTreeTmpFile(const BxGeneratorTTreeTmpFile&);
+    BxGeneratorTTreeTmpFile& operator=(const BxGeneratorTTreeTmpFile&);
+
+    G4String fFileName;
+    G4String fTmpName;
+    G4bool   fIsDone;
+};
+
+#endif
@@ -0,0 +1,124 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxGeneratorTTreeTruth_h
+#define BxGeneratorTTreeTruth_h 1
+
+#include "BxGeneratorTTree.hh"
+
+#include <vector>
+#include <fstream>
+
+class TFile;
+class TTree;
+class TThread;
+template <class T> class BxRingBuffer;
+
+/// Primary particles of single G4 event
+struct BxGeneratorTTreeTruthEvent {
+    G4int                                       g4event;
+    Long64_t                                    entry;
+    std::vector<BxGeneratorTTree::ParticleInfo> particles;
+
+    BxGeneratorTTreeTruthEvent() : g4event(-1), entry(-1), particles() {}
+    void swap(BxGeneratorTTreeTruthEvent& other) { std::swap(g4event, other.g4event); std::swap(entry, other.entry); particles.swap(other.particles); }
+};
+
+/**
+ *  Base of writers of primaries which work in background thread.
+ *  Event loop thread only copies particles of event to recycled batch and queues it.
+ */
+class BxGeneratorTTreeEventSink {
+public:
+    virtual ~BxGeneratorTTreeEventSink();
+
+    /// Queue particles of G4 event. Blocks only if writer is depth events behind.
+    void Write(G4int g4event, Long64_t entry, const std::vector<BxGeneratorTTree::ParticleInfo>& particles);
+
+    /// Write all queued events and finish output. Must be called by destructor of derived class.
+    void Close();
+
+protected:
+    BxGeneratorTTreeEventSink();
+
+    /// Start writer thread, depth is the number of events which can wait to be written
+    void Start(const char* name, G4int depth);
+
+    /// Write single event, called from writer thread only
+    virtual void WriteEvent(const BxGeneratorTTreeTruthEvent& event) = 0;
+
+    /// Finish output, called after writer thread is over
+    virtual void Finish() = 0;
+
+private:
+    void Run();
+    static void* ThreadFunction(void* sink);
+
+    BxRingBuffer<BxGeneratorTTreeTruthEvent>* fBuffer;
+    TThread*                                  fThread;
+    BxGeneratorTTreeTruthEvent                fBatch;   ///< Recycled batch of the event thread
+};
+
+/**
+ *  Writes truth of generated primary particles to separate ROOT file in background thread.
+ *  Tree "truth" has one row per primary particle (flat branches of basic types),
+ *  tree "truth_index" has one row per G4 event with its input entry and rows of its particles in "truth",
+ *  so that truth can be joined with MC output by G4 event number without reading either of them as a whole.
+ *  Units: energy in MeV, position in m, time in ns.
+ */
+class BxGeneratorTTreeTruthWriter : public BxGeneratorTTreeEventSink {
+public:
+    /// File is created at once, depth is the number of events which can wait to be written
+    BxGeneratorTTreeTruthWriter(const G4String& filename, G4int depth);
+    virtual ~BxGeneratorTTreeTruthWriter();
+
+protected:
+    virtual void WriteEvent(const BxGeneratorTTreeTruthEvent& event);
+    virtual void Finish();
+
+private:
+    G4String fFileName;
+    TFile*   fFile;
+    TTree*   fTruth;
+    TTree*   fIndex;
+
+    // addresses of branches, used by writer thread only
+    Int_t    fG4Event;
+    Long64_t fEntry;
+    Int_t    fEventId;
+    Int_t    fPIndex;
+    Int_t    fStatus;
+    Int_t    fPdg;
+    Double_t fEnergy;
+    Double_t fDirection[3];
+    Double_t fPosition[3];
+    Double_t fTime;
+    Double_t fWeight;
+    Long64_t fFirstRow; ///< Row of the first particle of event in "truth"
+    Int_t    fNRows;    ///< Number of particles of event
+};
+
+/**
+ *  Writes primaries of traced events to text file in background thread,
+ *  in the same format as primaries info of trace log, so that tracing doesn't slow down the event loop.
+ */
+class BxGeneratorTTreeTraceWriter : public BxGeneratorTTreeEventSink {
+public:
+    BxGeneratorTTreeTraceWriter(const G4String& filename, G4int depth);
+    virtual ~BxGeneratorTTreeTraceWriter();
+
+protected:
+    virtual void WriteEvent(const BxGeneratorTTreeTruthEvent& event);
+    virtual void Finish();
+
+private:
+    G4String      fFileName;
+    std::ofstream fFile;
+    Long64_t      fNEvents;
+};
+
+#endif
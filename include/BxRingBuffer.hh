@@ -0,0 +1,95 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#ifndef BxRingBuffer_h
+#define BxRingBuffer_h 1
+
+#include "TMutex.h"
+#include "TCondition.h"
+
+#include "globals.hh"
+
+#include <vector>
+
+/**
+ *  Bounded circular buffer for handing objects between threads.
+ *  Items are exchanged with the slots by T::swap(), so containers inside T keep
+ *  their capacity and are recycled instead of being reallocated for every item.
+ *  Push() blocks while the buffer is full, Pop() blocks while it is empty.
+ *  After Close() both return false as soon as nothing is left to exchange.
+ */
+template <class T>
+class BxRingBuffer {
+public:
+    explicit BxRingBuffer(size_t capacity)
+    : fSlots(capacity > 0 ? capacity : 1)
+    , fHead(0)
+    , fCount(0)
+    , fClosed(false)
+    , fMutex()
+    , fNotEmpty(&fMutex)
+    , fNotFull(&fMutex)
+    {}
+
+    ~BxRingBuffer() {}
+
+    /// Move item into the buffer, item gets the recycled content of the slot. Returns false if buffer is closed.
+    G4bool Push(T& item) {
+        fMutex.Lock();
+        while (fCount == fSlots.size() && !fClosed) fNotFull.Wait();
+        if (fClosed) {
+            fMutex.UnLock();
+            return false;
+        }
+        fSlots[(fHead + fCount) % fSlots.size()].swap(item);
+        ++fCount;
+        fNotEmpty.Signal();
+        fMutex.UnLock();
+        return true;
+    }
+
+    /// Move the oldest item out of the buffer. Returns false if buffer is closed and empty.
+    G4bool Pop(T& item) {
+        fMutex.Lock();
+        while (fCount == 0 && !fClosed) fNotEmpty.Wait();
+        if (fCount == 0) {
+            fMutex.UnLock();
+            return false;
+        }
+        fSlots[fHead].swap(item);
+        fHead = (fHead + 1) % fSlots.size();
+        --fCount;
+        fNotFull.Signal();
+        fMutex.UnLock();
+        return true;
+    }
+
+    /// No more items will be pushed. Wakes up all waiting threads.
+    void Close() {
+        fMutex.Lock();
+        fClosed = true;
+        fNotEmpty.Broadcast();
+        fNotFull.Broadcast();
+        fMutex.UnLock();
+    }
+
+    size_t GetCapacity() const { return fSlots.size(); }
+
+private:
+    BxRingBuffer(const BxRingBuffer&);
+    BxRingBuffer& operator=(const BxRingBuffer&);
+
+    std::vector<T> fSlots;
+    size_t         fHead;   ///< Index of the oldest item
+    size_t         fCount;  ///< Number of items in buffer
+    G4bool         fClosed;
+    TMutex         fMutex;
+    TCondition     fNotEmpty;
+    TCondition     fNotFull;
+};
+
+#endif
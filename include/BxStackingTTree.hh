@@ -20,10 +20,13 @@
 #include <bitset>
 #include <set>
 #include <map>
+#include <vector>
+#include <algorithm>
 
 class BxGeneratorTTree;
 class BxStackingTTreeMessenger;
 class G4Track;
+class G4VProcess;
 
 //
 /** This is the base class of one of the user's optional action classes.
@@ -104,18 +107,108 @@ public: // with description
     //---------------------------------------------------------------
     //
     
-    void SetMode(size_t pos, G4bool val) { fMode.set(pos,val); }
-    void SetMode(G4bool val) { val ? fMode.set() : fMode.reset(); }
+    /// Classification of tracks matched by rule
+    enum ERuleAction {
+        kUrgent,   ///< Track is tracked in current event
+        kWaiting,  ///< Track is tracked in current event after urgent ones
+        kKill,     ///< Track is killed
+        kPostpone  ///< Track is killed and generated by BxGeneratorTTree as primary of the next event
+    };
+    
+    void SetMode(size_t pos, G4bool val) { fMode.set(pos,val); fRulesChanged = true; }
+    void SetMode(G4bool val) { val ? fMode.set() : fMode.reset(); fRulesChanged = true; }
+    
+    void SetKillMode(size_t pos, G4bool val) { fKillMode.set(pos,val); fRulesChanged = true; }
+    void SetKillMode(G4bool val) { val ? fKillMode.set() : fKillMode.reset(); fRulesChanged = true; }
     
-    void SetKillMode(size_t pos, G4bool val) { fKillMode.set(pos,val); }
-    void SetKillMode(G4bool val) { val ? fKillMode.set() : fKillMode.reset(); }
+    void AddParticleToBlackList(G4int pdg_code) { fBlackListPdg.insert(pdg_code); fRulesChanged = true; }
+    /// Particle names with wildcards '*' and '?', expanded over particle table when rules are compiled
+    void AddParticlePatternToBlackList(const G4String& pattern) { fBlackListParticlePatterns.insert(pattern); fRulesChanged = true; }
+    /// Ions (PDG codes 100ZZZAAAI) with Z (or A if isZ is false) in [min, max]
+    void AddIonRangeToBlackList(G4bool isZ, G4int min, G4int max);
+    /// Process names, may have wildcards '*' and '?', expanded over process table when rules are compiled
+    void AddProcessToBlackList(const G4String& processName) { fBlackListProcess.insert(processName); fRulesChanged = true; }
     
-    void AddParticleToBlackList(G4int pdg_code) { fBlackListPdg.insert(pdg_code); }
-    void AddProcessToBlackList(const G4String& processName) { fBlackListProcess.insert(processName); }
+    /// User rule for tracks created by process, for all particles if allParticles. Rules are applied in order they are added, before modes
+    void AddRule(const G4String& processName, G4int pdg_code, G4bool allParticles, ERuleAction action, G4int status);
+    
+    /**
+     *  Biasing of tracks created by process ("all" for any process) with kinetic energy in [eMin, eMax):
+     *  Russian roulette if probability < 1 (weight of survivors is divided by probability) and
+     *  splitting into nSplit tracks with weight divided by nSplit if nSplit > 1.
+     *  Only the first matching biasing is applied, after rules and modes, to tracks which are not killed or postponed
+     */
+    void AddBiasing(const G4String& processName, G4int pdg_code, G4bool allParticles, G4double eMin, G4double eMax, G4double probability, G4int nSplit);
     
 private:
-    G4int GetPrimaryParentID(G4int trackID);
-    void PostponeTrack(const G4Track* aTrack, G4int status);
+    /// Extra condition of rule, besides creator process and particle
+    enum ERuleCondition {
+        kAlways,
+        kParentTimeNotNegative,  ///< Parent of track has global time >= 0
+        kMuCaptureDecayElectron, ///< Electron from decay in orbit of mu- (not Auger one)
+        kMuCaptureNuclear,       ///< Product of nuclear capture of mu-
+        kMuPlusDecayPositron     ///< Positron from decay of mu+ at rest
+    };
+    struct Rule {
+        G4int condition;
+        G4int action;
+        G4int status;
+    };
+    struct UserRule {
+        G4String process;
+        G4int    pdg;
+        G4bool   allParticles;
+        Rule     rule;
+    };
+    struct Biasing {
+        G4double eMin;
+        G4double eMax;
+        G4double probability; ///< Survival probability of Russian roulette
+        G4int    nSplit;      ///< Number of tracks after splitting
+    };
+    struct UserBiasing {
+        G4String process;
+        G4int    pdg;
+        G4bool   allParticles;
+        Biasing  biasing;
+    };
+    
+    /// Resolve process names of rules and modes into table of rules indexed by (process id, particle class)
+    void  CompileRules();
+    G4int ProcessId(const G4String& processName, G4bool create);
+    void  AddCompiledRule(G4int process, G4int particleClass, G4int condition, G4int action, G4int status);
+    void  CompileBlackList();
+    G4bool IsBlackListed(G4int pdg_code) const {
+        if (pdg_code > -kPdgBitsHalf && pdg_code < kPdgBitsHalf) return fKilledPdgs.test(pdg_code + kPdgBitsHalf);
+        if (pdg_code >= 1000000000 && fHasIonRanges) {
+            const G4int Z = (pdg_code / 10000) % 1000;
+            const G4int A = (pdg_code / 10) % 1000;
+            if (fKilledIonZ.test(Z) || fKilledIonA.test(A)) return true;
+        }
+        return std::binary_search(fKilledLargePdgs.begin(), fKilledLargePdgs.end(), pdg_code);
+    }
+    G4int GetProcessId(const G4VProcess* process) const;
+    G4int GetParticleClass(G4int pdg_code) const;
+    G4bool TestCondition(G4int condition, const G4Track* aTrack);
+    G4ClassificationOfNewTrack ApplyBiasing(const G4Track* aTrack, const std::vector<Biasing>& biasings, G4ClassificationOfNewTrack classification);
+    
+
+    /// Track of current event, slot of arena is free if primaryID == 0
+    struct TrackRecord {
+        G4int    parentID;
+        G4int    primaryID; ///< ID of primary track the track comes from, resolved when track is recorded, -1 if unknown
+        G4int    pdg;
+        G4double time;      ///< Global time
+    };
+    
+    void               RecordTrack(const G4Track* aTrack, G4int pdg_code);
+    const TrackRecord* FindTrack(G4int trackID) const {
+        return (trackID > 0 && trackID < G4int(fTracks.size()) && fTracks[trackID].primaryID != 0) ? &fTracks[trackID] : 0;
+    }
+    /// ID of primary track the track comes from, -1 if it is unknown (e.g. track or its parent is not recorded)
+    G4int GetPrimaryParentID(G4int trackID) const;
+    /// Push track to the generator as particle of the next events. Returns false if its primary is unknown.
+    G4bool PostponeTrack(const G4Track* aTrack, G4int status);
     
 private:
     BxGeneratorTTree*         fGenerator;
@@ -124,12 +217,38 @@ private:
     std::bitset<4>            fMode; //[0] - gamma from neutron capture, [1] - radioactive decay, [2] - muon decay, [3] - decay
     std::bitset<4>            fKillMode; //[0] - gamma from neutron capture, [1] - radioactive decay, [2] - muon decay, [3] - decay
     std::set<G4int>           fBlackListPdg;
+    std::set<G4String>        fBlackListParticlePatterns;
     std::set<G4String>        fBlackListProcess;
+    
+    // Compiled black list of particles: PDG codes with |code| < kPdgBitsHalf are bits, the others are in sorted vector,
+    // ions are also matched by their Z and A
+    static const G4int        kPdgBitsHalf = 1 << 15;
+    std::bitset<2*kPdgBitsHalf> fKilledPdgs;
+    std::vector<G4int>        fKilledLargePdgs;
+    std::bitset<1000>         fKilledIonZ;
+    std::bitset<1000>         fKilledIonA;
+    G4bool                    fHasIonRanges;
     G4double                  fEkinMaxMuonDecay;
     
-    std::map<G4int, G4int>    fTrackParentIDs; // <TrackID, ParentID>
-    std::map<G4int, G4int>    fTrackPDGs;      // <TrackID, PDGEncoding>
-    std::map<G4int, G4double> fTrackTimes;     // <TrackID, GlobalTime>
+    // Compiled rules: process id 0 is for processes without rules, particle class 0 is for particles without own rules
+    std::vector<UserRule>             fUserRules;
+    G4bool                            fRulesChanged;
+    G4bool                            fHasRules;
+    std::map<G4String, G4int>         fProcessIds;        // <ProcessName, process id>
+    std::vector<G4int>                fSubTypeProcessIds; // process id by process subtype, negative if subtype is shared by processes with different ids
+    std::vector<G4bool>               fProcessKilled;     // by process id, from process black list
+    std::vector<G4int>                fParticleClassPdgs; // sorted PDG codes with own particle class (index + 1)
+    std::vector< std::vector<Rule> >  fRules;             // [process id * number of particle classes + particle class]
+    std::vector<UserBiasing>          fUserBiasings;
+    std::vector< std::vector<Biasing> > fBiasings;        // same index as fRules
+    G4bool                            fHasBiasing;
+    G4bool                            fUnknownPrimaryWarned; // tracks with unknown primary are not postponed, warning is given once
+    G4bool                            fIsSplitting;       // copies of split track are being stacked
+    G4ClassificationOfNewTrack        fSplitClassification;
+    
+    // Track IDs are dense in event, so tracks are stored by ID; arena is kept between events, only used slots are freed
+    std::vector<TrackRecord>  fTracks;
+    G4int                     fMaxTrackID;     // Highest recorded track ID of current event
     
     struct MuMinusHelper {
         G4int    parentID;
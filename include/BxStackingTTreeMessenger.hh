@@ -32,6 +32,9 @@ class BxStackingTTreeMessenger: public G4UImessenger {
         G4UIcmdWithAString*  	      fModeCmd;
         G4UIcmdWithAString*           fBlackListParticleCmd;
         G4UIcmdWithAString*           fBlackListProcessCmd;
+        G4UIcmdWithAString*           fRuleCmd;
+        G4UIcmdWithAString*           fRouletteCmd;
+        G4UIcmdWithAString*           fSplitCmd;
 };
 
 #endif
\ No newline at end of file
@@ -7,16 +7,39 @@
 
 #include "TTreeFormula.h"
 #include "TTreeFormulaManager.h"
+#include "TThread.h"
+#include "TMutex.h"
+#include "TCondition.h"
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "TList.h"
+#include "TStopwatch.h"
+#include "TChainElement.h"
+#include "TEntryList.h"
+#include "TFile.h"
+#include "TMD5.h"
+#include "TSystem.h"
+#include "TROOT.h"
+#include "RVersion.h"
 
 #include "BxGeneratorTTree.hh"
 #include "BxOutputVertex.hh"
 #include "BxVGenerator.hh"
 #include "BxGeneratorTTreeMessenger.hh"
 #include "BxLogger.hh"
-#include "BxManager.hh"
 #include "BxReadParameters.hh"
+#include "BxRingBuffer.hh"
+#include "BxGeneratorTTreeSnapshot.hh"
+#include "BxGeneratorTTreeJit.hh"
+#include "BxGeneratorTTreeSampler.hh"
+#include "BxGeneratorTTreeTruth.hh"
+#include "BxGeneratorTTreeTmpFile.hh"
 
 #include "G4Event.hh"
+#include "G4RunManager.hh"
+#include "G4Run.hh"
+#include "G4AutoLock.hh"
+#include "G4Threading.hh"
 #include "G4PrimaryVertex.hh"
 #include "G4ParticleDefinition.hh"
 #include "G4ParticleTable.hh"
@@ -29,21 +52,132 @@
 #include "G4PrimaryParticle.hh"
 #include "G4PhysicalConstants.hh"
 #include "Randomize.hh"
+#include "CLHEP/Random/JamesRandom.h"
 
 #include <algorithm>
 #include <sstream>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <climits>
+
+namespace {
+    /// ROOT is made thread safe once, before the first thread of any generator (worker, reader, prewarm, writer) touches it
+    void EnableRootThreadSafety() {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+        static G4Mutex mutex     = G4MUTEX_INITIALIZER;
+        static G4bool  isEnabled = false;
+        G4AutoLock lock(&mutex);
+        if (!isEnabled) ROOT::EnableThreadSafety();
+        isEnabled = true;
+#endif
+    }
+    
+    /// Reader shared by generators of all worker threads, see BxGeneratorTTree::SetSharedReader().
+    /// Its state is guarded by the mutex, the condition is signalled when the reader is done or a generator leaves.
+    /// Both are created on first use, so that they don't depend on the order of static initialization of ROOT.
+    TMutex&     SharedReaderMutex()     { static TMutex mutex; return mutex; }
+    TCondition& SharedReaderCondition() { static TCondition condition(&SharedReaderMutex()); return condition; }
+    BxGeneratorTTree*                        gSharedReaderOwner  = 0; ///< Generator whose thread reads the Tree(Chain)
+    BxRingBuffer<BxGeneratorTTree::EntryBatch>* gSharedReaderBuffer = 0;
+    G4int                                    gSharedReaderUsers  = 0; ///< Number of generators attached to the buffer
+    G4bool                                   gSharedReaderDone   = false; ///< Reader has pushed the whole input to the buffer
+    
+    /// Reader stats of generators and stats published by worker generators for the master
+    G4Mutex                                  gStatsMutex = G4MUTEX_INITIALIZER;
+    std::map<G4int, BxGeneratorTTreeStats>   gThreadStats; ///< Stats of worker generators by thread id
+    
+    /// In worker threads file name gets suffix "_t<thread id>" before extension, so that each worker writes its own file
+    G4String ThreadFileName(const G4String& filename) {
+        if (!G4Threading::IsWorkerThread()) return filename;
+        size_t dot = filename.rfind('.');
+        const size_t slash = filename.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = filename.size();
+        G4String result = filename;
+        result.insert(dot, TString::Format("_t%d", G4Threading::G4GetThreadId()).Data());
+        return result;
+    }
+}
 
 BxGeneratorTTree::BxGeneratorTTree()
 : BxVGenerator("BxGeneratorTTree")
 , fCurrentEntry(-1)
+, fReadEntry(-1)
 , fFirstEntry(0)
 , fLastEntry(0)
 , fNEntries(0)
 , fIsInitialized(false)
 , fLogPrimariesInfo(true)
+, fLogPrimariesEvery(1)
 , fSavePrimariesInfo(true)
-, fDequeParticleInfo()
+, fUseOutputVertex(true)
+, fMixedWeightsWarned(false)
+, fEndOfChain(false)
+, fEndOfInput(false)
+, fCountEvents(false)
+, fNEvents(-1)
+, fNGeneratedEvents(0)
+, fNPulledEntries(0)
+, fPrefetchDepth(0)
+, fSharedReader(false)
+, fPruneBranches(false)
+, fCacheSize(0)
+, fCacheBranches()
+, fSnapshotFileName()
+, fSnapshotReader(0)
+, fTruthFileName()
+, fTruthWriter(0)
+, fTraceFileName()
+, fTraceWriter(0)
+, fStats()
+, fReaderStats()
+, fReaderTotals()
+, fStatsEvery(0)
+, fSkipIndexDir()
+, fUseSkipIndex(false)
+, fAcceptedEntries()
+, fSkipIndexCursor(0)
+, fJitBackend(false)
+, fCrossCheckEntries(0)
+, fCrossCheckMismatches(0)
+, fPrewarmThreads(0)
+, fShardIndex(0)
+, fNShards(0)
+, fShardPlanFile()
+, fChainFiles()
+, fMetadataFileName()
+, fSamplingWeight()
+, fSamplingDraws(0)
+, fSamplingCacheDir()
+, fSampler(0)
+, fSamplingEngine(0)
+, fSamplingSeed(0)
+, fNDrawn(0)
+, fSampledEntries()
+, fSampleCursor(0)
+, fEntryWeight(1.)
+, fPoolSize(0)
+, fPoolRotateIso(true)
+, fPoolTimeShift(0.)
+, fPoolCursor(0)
+, fPoolCycle(0)
+, fPoolEventIdStride(0)
+, fPoolMaxEventId(0)
+, fCoincidenceWindow(0.)
+, fCoincidenceGate(-1.)
+, fPostponedTimeOffset(0.)
+, fDefinitions()
+, fParticleQueue()
 , fCurrentParticlesInfo()
+, fEntryBatch()
+, fPool()
+, fColumns(SubEventConfigTTF::kNFormulas)
+, fMomentumMag()
+, fScalars(SubEventConfigTTF::kNFormulas, 0.)
+, fRandoms()
+, fPrefetchBuffer(0)
+, fPrefetchThread(0)
+, fPrefetchEngine(0)
 {
     fTreeChain = new TChain();
     
@@ -60,14 +194,107 @@ BxGeneratorTTree::BxGeneratorTTree()
 }
 
 BxGeneratorTTree::~BxGeneratorTTree() {
+    if (fSharedReader && fIsInitialized) ReleaseSharedReader();
+    else StopPrefetch();
+    delete fTruthWriter;
+    delete fTraceWriter;
     delete fMessenger;
     delete fParticleGun;
     delete fEventConfigTTF;
     delete fTreeChain;
+    delete fSnapshotReader;
+    delete fSampler;
+    delete fSamplingEngine;
+}
+
+void BxGeneratorTTree::AddTree(const G4String& treename, const G4String& filename, Long64_t nEntries) {
+    // files are added to the chain by BuildChain() at initialization, when entry counts are known
+    ChainFile file;
+    file.treename = treename;
+    file.filename = filename;
+    file.nEntries = nEntries;
+    fChainFiles.push_back(file);
+}
+
+void BxGeneratorTTree::ReadMetadata(std::map<std::string, FileMetadata>& metadata) const {
+    std::ifstream file(fMetadataFileName.data());
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        FileMetadata m;
+        std::string key;
+        if (!(ss >> m.size >> m.mtime >> m.nEntries)) continue;
+        std::getline(ss >> std::ws, key);
+        if (!key.empty()) metadata[key] = m;
+    }
 }
 
-void BxGeneratorTTree::AddTree(const G4String& treename, const G4String& filename) {
-    fTreeChain->Add( (filename + "/" + treename).data() );
+void BxGeneratorTTree::WriteMetadata(const std::map<std::string, FileMetadata>& metadata) const {
+    BxGeneratorTTreeTmpFile tmpFile(fMetadataFileName);
+    std::ofstream file(tmpFile.GetName().data());
+    file << "# BxGeneratorTTree chain metadata: file size, modification time, number of entries, file/tree\n";
+    for (std::map<std::string, FileMetadata>::const_iterator it = metadata.begin(); it != metadata.end(); ++it) {
+        file << it->second.size << " " << it->second.mtime << " " << it->second.nEntries << " " << it->first << "\n";
+    }
+    file.close();
+    if (!tmpFile.Commit(bool(file))) BxLog(warning) << "Cannot write chain metadata to \"" << fMetadataFileName << "\"" << endlog;
+}
+
+Long64_t BxGeneratorTTree::CountEntries(const G4String& treename, const G4String& filename) {
+    TFile* file = TFile::Open(filename.data(), "READ");
+    TTree* tree = (file && !file->IsZombie()) ? dynamic_cast<TTree*>(file->Get(treename.data())) : 0;
+    const Long64_t n = tree ? tree->GetEntries() : -1;
+    delete file;
+    return n;
+}
+
+void BxGeneratorTTree::BuildChain() {
+    std::map<std::string, FileMetadata> metadata;
+    if (!fMetadataFileName.empty()) ReadMetadata(metadata);
+    
+    G4int nGiven = 0, nCached = 0, nCounted = 0, nUnknown = 0;
+    G4bool isChanged = false;
+    for (size_t i = 0; i < fChainFiles.size(); ++i) {
+        const ChainFile& chainFile = fChainFiles[i];
+        const std::string path = chainFile.filename + "/" + chainFile.treename;
+        Long64_t n = chainFile.nEntries;
+        
+        // wildcards are expanded by TChain::Add, such files are never cached
+        const G4bool isPattern = chainFile.filename.find_first_of("*?[") != std::string::npos;
+        FileStat_t stat;
+        if (n >= 0) {
+            ++nGiven;
+        } else if (!fMetadataFileName.empty() && !isPattern && gSystem->GetPathInfo(chainFile.filename.data(), stat) == 0) {
+            std::map<std::string, FileMetadata>::const_iterator it = metadata.find(path);
+            if (it != metadata.end() && it->second.size == Long64_t(stat.fSize) && it->second.mtime == Long64_t(stat.fMtime)) {
+                n = it->second.nEntries;
+                ++nCached;
+            } else if ((n = CountEntries(chainFile.treename, chainFile.filename)) >= 0) {
+                FileMetadata& m = metadata[path];
+                m.size     = stat.fSize;
+                m.mtime    = stat.fMtime;
+                m.nEntries = n;
+                isChanged  = true;
+                ++nCounted;
+            }
+        }
+        
+        if (n < 0) {
+            ++nUnknown;
+            fTreeChain->Add(path.data());
+        } else if (n > 0) {
+            fTreeChain->Add(path.data(), n);
+        } else {
+            BxLog(routine) << "File \"" << chainFile.filename << "\" has no entries in TTree \"" << chainFile.treename << "\", it is not added" << endlog;
+        }
+    }
+    fChainFiles.clear();
+    
+    if (isChanged) WriteMetadata(metadata);
+    BxLog(routine) << "Tree(Chain) is built: entry counts of " << nGiven << " files are given, " << nCached << " are taken from metadata, "
+                   << nCounted << " are counted, " << nUnknown << " are unknown" << endlog;
+    if (nUnknown) BxLog(routine) << "Files with unknown entry counts are opened at initialization to count entries" << endlog;
 }
 
 void BxGeneratorTTree::SetAlias(const G4String& alias, const G4String& expression) {
@@ -76,175 +303,1282 @@ void BxGeneratorTTree::SetAlias(const G4String& alias, const G4String& expressio
 
 void BxGeneratorTTree::Initialize() {
     BxLog(routine) << "BxGeneratorTTree initialization started" << endlog;
+    EnableRootThreadSafety();
+    fStats.Reset(); // before background threads are started
+    fReaderStats.Reset();
+    fReaderTotals.Reset();
     
-    G4int loadTree0 = fTreeChain->LoadTree(0);
-    if (loadTree0 == -1) {
-        BxLog(warning) << "Tree(Chain) is empty! Be sure that exact numeric values are used for variables or it'll be crash" << endlog;
+    if (fSharedReader) {
+        // The first generator opens the input and starts the background reader,
+        // generators of other threads just take entries from its buffer one by one.
+        TLockGuard lock(&SharedReaderMutex());
+        ++gSharedReaderUsers;
+        if (!gSharedReaderBuffer) {
+            if (fPrefetchDepth <= 0) fPrefetchDepth = 1;
+            gSharedReaderDone = false;
+            InitializeReader();
+            gSharedReaderOwner  = this;
+            gSharedReaderBuffer = fPrefetchBuffer;
+            BxLog(routine) << "BxGeneratorTTree: input is read for all threads by this generator" << endlog;
+        } else {
+            fPrefetchBuffer = gSharedReaderBuffer;
+            BxLog(routine) << "BxGeneratorTTree: entries are taken from the shared reader" << endlog;
+        }
+    } else {
+        InitializeReader();
+    }
+    
+    // BxOutputVertex of g4bx2 is one object for the whole process, so only the master (or sequential) generator fills it
+    fUseOutputVertex = !G4Threading::IsWorkerThread();
+    if (!fUseOutputVertex && fSavePrimariesInfo) {
+        BxLog(warning) << "BxOutputVertex is shared by all threads, primaries info is not saved by generators of worker threads, use /bx/generator/ttree/truth_file" << endlog;
+    }
+    
+    if (!fTruthFileName.empty()) fTruthWriter = new BxGeneratorTTreeTruthWriter(ThreadFileName(fTruthFileName), 256);
+    if (!fTraceFileName.empty() && fLogPrimariesInfo) fTraceWriter = new BxGeneratorTTreeTraceWriter(ThreadFileName(fTraceFileName), 256);
+    
+    fIsInitialized = true;
+    
+    BxLog(routine) << "BxGeneratorTTree initialized" << endlog;
+}
+
+void BxGeneratorTTree::InitializeReader() {
+    if (!fSnapshotFileName.empty()) {
+        fSnapshotReader = new BxGeneratorTTreeSnapshotReader(fSnapshotFileName);
+        fSnapshotReader->SetRange(fFirstEntry, fNEntries);
+        BxLog(routine) << "Primaries are replayed from snapshot \"" << fSnapshotFileName << "\" with "
+                       << fSnapshotReader->GetNEntries() << " entries and " << fSnapshotReader->GetNParticles() << " particles" << endlog;
+        if (fPoolSize > 0) SetupPool();
+        if (fCountEvents) fNEvents = fSnapshotReader->GetNEntriesLeft();
+        
+        if (fPrefetchDepth > 0) StartPrefetch();
+        return;
     }
     
+    BuildChain();
+    
+    // files with known entry counts are not opened here
     fLastEntry = fTreeChain->GetEntries() - 1;
-    if (fFirstEntry > fLastEntry && loadTree0 != -1) {
+    if (fFirstEntry > fLastEntry && fLastEntry >= 0) {
         BxLog(error) << "First entry " << fFirstEntry << " > max possible entry " << fLastEntry << " for given Tree(Chain)" << endlog;
         BxLog(fatal) << "FATAL " << endlog;
     }
-    fCurrentEntry += fFirstEntry;
     if (fNEntries <= 0) fNEntries = fLastEntry - fFirstEntry + 1;
     
-    fEventConfigTTF->Initialize();
+    // saved shard plan narrows the range before formulas are set up on the first file of the range,
+    // so that the job opens only files of its own shard
+    const G4bool isShardSet = fLastEntry >= 0 && fNShards > 0 && SetupShard(false);
+    
+    Long64_t loadFirst = fTreeChain->LoadTree(std::max(Long64_t(0), std::min(fFirstEntry, fLastEntry)));
+    if (loadFirst == -1) {
+        BxLog(warning) << "Tree(Chain) is empty! Be sure that exact numeric values are used for variables or it'll be crash" << endlog;
+    }
+    
+    fEventConfigTTF->Initialize(fJitBackend);
     fEventConfigTTF->Log();
     
-    fIsInitialized = true;
+    // shard narrows [fFirstEntry, fFirstEntry + fNEntries), so it goes before any use of the range
+    if (loadFirst != -1 && fNShards > 0 && !isShardSet) SetupShard(true);
+    fCurrentEntry += fFirstEntry;
+    fReadEntry += fFirstEntry;
     
-    BxLog(routine) << "BxGeneratorTTree initialized" << endlog;
+    // weights are evaluated before branches not used by generator formulas are disabled
+    if (loadFirst != -1 && !fSamplingWeight.empty()) SetupSampling();
+    if (loadFirst != -1) SetupBranches();
+    if (loadFirst != -1 && !fSkipIndexDir.empty() && !fSampler) SetupSkipIndex(); // sampling already drops skipped entries
+    // cache is set for the range left after shard, sampling and skip index
+    if (loadFirst != -1 && fCacheSize > 0) SetupCache();
+    if (loadFirst != -1 && fPrewarmThreads > 0) PrewarmIons();
+    if (fPoolSize > 0) SetupPool();
+    // events are counted before background reader starts to use the chain
+    if (fCountEvents) fNEvents = (loadFirst != -1) ? CountEvents() : fNEntries;
+    
+    if (fPrefetchDepth > 0) StartPrefetch();
+}
+
+void BxGeneratorTTree::SetupBranches() {
+    std::vector<TTreeFormula*> formulas;
+    fEventConfigTTF->GetFormulas(formulas);
+    
+    std::set<std::string> branches;
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        for (Int_t j = 0; j < formulas[i]->GetNcodes(); ++j) {
+            TLeaf* leaf = formulas[i]->GetLeaf(j);
+            if (leaf) CollectBranch(leaf->GetBranch(), branches);
+        }
+        // leaves used inside aliases and special functions (like Sum$) are not visible via GetLeaf()
+        CollectBranches(formulas[i]->GetTitle(), branches);
+    }
+    
+    std::stringstream ss;
+    for (std::set<std::string>::const_iterator it = branches.begin(); it != branches.end(); ++it) ss << " " << *it;
+    BxLog(routine) << "Branches used by formulas:" << (branches.empty() ? " none" : ss.str()) << endlog;
+    
+    if (fPruneBranches) {
+        fTreeChain->SetBranchStatus("*", 0);
+        for (std::set<std::string>::const_iterator it = branches.begin(); it != branches.end(); ++it) {
+            fTreeChain->SetBranchStatus(it->data(), 1);
+        }
+        BxLog(routine) << "All other branches are disabled" << endlog;
+    }
+    
+    fCacheBranches.swap(branches);
+}
+
+void BxGeneratorTTree::SetupCache() {
+    // entries actually read by this job: drawn ones, accepted by skip index or the whole (shard) range
+    Long64_t first = fFirstEntry;
+    Long64_t end   = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+    if (fSampler) {
+        first = fSampler->GetEntry(0);
+        end   = fSampler->GetEntry(fSampler->GetSize() - 1) + 1;
+    } else if (fUseSkipIndex) {
+        const std::vector<Long64_t>& accepted = fAcceptedEntries;
+        std::vector<Long64_t>::const_iterator begin = std::lower_bound(accepted.begin(), accepted.end(), first);
+        std::vector<Long64_t>::const_iterator last  = std::lower_bound(begin, accepted.end(), end);
+        if (begin != last) {
+            first = *begin;
+            end   = *(last - 1) + 1;
+        }
+    }
+    
+    fTreeChain->SetCacheSize(fCacheSize);
+    fTreeChain->SetCacheEntryRange(first, end);
+    for (std::set<std::string>::const_iterator it = fCacheBranches.begin(); it != fCacheBranches.end(); ++it) {
+        fTreeChain->AddBranchToCache(it->data(), kTRUE);
+    }
+    fTreeChain->StopCacheLearningPhase();
+    BxLog(routine) << "TTreeCache of " << fCacheSize << " bytes is set for entries [" << first << ", " << end << ")" << endlog;
+}
+
+void BxGeneratorTTree::CollectBranches(const G4String& expression, std::set<std::string>& branches, G4int depth) {
+    if (depth > 100) {
+        BxLog(error) << "Too deep recursion of aliases in expression \"" << expression << "\"" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    size_t pos = 0;
+    while (pos < expression.size()) {
+        char c = expression[pos];
+        if (!(isalpha(c) || c == '_')) {
+            // skip numbers entirely, including exponents like 1e5
+            if (isdigit(c) || c == '.') {
+                while (pos < expression.size() && (isalnum(expression[pos]) || expression[pos] == '.')) ++pos;
+            } else {
+                ++pos;
+            }
+            continue;
+        }
+        size_t end = pos;
+        while (end < expression.size() && (isalnum(expression[end]) || expression[end] == '_' || expression[end] == '.')) ++end;
+        G4String token = expression.substr(pos, end - pos);
+        pos = end;
+        
+        const char* alias = fTreeChain->GetAlias(token.data());
+        if (alias) {
+            CollectBranches(alias, branches, depth + 1);
+            continue;
+        }
+        // strip trailing members (e.g. "event.vertex.fX" of unsplit object) until branch or leaf is found
+        while (!token.empty()) {
+            TBranch* branch = fTreeChain->GetBranch(token.data());
+            if (!branch) {
+                TLeaf* leaf = fTreeChain->GetLeaf(token.data());
+                if (leaf) branch = leaf->GetBranch();
+            }
+            if (branch) {
+                CollectBranch(branch, branches);
+                break;
+            }
+            size_t dot = token.rfind('.');
+            if (dot == std::string::npos) break;
+            token = token.substr(0, dot);
+        }
+    }
+}
+
+void BxGeneratorTTree::CollectBranch(TBranch* branch, std::set<std::string>& branches) {
+    if (!branch) return;
+    branches.insert(branch->GetName());
+    TBranch* mother = branch->GetMother();
+    if (mother && mother != branch) branches.insert(mother->GetName());
+    TObjArray* leaves = branch->GetListOfLeaves();
+    for (Int_t i = 0; leaves && i < leaves->GetEntriesFast(); ++i) {
+        TLeaf* leafCount = static_cast<TLeaf*>(leaves->UncheckedAt(i))->GetLeafCount();
+        if (leafCount) branches.insert(leafCount->GetBranch()->GetName());
+    }
+}
+
+G4String BxGeneratorTTree::GetChainHash(const std::vector<G4String>& expressions) const {
+    std::stringstream ss;
+    TObjArray* files = fTreeChain->GetListOfFiles();
+    for (Int_t i = 0; files && i < files->GetEntriesFast(); ++i) {
+        const TChainElement* element = static_cast<const TChainElement*>(files->UncheckedAt(i));
+        ss << "file:" << element->GetTitle() << "/" << element->GetName() << "\n";
+    }
+    const TList* aliases = fTreeChain->GetListOfAliases();
+    for (Int_t i = 0; aliases && i < aliases->GetEntries(); ++i) {
+        const TObject* alias = aliases->At(i);
+        ss << "alias:" << alias->GetName() << "=" << alias->GetTitle() << "\n";
+    }
+    for (size_t i = 0; i < expressions.size(); ++i) ss << "expression:" << expressions[i] << "\n";
+    
+    const std::string key = ss.str();
+    TMD5 md5;
+    md5.Update(reinterpret_cast<const UChar_t*>(key.data()), key.size());
+    md5.Final();
+    return md5.AsString();
+}
+
+void BxGeneratorTTree::SetupSkipIndex() {
+    const G4String& condition = fEventConfigTTF->GetEventSkip();
+    if (condition == "0") return; // nothing is skipped
+    
+    // index covers only the range of this job (after sharding), so the range is a part of the key
+    const Long64_t end = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+    std::vector<G4String> expressions(1, condition);
+    std::stringstream range;
+    range << "range " << fFirstEntry << " " << end - fFirstEntry;
+    expressions.push_back(range.str());
+    const G4String filename = fSkipIndexDir + "/bx_skip_index_" + GetChainHash(expressions) + ".root";
+    const char* listName = "bx_skip_index";
+    
+    fAcceptedEntries.clear();
+    TFile* file = gSystem->AccessPathName(filename.data()) ? 0 : TFile::Open(filename.data(), "READ");
+    TEntryList* list = file ? dynamic_cast<TEntryList*>(file->Get(listName)) : 0;
+    if (list) {
+        Long64_t n = list->GetN();
+        fAcceptedEntries.reserve(n);
+        for (Long64_t i = 0; i < n; ++i) fAcceptedEntries.push_back(i == 0 ? list->GetEntry(0) : list->Next());
+        BxLog(routine) << "Skip index \"" << filename << "\" is loaded" << endlog;
+    } else {
+        if (file) BxLog(warning) << "Skip index \"" << filename << "\" is broken, it will be rebuilt" << endlog;
+        BxLog(routine) << "Building skip index for entries [" << fFirstEntry << ", " << end << ") with condition \"" << condition << "\"" << endlog;
+        TStopwatch stopwatch;
+        for (Long64_t entry = fFirstEntry; entry < end; ++entry) {
+            if (!fEventConfigTTF->EvalEventSkipOnEntry(entry)) fAcceptedEntries.push_back(entry);
+        }
+        stopwatch.Stop();
+        BxLog(routine) << "Skip index is built in " << stopwatch.RealTime() << " s" << endlog;
+        
+        TEntryList* newList = new TEntryList(listName, condition.data());
+        newList->SetDirectory(0);
+        for (size_t i = 0; i < fAcceptedEntries.size(); ++i) newList->Enter(fAcceptedEntries[i]);
+        BxGeneratorTTreeTmpFile tmpFile(filename);
+        G4bool written = false;
+        TFile* newFile = TFile::Open(tmpFile.GetName().data(), "RECREATE");
+        if (newFile && !newFile->IsZombie()) {
+            written = newFile->WriteTObject(newList, listName) > 0;
+            newFile->Close();
+        }
+        delete newFile;
+        delete newList;
+        // index is read back, so that truncated file is never published
+        if (written) {
+            TFile* checkFile = TFile::Open(tmpFile.GetName().data(), "READ");
+            TEntryList* checkList = (checkFile && !checkFile->IsZombie()) ? dynamic_cast<TEntryList*>(checkFile->Get(listName)) : 0;
+            written = checkList && checkList->GetN() == Long64_t(fAcceptedEntries.size());
+            delete checkFile;
+        }
+        if (tmpFile.Commit(written)) BxLog(routine) << "Skip index is saved to \"" << filename << "\"" << endlog;
+        else                         BxLog(warning) << "Cannot write skip index to \"" << filename << "\"" << endlog;
+    }
+    delete file;
+    
+    fUseSkipIndex = true;
+    fSkipIndexCursor = std::lower_bound(fAcceptedEntries.begin(), fAcceptedEntries.end(), fReadEntry + 1) - fAcceptedEntries.begin();
+    BxLog(routine) << fAcceptedEntries.size() << " of " << end - fFirstEntry << " entries pass \"event_skip_if\" condition" << endlog;
+}
+
+Long64_t BxGeneratorTTree::NextEntryNumber(Long64_t entry) {
+    if (!fUseSkipIndex) return entry + 1;
+    while (fSkipIndexCursor < fAcceptedEntries.size() && fAcceptedEntries[fSkipIndexCursor] <= entry) ++fSkipIndexCursor;
+    return fSkipIndexCursor < fAcceptedEntries.size() ? fAcceptedEntries[fSkipIndexCursor] : fLastEntry + 1;
+}
+
+void BxGeneratorTTree::SetShard(G4int index, G4int nShards, const G4String& planFile) {
+    if (nShards <= 0 || index < 0 || index >= nShards) {
+        BxLog(error) << "Shard " << index << " of " << nShards << " does not exist" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    fShardIndex    = index;
+    fNShards       = nShards;
+    fShardPlanFile = planFile;
+}
+
+G4bool BxGeneratorTTree::ReadShardPlan(const G4String& hash, std::vector<ShardInfo>& shards) const {
+    shards.clear();
+    std::ifstream file(fShardPlanFile.data());
+    if (!file) return false;
+    std::string line;
+    G4bool isSameHash = false;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        std::string key;
+        ss >> key;
+        if (key == "hash") {
+            std::string value;
+            ss >> value;
+            isSameHash = (value == hash);
+        } else {
+            ShardInfo shard;
+            std::istringstream row(line);
+            G4int index = -1;
+            // whole line must be numbers, a damaged plan is rebuilt instead of dropping entries
+            if (!(row >> index >> shard.first >> shard.n >> shard.cost) || !(row >> std::ws).eof()
+                || index != G4int(shards.size()) || shard.first < 0 || shard.n < 0) {
+                shards.clear();
+                return false;
+            }
+            shards.push_back(shard);
+        }
+    }
+    return isSameHash && G4int(shards.size()) == fNShards;
+}
+
+void BxGeneratorTTree::BuildShardPlan(std::vector<ShardInfo>& shards) {
+    const Long64_t first = fFirstEntry;
+    const Long64_t end   = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+    
+    // cluster boundaries inside [first, end), the first entry of range is a boundary as well
+    std::vector<Long64_t> boundaries(1, first);
+    const Long64_t* offsets = fTreeChain->GetTreeOffset();
+    for (G4int t = 0; t < fTreeChain->GetNtrees(); ++t) {
+        if (offsets[t] >= end || offsets[t + 1] <= first) continue;
+        fTreeChain->LoadTree(offsets[t]);
+        TTree* tree = fTreeChain->GetTree();
+        const Long64_t nEntries = tree->GetEntries();
+        TTree::TClusterIterator cluster = tree->GetClusterIterator(0);
+        for (Long64_t start = cluster.Next(); start < nEntries; start = cluster.Next()) {
+            const Long64_t entry = offsets[t] + start;
+            if (entry > first && entry < end) boundaries.push_back(entry);
+        }
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    boundaries.push_back(end);
+    
+    // cost of entry is 1 (reading) plus number of its particles
+    BxLog(routine) << "Shard plan: evaluating cost of " << end - first << " entries in " << boundaries.size() - 1 << " clusters" << endlog;
+    TStopwatch stopwatch;
+    std::vector<G4double> prefix(1, 0.); // cost of clusters before boundary
+    for (size_t c = 0; c + 1 < boundaries.size(); ++c) {
+        G4double cost = 0.;
+        for (Long64_t entry = boundaries[c]; entry < boundaries[c + 1]; ++entry) {
+            cost += 1. + std::max(Long64_t(0), CountParticles(entry));
+        }
+        prefix.push_back(prefix.back() + cost);
+    }
+    stopwatch.Stop();
+    
+    // cut at boundaries closest to equal fractions of the total cost
+    shards.assign(fNShards, ShardInfo());
+    size_t begin = 0;
+    for (G4int i = 0; i < fNShards; ++i) {
+        size_t cut = prefix.size() - 1;
+        if (i + 1 < fNShards) {
+            const G4double target = prefix.back() * (i + 1) / fNShards;
+            cut = std::lower_bound(prefix.begin() + begin, prefix.end(), target) - prefix.begin();
+            if (cut > begin && target - prefix[cut - 1] < prefix[cut] - target) --cut;
+        }
+        shards[i].first = boundaries[begin];
+        shards[i].n     = boundaries[cut] - boundaries[begin];
+        shards[i].cost  = prefix[cut] - prefix[begin];
+        begin = cut;
+    }
+    BxLog(routine) << "Shard plan: total cost " << prefix.back() << " is split in " << fNShards << " shards in " << stopwatch.RealTime() << " s" << endlog;
+}
+
+G4bool BxGeneratorTTree::SetupShard(G4bool build) {
+    // expressions are taken as strings, so the hash is known before formulas are set up
+    std::vector<G4String> expressions;
+    expressions.push_back(fEventConfigTTF->GetEventSkip());
+    for (size_t k = 0; k < fEventConfigTTF->GetSubEvents().size(); ++k) {
+        expressions.push_back(fEventConfigTTF->GetSubEvent(k).GetNParticles());
+    }
+    std::stringstream range;
+    range << "range " << fFirstEntry << " " << fNEntries << " shards " << fNShards;
+    expressions.push_back(range.str());
+    const G4String hash = GetChainHash(expressions);
+    
+    std::vector<ShardInfo> shards;
+    if (ReadShardPlan(hash, shards)) {
+        BxLog(routine) << "Shard plan \"" << fShardPlanFile << "\" is loaded" << endlog;
+    } else if (!build) {
+        return false;
+    } else {
+        if (!gSystem->AccessPathName(fShardPlanFile.data())) {
+            BxLog(warning) << "Shard plan \"" << fShardPlanFile << "\" is made for other Tree(Chain), range or number of shards, it will be rebuilt" << endlog;
+        }
+        BuildShardPlan(shards);
+        
+        BxGeneratorTTreeTmpFile tmpFile(fShardPlanFile);
+        std::ofstream file(tmpFile.GetName().data());
+        file << "# BxGeneratorTTree shard plan: index, first entry, number of entries, cost (entries + particles)\n";
+        file << "hash " << hash << "\n";
+        for (size_t i = 0; i < shards.size(); ++i) {
+            file << i << " " << shards[i].first << " " << shards[i].n << " " << shards[i].cost << "\n";
+        }
+        file.close();
+        if (tmpFile.Commit(bool(file))) {
+            BxLog(routine) << "Shard plan is saved to \"" << fShardPlanFile << "\"" << endlog;
+        } else {
+            BxLog(warning) << "Cannot write shard plan to \"" << fShardPlanFile << "\"" << endlog;
+        }
+    }
+    
+    const ShardInfo& shard = shards[fShardIndex];
+    fFirstEntry = shard.first;
+    fNEntries   = shard.n;
+    BxLog(routine) << "Shard " << fShardIndex << " of " << fNShards << ": entries [" << fFirstEntry << ", "
+                   << fFirstEntry + fNEntries << "), cost " << shard.cost << endlog;
+    if (fNEntries == 0) BxLog(warning) << "Shard is empty, there are fewer clusters than shards" << endlog;
+    return true;
+}
+
+void BxGeneratorTTree::SetupSampling() {
+    std::vector<G4String> expressions;
+    expressions.push_back(fSamplingWeight);
+    expressions.push_back(fEventConfigTTF->GetEventSkip());
+    std::stringstream range;
+    range << "range " << fFirstEntry << " " << fNEntries;
+    expressions.push_back(range.str());
+    const G4String key = GetChainHash(expressions);
+    const G4String filename = fSamplingCacheDir.empty() ? G4String() : G4String(fSamplingCacheDir + "/bx_alias_table_" + key + ".bin");
+    
+    fSampler = new BxGeneratorTTreeSampler();
+    BxGeneratorTTreeSampler& sampler = *fSampler;
+    if (!filename.empty() && sampler.Load(filename, key)) {
+        BxLog(routine) << "Alias table \"" << filename << "\" is loaded" << endlog;
+    } else {
+        const Long64_t end = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+        BxLog(routine) << "Building alias table for " << end - fFirstEntry << " entries with weight \"" << fSamplingWeight << "\"" << endlog;
+        TStopwatch stopwatch;
+        
+        // formula must not replace notification of generator formulas, its leaves are updated here
+        TObject* notify = fTreeChain->GetNotify();
+        TTreeFormula* formula = new TTreeFormula("bx_sampling_weight", fSamplingWeight.data(), fTreeChain);
+        fTreeChain->SetNotify(notify);
+        if (formula->GetNdim() == 0) {
+            BxLog(error) << "Bad sampling weight expression \"" << fSamplingWeight << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        
+        std::vector<Long64_t> entries;
+        std::vector<Double_t> weights;
+        Long64_t nNegative = 0;
+        Int_t treeNumber = -1;
+        for (Long64_t entry = fFirstEntry; entry < end; ++entry) {
+            if (fEventConfigTTF->EvalEventSkipOnEntry(entry)) continue; // skipped entries are never drawn
+            if (fTreeChain->GetTreeNumber() != treeNumber) {
+                treeNumber = fTreeChain->GetTreeNumber();
+                formula->UpdateFormulaLeaves();
+            }
+            formula->GetNdata();
+            const Double_t weight = formula->EvalInstance(0);
+            if (!(weight >= 0.)) {
+                ++nNegative;
+            } else if (weight > 0.) {
+                entries.push_back(entry);
+                weights.push_back(weight);
+            }
+        }
+        delete formula;
+        sampler.Build(entries, weights, end - fFirstEntry);
+        stopwatch.Stop();
+        if (nNegative) BxLog(warning) << nNegative << " entries have negative or NaN weight, they are never drawn" << endlog;
+        BxLog(routine) << "Alias table of " << sampler.GetSize() << " entries is built in " << stopwatch.RealTime() << " s" << endlog;
+        
+        if (!filename.empty()) {
+            if (sampler.Save(filename, key)) BxLog(routine) << "Alias table is saved to \"" << filename << "\"" << endlog;
+            else                             BxLog(warning) << "Cannot write alias table to \"" << filename << "\"" << endlog;
+        }
+    }
+    if (sampler.GetSize() == 0) {
+        BxLog(error) << "All entries have zero sampling weight" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    
+    // Entries are drawn lazily in blocks by own engine, which may be used by background reader.
+    // Its seed is kept, so that the same draws can be replayed by CountEvents().
+    if (fSamplingDraws <= 0) fSamplingDraws = sampler.GetNRange();
+    fSamplingSeed   = static_cast<long>(G4UniformRand() * 900000000.);
+    fSamplingEngine = new CLHEP::HepJamesRandom(fSamplingSeed);
+    fNDrawn         = 0;
+    fSampledEntries.clear();
+    fSampleCursor   = 0;
+    BxLog(routine) << fSamplingDraws << " entries are drawn from " << sampler.GetSize() << " entries with positive weight, in blocks of "
+                   << kSamplingBlock << " draws" << endlog;
+}
+
+G4bool BxGeneratorTTree::NextSampledBlock() {
+    if (fNDrawn >= fSamplingDraws) return false;
+    // each block is sorted, so that its entries are read in order of the chain
+    const Long64_t n = std::min(Long64_t(kSamplingBlock), fSamplingDraws - fNDrawn);
+    fSampledEntries.resize(n);
+    for (Long64_t i = 0; i < n; ++i) {
+        const size_t k = fSampler->Draw(fSamplingEngine->flat(), fSamplingEngine->flat());
+        fSampledEntries[i] = std::make_pair(fSampler->GetEntry(k), fSampler->GetCompensatingWeight(k));
+    }
+    std::sort(fSampledEntries.begin(), fSampledEntries.end());
+    fSampleCursor = 0;
+    fNDrawn += n;
+    return true;
+}
+
+void BxGeneratorTTree::SetupPool() {
+    // /bx/generator/ttree/beam_on (exact and stream) is rejected by BeamOn(), pool never ends
+    TStopwatch stopwatch;
+    std::vector<EntryBatch> pool;
+    pool.reserve(fPoolSize);
+    size_t nParticles = 0;
+    EntryBatch batch;
+    while (G4int(pool.size()) < fPoolSize && ReadNextEntry(batch)) {
+        nParticles += batch.particles.size();
+        pool.push_back(EntryBatch());
+        pool.back().swap(batch);
+    }
+    stopwatch.Stop();
+    
+    if (pool.empty()) {
+        BxLog(error) << "No entries with particles to be loaded into pool" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    if (G4int(pool.size()) < fPoolSize) BxLog(warning) << "Only " << pool.size() << " entries are available for pool of " << fPoolSize << " entries" << endlog;
+    
+    // event ids of each next cycle are shifted by the span of ids in pool, so that events of different cycles differ
+    G4int minEventId = pool[0].particles[0].event_id, maxEventId = minEventId;
+    for (size_t i = 0; i < pool.size(); ++i) {
+        minEventId = std::min(minEventId, pool[i].particles[0].event_id);
+        maxEventId = std::max(maxEventId, pool[i].particles[0].event_id);
+    }
+    fPoolEventIdStride = Long64_t(maxEventId) - minEventId + 1;
+    fPoolMaxEventId    = maxEventId;
+    
+    fPool.swap(pool);
+    fPoolCursor = 0;
+    fPoolCycle  = 0;
+    fEndOfChain = false; // input is not read any more
+    BxLog(routine) << "Pool: " << fPool.size() << " entries with " << nParticles << " particles ("
+                   << (nParticles * sizeof(ParticleInfo)) / (1024. * 1024.) << " MB) loaded in " << stopwatch.RealTime() << " s, "
+                   << (fPoolRotateIso ? "rotated isotropically" : "not rotated")
+                   << (fPoolTimeShift > 0. ? TString::Format(", shifted in time up to %g ns", fPoolTimeShift/ns).Data() : "") << endlog;
+}
+
+G4bool BxGeneratorTTree::NextPoolEntry(EntryBatch& batch) {
+    const EntryBatch& source = fPool[fPoolCursor];
+    Long64_t eventIdOffset = fPoolCycle * fPoolEventIdStride;
+    if (fPoolMaxEventId + eventIdOffset > INT_MAX) {
+        BxLog(warning) << "Event ids of pool cycle " << fPoolCycle << " exceed " << INT_MAX << ", they start again from event ids of the pool" << endlog;
+        fPoolCycle    = 0;
+        eventIdOffset = 0;
+    }
+    if (++fPoolCursor == fPool.size()) {
+        fPoolCursor = 0;
+        ++fPoolCycle;
+    }
+    batch.entry     = source.entry;
+    batch.particles = source.particles;
+    if (eventIdOffset) for (size_t i = 0; i < batch.particles.size(); ++i) batch.particles[i].event_id += G4int(eventIdOffset);
+    
+    if (fPoolRotateIso) {
+        // the whole event is rotated as one, so that angular correlations of particles are kept
+        const G4RotationMatrix rotation = RandomRotation();
+        for (size_t i = 0; i < batch.particles.size(); ++i) {
+            batch.particles[i].momentum     = rotation * batch.particles[i].momentum;
+            batch.particles[i].polarization = rotation * batch.particles[i].polarization;
+        }
+    }
+    if (fPoolTimeShift > 0.) {
+        const G4double shift = fPoolTimeShift * UniformRand();
+        for (size_t i = 0; i < batch.particles.size(); ++i) batch.particles[i].time += shift;
+    }
+    return true;
+}
+
+namespace {
+    /// Flags are truncated to integers as by TTreeFormula::EvalInstance64(), so that 0.5 is false
+    inline G4bool IsFlagSet(Double_t value) { return Long64_t(value) != 0; }
+}
+
+Long64_t BxGeneratorTTree::CountParticles(Long64_t entry_number) {
+    fEventConfigTTF->CheckInOnEntry(entry_number);
+    fEventConfigTTF->PrepareEntry();
+    if (fEventConfigTTF->EvalEventSkip()) return -1;
+    
+    Long64_t n = 0;
+    for (size_t k = 0; k < fEventConfigTTF->GetSubEvents().size(); ++k) {
+        SubEventConfigTTF& subEventConfigTTF = fEventConfigTTF->GetSubEvent(k);
+        if (subEventConfigTTF.GetNdata() <= 0) return 0; // as in FillBatchFromEntry
+        const G4int nParticles = subEventConfigTTF.EvalNParticles();
+        if (nParticles <= 0) continue;
+        // particles with particle_skip_if are not counted, as in FillSubEvent
+        G4int sSkip;
+        const Double_t* skip = PrepareColumn(subEventConfigTTF, SubEventConfigTTF::kParticleSkip, nParticles, 1., false, sSkip);
+        if (sSkip == 0) {
+            if (!IsFlagSet(skip[0])) n += nParticles;
+            continue;
+        }
+        for (G4int i = 0; i < nParticles; ++i) if (!IsFlagSet(skip[i])) ++n;
+    }
+    return n;
+}
+
+Long64_t BxGeneratorTTree::CountEvents() {
+    TStopwatch stopwatch;
+    const Long64_t end = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+    Long64_t nEvents = 0;
+    if (fSampler) {
+        // draws are replayed by engine with the same seed, each entry of the table is evaluated once
+        CLHEP::HepJamesRandom engine(fSamplingSeed);
+        std::vector<signed char> hasParticles(fSampler->GetSize(), -1);
+        for (Long64_t i = 0; i < fSamplingDraws; ++i) {
+            const size_t k = fSampler->Draw(engine.flat(), engine.flat());
+            if (hasParticles[k] < 0) hasParticles[k] = CountParticles(fSampler->GetEntry(k)) > 0;
+            nEvents += hasParticles[k];
+        }
+    } else if (fUseSkipIndex) {
+        std::vector<Long64_t>::const_iterator it = std::lower_bound(fAcceptedEntries.begin(), fAcceptedEntries.end(), fFirstEntry);
+        for (; it != fAcceptedEntries.end() && *it < end; ++it) if (CountParticles(*it) > 0) ++nEvents;
+    } else {
+        for (Long64_t entry = fFirstEntry; entry < end; ++entry) if (CountParticles(entry) > 0) ++nEvents;
+    }
+    stopwatch.Stop();
+    BxLog(routine) << nEvents << " of " << end - fFirstEntry << " entries have particles, counted in " << stopwatch.RealTime() << " s" << endlog;
+    return nEvents;
+}
+
+void BxGeneratorTTree::BeamOn(G4bool exact) {
+    G4RunManager* runManager = G4RunManager::GetRunManager();
+    if (runManager->GetRunManagerType() != G4RunManager::sequentialRM) {
+        BxLog(error) << "/bx/generator/ttree/beam_on is for sequential runs only, use /run/beamOn 2147483647 in multithreaded mode" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    if (fPoolSize > 0) {
+        BxLog(error) << "Events are served from pool endlessly, so the input never ends, use /run/beamOn N instead of /bx/generator/ttree/beam_on" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    if (exact && fIsInitialized) {
+        BxLog(warning) << "Generator is already initialized, number of events cannot be counted. Events are streamed until the end of input" << endlog;
+        exact = false;
+    }
+    fCountEvents = exact;
+    if (!fIsInitialized)  Initialize();
+    
+    // One run can't have more than 2^31-1 events, longer inputs are split into several runs.
+    // Counted events are entries with particles, events of postponed particles take some of them,
+    // so the rest of input is streamed after the counted events until the end of input.
+    Long64_t nLeft = exact ? fNEvents : -1;
+    if (exact) BxLog(routine) << "BxGeneratorTTree: " << nLeft << " events are to be generated" << endlog;
+    while (!fEndOfInput) {
+        if (nLeft == 0) {
+            if (fParticleQueue.empty() && fNPulledEntries >= fNEvents) break;
+            BxLog(routine) << "BxGeneratorTTree: " << fNEvents - fNPulledEntries << " entries and " << fParticleQueue.size()
+                           << " postponed particles are left, they are streamed until the end of input" << endlog;
+            nLeft = -1;
+        }
+        const G4int n = (nLeft < 0 || nLeft > INT_MAX) ? INT_MAX : G4int(nLeft);
+        const Long64_t nGenerated = fNGeneratedEvents;
+        runManager->BeamOn(n);
+        if (nLeft > 0) nLeft -= n;
+        if (fNGeneratedEvents - nGenerated < n && !fEndOfInput) break; // run was aborted by somebody else
+    }
 }
 
-G4bool BxGeneratorTTree::FillDequeFromEntry(G4int entry_number) {
+G4bool BxGeneratorTTree::FillBatchFromEntry(Long64_t entry_number, std::vector<ParticleInfo>& particles) {
     fEventConfigTTF->CheckInOnEntry(entry_number);
     
+    fEventConfigTTF->PrepareEntry();
     if (fEventConfigTTF->EvalEventSkip()) return false;
     
     ParticleInfo particle_info;
-    particle_info.event_id = fEventConfigTTF->IsSetEventId() ? fEventConfigTTF->EvalEventId() : entry_number;
+    particle_info.event_id = G4int(fEventConfigTTF->IsSetEventId() ? fEventConfigTTF->EvalEventId() : entry_number);
+    particle_info.entry = entry_number;
+    particle_info.status = 0;
+    particle_info.definition = 0;
+    particle_info.weight = fEntryWeight;
     
-    G4ThreeVector rotationAnglesEvent(0.,0.,0.);
-    if (fEventConfigTTF->EvalEventRotateIso())  rotationAnglesEvent.set(twopi*G4UniformRand(), std::acos(2.*G4UniformRand() - 1.), twopi*G4UniformRand());
+    G4RotationMatrix rotationEvent;
+    if (fEventConfigTTF->EvalEventRotateIso())  rotationEvent = RandomRotation();
     
     G4int total_p_index = 0;
     for (size_t k = 0; k < fEventConfigTTF->GetSubEvents().size(); ++k) {
         SubEventConfigTTF& subEventConfigTTF = fEventConfigTTF->GetSubEvent(k);
-        if (subEventConfigTTF.GetManager()->GetNdata() <= 0) {
-            fDequeParticleInfo.clear();
+        if (subEventConfigTTF.GetNdata() <= 0) {
+            particles.clear();
             return false;
         }
         
-        G4ThreeVector rotationAnglesSubEvent(0.,0.,0.);
-        if (subEventConfigTTF.EvalSubEventRotateIso())  rotationAnglesSubEvent.set(twopi*G4UniformRand(), std::acos(2.*G4UniformRand() - 1.), twopi*G4UniformRand());
+        // event rotation is applied first, so the product is built once per sub-event instead of two rotations per particle
+        G4RotationMatrix rotation = rotationEvent;
+        if (subEventConfigTTF.EvalSubEventRotateIso())  rotation = RandomRotation() * rotationEvent;
         
-        for (G4int i = 0; i < subEventConfigTTF.EvalNParticles(); ++i) {
-            if (subEventConfigTTF.EvalParticleSkip(i))  continue;
-            particle_info.p_index = total_p_index;
-            ++total_p_index;
-            particle_info.status = 0;
-            
-            particle_info.pdg_code = subEventConfigTTF.EvalPdg(i);
-            G4ParticleDefinition* fParticle = G4ParticleTable::GetParticleTable()->FindParticle(particle_info.pdg_code);
-            if (!fParticle) {
-                fParticle = G4IonTable::GetIonTable()->GetIon(particle_info.pdg_code);
-                if (!fParticle) { // Skip unknown particle
-                    BxLog(warning) << "  Entry " << entry_number
-                                << ", event_id = " << particle_info.event_id
-                                << " : sub_event #" << k
-                                << ", particle #" << i
-                                << " : WARNING!" << endlog;
-                    BxLog(warning) << "    Skipping unknown particle with PDG code " << particle_info.pdg_code << endlog;
-                    continue;
-                }
+        const G4int n = subEventConfigTTF.EvalNParticles();
+        if (n <= 0) continue;
+        
+        typedef SubEventConfigTTF C;
+        // vector fields without per-particle components are evaluated and transformed once per entry
+        const G4int mode = (subEventConfigTTF.IsUniform(C::kMomentumX    , C::kMomentumY    , C::kMomentumZ    ) ? 1 : 0)
+                         | (subEventConfigTTF.IsUniform(C::kPositionX    , C::kPositionY    , C::kPositionZ    ) ? 2 : 0)
+                         | (subEventConfigTTF.IsUniform(C::kPolarizationX, C::kPolarizationY, C::kPolarizationZ) ? 4 : 0);
+        switch (mode) {
+            case 0: FillSubEvent<false,false,false>(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 1: FillSubEvent<true ,false,false>(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 2: FillSubEvent<false,true ,false>(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 3: FillSubEvent<true ,true ,false>(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 4: FillSubEvent<false,false,true >(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 5: FillSubEvent<true ,false,true >(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 6: FillSubEvent<false,true ,true >(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+            case 7: FillSubEvent<true ,true ,true >(subEventConfigTTF, n, rotation, particle_info, total_p_index, particles); break;
+        }
+    }
+    return true;
+}
+
+Double_t* BxGeneratorTTree::PrepareColumn(SubEventConfigTTF& config, G4int field, G4int n, Double_t unit, G4bool forceColumn, G4int& stride) {
+    const SubEventConfigTTF::EFormula k = SubEventConfigTTF::EFormula(field);
+    if (!forceColumn && !config.IsPerParticle(k)) {
+        fScalars[k] = unit * config.EvalScalar(k);
+        stride = 0;
+        return &fScalars[k];
+    }
+    if (G4int(fColumns[k].size()) < n) fColumns[k].resize(n);
+    Double_t* column = &fColumns[k][0];
+    config.EvalColumn(k, n, column);
+    if (unit != 1.) for (G4int i = 0; i < n; ++i) column[i] *= unit;
+    stride = 1;
+    return column;
+}
+
+template <G4bool kUniformMomentum, G4bool kUniformPosition, G4bool kUniformPolarization>
+void BxGeneratorTTree::FillSubEvent(SubEventConfigTTF& config, G4int n, const G4RotationMatrix& rotation,
+    ParticleInfo& particle_info, G4int& total_p_index, std::vector<ParticleInfo>& particles) {
+    typedef SubEventConfigTTF C;
+    G4int sSkip, sRotateIso, sPdg, sEnergy, sTime, sx, sy, sz;
+    
+    const Double_t* skip = PrepareColumn(config, C::kParticleSkip, n, 1., false, sSkip);
+    if (sSkip == 0 && IsFlagSet(skip[0])) return; // all particles are skipped
+    const Double_t* rotateIso = PrepareColumn(config, C::kParticleRotateIso, n, 1.                        , false, sRotateIso);
+    const Double_t* pdg       = PrepareColumn(config, C::kPdg             , n, 1.                        , false, sPdg      );
+    const Double_t* energy    = PrepareColumn(config, C::kEnergy          , n, config.GetEnergyUnit()    , false, sEnergy   );
+    const Double_t* t         = PrepareColumn(config, C::kTime            , n, config.GetTimeUnit()      , false, sTime     );
+    
+    // momentum direction and magnitude
+    G4ThreeVector direction;
+    Double_t      directionMag = 0.;
+    Double_t *px = 0, *py = 0, *pz = 0, *pmag = 0;
+    if (kUniformMomentum) {
+        const Double_t unit = config.GetMomentumUnit();
+        direction.set(unit * config.EvalScalar(C::kMomentumX), unit * config.EvalScalar(C::kMomentumY), unit * config.EvalScalar(C::kMomentumZ));
+        directionMag = direction.mag();
+        if (directionMag == 0.) direction.set(0.,0.,1.);
+        direction = rotation * direction.unit();
+    } else {
+        px = PrepareColumn(config, C::kMomentumX, n, config.GetMomentumUnit(), true, sx);
+        py = PrepareColumn(config, C::kMomentumY, n, config.GetMomentumUnit(), true, sy);
+        pz = PrepareColumn(config, C::kMomentumZ, n, config.GetMomentumUnit(), true, sz);
+        if (G4int(fMomentumMag.size()) < n) fMomentumMag.resize(n);
+        pmag = &fMomentumMag[0];
+        for (G4int i = 0; i < n; ++i) pmag[i] = std::sqrt(px[i]*px[i] + py[i]*py[i] + pz[i]*pz[i]);
+        for (G4int i = 0; i < n; ++i) {
+            const Double_t norm = (pmag[i] == 0.) ? 0. : 1. / pmag[i];
+            px[i] *= norm;
+            py[i] *= norm;
+            pz[i] = (pmag[i] == 0.) ? 1. : pz[i] * norm;
+        }
+        if (!rotation.isIdentity()) {
+            const Double_t xx = rotation.xx(), xy = rotation.xy(), xz = rotation.xz();
+            const Double_t yx = rotation.yx(), yy = rotation.yy(), yz = rotation.yz();
+            const Double_t zx = rotation.zx(), zy = rotation.zy(), zz = rotation.zz();
+            for (G4int i = 0; i < n; ++i) {
+                const Double_t x = px[i], y = py[i], z = pz[i];
+                px[i] = xx*x + xy*y + xz*z;
+                py[i] = yx*x + yy*y + yz*z;
+                pz[i] = zx*x + zy*y + zz*z;
             }
-            
-            particle_info.momentum.set(
-                subEventConfigTTF.GetMomentumUnit() * subEventConfigTTF.EvalMomentumX(i),
-                subEventConfigTTF.GetMomentumUnit() * subEventConfigTTF.EvalMomentumY(i),
-                subEventConfigTTF.GetMomentumUnit() * subEventConfigTTF.EvalMomentumZ(i)
-            );
-            
-            particle_info.energy = subEventConfigTTF.GetEnergyUnit() * subEventConfigTTF.EvalEnergy(i);
-            G4double mass = fParticle->GetPDGMass();
-            if (particle_info.energy < 0.) particle_info.energy = std::sqrt(mass*mass + particle_info.momentum.mag2()) - mass;
-            
-            if (particle_info.momentum.mag() == 0.) particle_info.momentum.set(0.,0.,1.);
-            particle_info.momentum = particle_info.momentum
-                                                  .unit()
-                                                  .rotate(rotationAnglesEvent.x(), rotationAnglesEvent.y(), rotationAnglesEvent.z())
-                                                  .rotate(rotationAnglesSubEvent.x(), rotationAnglesSubEvent.y(), rotationAnglesSubEvent.z());
-            if (subEventConfigTTF.EvalParticleRotateIso(i)) {
-                particle_info.momentum = particle_info.momentum.rotate(twopi*G4UniformRand(), std::acos(2.*G4UniformRand() - 1.), twopi*G4UniformRand());
+        }
+    }
+    
+    // Isotropic rotation of a direction gives a direction uniform on the sphere, which needs just 2 random numbers.
+    // They are drawn for all such particles at once.
+    G4int nRandoms = 0;
+    for (G4int i = 0; i < n; ++i) if (!IsFlagSet(skip[i*sSkip]) && IsFlagSet(rotateIso[i*sRotateIso])) nRandoms += 2;
+    if (nRandoms > 0) {
+        if (G4int(fRandoms.size()) < nRandoms) fRandoms.resize(nRandoms);
+        UniformRandArray(nRandoms, &fRandoms[0]);
+    }
+    const G4double* randoms = nRandoms > 0 ? &fRandoms[0] : 0;
+    
+    G4ThreeVector position;
+    const Double_t *x = 0, *y = 0, *z = 0;
+    if (kUniformPosition) {
+        const Double_t unit = config.GetPositionUnit();
+        position.set(unit * config.EvalScalar(C::kPositionX), unit * config.EvalScalar(C::kPositionY), unit * config.EvalScalar(C::kPositionZ));
+    } else {
+        x = PrepareColumn(config, C::kPositionX, n, config.GetPositionUnit(), true, sx);
+        y = PrepareColumn(config, C::kPositionY, n, config.GetPositionUnit(), true, sy);
+        z = PrepareColumn(config, C::kPositionZ, n, config.GetPositionUnit(), true, sz);
+    }
+    
+    G4ThreeVector polarization;
+    const Double_t *polx = 0, *poly = 0, *polz = 0;
+    if (kUniformPolarization) {
+        polarization.set(config.EvalScalar(C::kPolarizationX), config.EvalScalar(C::kPolarizationY), config.EvalScalar(C::kPolarizationZ));
+    } else {
+        polx = PrepareColumn(config, C::kPolarizationX, n, 1., true, sx);
+        poly = PrepareColumn(config, C::kPolarizationY, n, 1., true, sy);
+        polz = PrepareColumn(config, C::kPolarizationZ, n, 1., true, sz);
+    }
+    
+    for (G4int i = 0; i < n; ++i) {
+        if (IsFlagSet(skip[i*sSkip]))  continue;
+        particle_info.p_index = total_p_index;
+        ++total_p_index;
+        
+        particle_info.pdg_code = Long64_t(pdg[i*sPdg]);
+        
+        //Particle table is not touched here, because this method can be called from background reader.
+        //Negative energy keeps momentum magnitude, kinetic energy is calculated when particle definition is known
+        particle_info.energy = energy[i*sEnergy];
+        if (particle_info.energy < 0.) particle_info.energy = kUniformMomentum ? -directionMag : -pmag[i];
+        
+        if (IsFlagSet(rotateIso[i*sRotateIso])) {
+            const G4double cosTheta = 2.*randoms[0] - 1.;
+            const G4double sinTheta = std::sqrt(std::max(0., 1. - cosTheta*cosTheta));
+            const G4double phi      = twopi*randoms[1];
+            particle_info.momentum.set(sinTheta*std::cos(phi), sinTheta*std::sin(phi), cosTheta);
+            randoms += 2;
+        } else if (kUniformMomentum) {
+            particle_info.momentum = direction;
+        } else {
+            particle_info.momentum.set(px[i], py[i], pz[i]);
+        }
+        
+        if (kUniformPosition) particle_info.position = position;
+        else                  particle_info.position.set(x[i], y[i], z[i]);
+        
+        particle_info.time = t[i*sTime];
+        
+        if (kUniformPolarization) particle_info.polarization = polarization;
+        else                      particle_info.polarization.set(polx[i], poly[i], polz[i]);
+        
+        particles.push_back(particle_info);
+    }
+}
+
+G4bool BxGeneratorTTree::ReadNextEntry(EntryBatch& batch) {
+    if (!fPool.empty()) {
+        const Long64_t start = fReaderStats.Start();
+        NextPoolEntry(batch);
+        fReaderStats.Stop(BxGeneratorTTreeStats::kEvaluate, start);
+        return true;
+    }
+    batch.entry = -1;
+    if (fSnapshotReader) {
+        const Long64_t start = fReaderStats.Start();
+        const G4bool ok = fSnapshotReader->Next(batch, fEndOfChain);
+        fReaderStats.Stop(BxGeneratorTTreeStats::kLoadTree, start);
+        if (ok) fReaderStats.Count(BxGeneratorTTreeStats::kEntriesRead);
+        return ok;
+    }
+    G4bool filled = false;
+    do {
+        batch.particles.clear();
+        if (fSampler) {
+            if (fSampleCursor >= fSampledEntries.size() && !NextSampledBlock()) return false;
+            fReadEntry   = fSampledEntries[fSampleCursor].first;
+            fEntryWeight = fSampledEntries[fSampleCursor].second;
+            ++fSampleCursor;
+        } else {
+            fReadEntry = NextEntryNumber(fReadEntry); //after initialization fReadEntry == fFirstEntry - 1
+            if ( (fReadEntry > fFirstEntry + fNEntries - 1) || (fReadEntry > fLastEntry && fLastEntry != -1)) {
+                fEndOfChain = (fReadEntry > fLastEntry && fLastEntry != -1);
+                return false;
             }
+        }
+        Long64_t start = fReaderStats.Start();
+        Long64_t loadedEntry = fTreeChain->LoadTree(fReadEntry);
+        fReaderStats.Stop(BxGeneratorTTreeStats::kLoadTree, start);
+        fReaderStats.Count(BxGeneratorTTreeStats::kEntriesRead);
+        if (loadedEntry < -1) {
+            //if loadedEntry == -1 (i.e. chain is empty) and one (or more) of TTreeFormula-s is not a float number,
+            //it already failed in Initialize() with "Bad numerical expression".
+            //So it is safe here to use fTreeChain->LoadTree(fReadEntry) == -1 as good case
+            //to provide possibility for using this generator without TTree.
             
-            particle_info.position.set(
-                subEventConfigTTF.GetPositionUnit() * subEventConfigTTF.EvalPositionX(i),
-                subEventConfigTTF.GetPositionUnit() * subEventConfigTTF.EvalPositionY(i),
-                subEventConfigTTF.GetPositionUnit() * subEventConfigTTF.EvalPositionZ(i)
-            );
-            
-            particle_info.time = subEventConfigTTF.GetTimeUnit() * subEventConfigTTF.EvalTime(i);
-            
-            particle_info.polarization.set(
-                subEventConfigTTF.EvalPolarizationX(i),
-                subEventConfigTTF.EvalPolarizationY(i),
-                subEventConfigTTF.EvalPolarizationZ(i)
-            );
-            
-            fDequeParticleInfo.push_back(particle_info);
+            //error descriptions from TChain::LoadTree()
+                 if (loadedEntry == -2) BxLog(fatal/*error*/) << "The requested entry number is less than zero or too large for the chain or too large for the large TTree" << endlog;
+            else if (loadedEntry == -3) BxLog(fatal/*error*/) << "The file corresponding to the entry could not be correctly open" << endlog;
+            else if (loadedEntry == -4) BxLog(fatal/*error*/) << "The TChainElement corresponding to the entry is missing or the TTree is missing from the file"  << endlog;
         }
-    }
+        if (fCrossCheckEntries > 0) {
+            fCrossCheckMismatches += fEventConfigTTF->CrossCheck();
+            if (--fCrossCheckEntries == 0) {
+                if (fCrossCheckMismatches) BxLog(warning) << "Backend cross-check: " << fCrossCheckMismatches << " mismatches, see messages above" << endlog;
+                else                       BxLog(routine) << "Backend cross-check: compiled and interpreted values are the same" << endlog;
+            }
+        }
+        start = fReaderStats.Start();
+        filled = FillBatchFromEntry(fReadEntry, batch.particles) && !batch.particles.empty();
+        fReaderStats.Stop(BxGeneratorTTreeStats::kEvaluate, start);
+        if (!filled) fReaderStats.Count(BxGeneratorTTreeStats::kEntriesSkipped);
+    } while (!filled);
+    batch.entry = fReadEntry;
     return true;
 }
 
-void BxGeneratorTTree::BxGeneratePrimaries(G4Event* event) {
-    if (!fIsInitialized)  Initialize();
+G4ParticleDefinition* BxGeneratorTTree::FindDefinition(G4int pdg_code) {
+    std::map<G4int, G4ParticleDefinition*>::const_iterator it = fDefinitions.find(pdg_code);
+    if (it != fDefinitions.end()) return it->second;
     
-    while (fDequeParticleInfo.empty()) {
-        do {
-            ++fCurrentEntry; //after initialization fCurrentEntry == fFirstEntry - 1
-            if ( (fCurrentEntry > fFirstEntry + fNEntries - 1) || (fCurrentEntry > fLastEntry && fLastEntry != -1)) {
-                // RunManager cannot abort the event from inside UserGeneratePrimaries(), so we do a soft abort
-                // to the RunManager, and abort the event ourselves. The result is the same as a hard abort.
-                BxManager::Get()->AbortRun(true);
-                event->SetEventAborted();
-                if (fCurrentEntry > fLastEntry && fLastEntry != -1) BxLog(routine) << "End of Tree(Chain) reached" << endlog;
-                return;
+    G4ParticleDefinition* definition = G4ParticleTable::GetParticleTable()->FindParticle(pdg_code);
+    if (!definition) definition = G4IonTable::GetIonTable()->GetIon(pdg_code);
+    fDefinitions[pdg_code] = definition;
+    return definition;
+}
+
+namespace {
+    /// Part of entries range scanned for PDG codes by single thread
+    struct PrewarmTask {
+        TChain*                    chain;
+        std::vector<TTreeFormula*> formulas; ///< PDG formulas of sub-events
+        Long64_t                   first;
+        Long64_t                   last;
+        std::set<G4int>            codes;
+    };
+    
+    void* PrewarmThreadFunction(void* arg) {
+        PrewarmTask* task = static_cast<PrewarmTask*>(arg);
+        Int_t treeNumber = task->chain->GetTreeNumber(); // formulas are bound to the tree of the first entry
+        for (Long64_t entry = task->first; entry < task->last; ++entry) {
+            if (task->chain->LoadTree(entry) < 0) break;
+            // chain has no notify object, so leaves of formulas are rebound here when the next file is opened
+            if (task->chain->GetTreeNumber() != treeNumber) {
+                treeNumber = task->chain->GetTreeNumber();
+                for (size_t k = 0; k < task->formulas.size(); ++k) task->formulas[k]->UpdateFormulaLeaves();
             }
-            G4int loadedEntry = fTreeChain->LoadTree(fCurrentEntry);
-            if (loadedEntry < -1) {
-                //if loadedEntry == -1 (i.e. chain is empty) and one (or more) of TTreeFormula-s is not a float number,
-                //it already failed in Initialize() with "Bad numerical expression".
-                //So it is safe here to use fTreeChain->LoadTree(fCurrentEntry) == -1 as good case
-                //to provide possibility for using this generator without TTree.
-                
-                //error descriptions from TChain::LoadTree()
-                     if (loadedEntry == -2) BxLog(fatal/*error*/) << "The requested entry number is less than zero or too large for the chain or too large for the large TTree" << endlog;
-                else if (loadedEntry == -3) BxLog(fatal/*error*/) << "The file corresponding to the entry could not be correctly open" << endlog;
-                else if (loadedEntry == -4) BxLog(fatal/*error*/) << "The TChainElement corresponding to the entry is missing or the TTree is missing from the file"  << endlog;
+            for (size_t k = 0; k < task->formulas.size(); ++k) {
+                TTreeFormula* formula = task->formulas[k];
+                const Int_t ndata = formula->GetNdata();
+                for (Int_t i = 0; i < ndata; ++i) task->codes.insert(G4int(formula->EvalInstance64(i)));
             }
-        } while (! FillDequeFromEntry(fCurrentEntry));
+        }
+        return 0;
+    }
+}
+
+void BxGeneratorTTree::PrewarmIons() {
+    TStopwatch stopwatch;
+    std::set<G4int> codes;
+    
+    std::vector<G4String> expressions;
+    for (size_t k = 0; k < fEventConfigTTF->GetSubEvents().size(); ++k) {
+        const SubEventConfigTTF& subEventConfigTTF = fEventConfigTTF->GetSubEvent(k);
+        if (subEventConfigTTF.GetFieldKind(SubEventConfigTTF::kPdg) == SubEventConfigTTF::kConstant) {
+            codes.insert(G4int(subEventConfigTTF.EvalScalar(SubEventConfigTTF::kPdg)));
+        } else {
+            expressions.push_back(subEventConfigTTF.GetFormula(SubEventConfigTTF::kPdg)->GetTitle());
+        }
+    }
+    
+    const Long64_t first = fFirstEntry;
+    const Long64_t last  = std::min(fFirstEntry + fNEntries, fLastEntry + 1);
+    G4int nThreads = expressions.empty() ? 0 : std::max(1, std::min(fPrewarmThreads, G4int(last - first)));
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,6,0)
+    // threads open files of their chains, which is safe only with ROOT::EnableThreadSafety() (see Initialize())
+    if (nThreads > 1) {
+        BxLog(routine) << "BxGeneratorTTree: ROOT older than 6.06 is not thread safe, PDG codes are scanned by one thread" << endlog;
+        nThreads = 1;
     }
+#endif
     
+    // chains and formulas are created here, threads only read entries
+    std::vector<PrewarmTask> tasks(nThreads);
+    for (G4int t = 0; t < nThreads; ++t) {
+        PrewarmTask& task = tasks[t];
+        task.chain = new TChain();
+        TObjArray* files = fTreeChain->GetListOfFiles();
+        for (Int_t i = 0; files && i < files->GetEntriesFast(); ++i) {
+            const TChainElement* element = static_cast<const TChainElement*>(files->UncheckedAt(i));
+            // known entry counts keep threads from opening files outside of their ranges
+            task.chain->Add((std::string(element->GetTitle()) + "/" + element->GetName()).data(), element->GetEntries());
+        }
+        const TList* aliases = fTreeChain->GetListOfAliases();
+        for (Int_t i = 0; aliases && i < aliases->GetEntries(); ++i) task.chain->SetAlias(aliases->At(i)->GetName(), aliases->At(i)->GetTitle());
+        task.first = first + (last - first) * t / nThreads;
+        task.last  = first + (last - first) * (t + 1) / nThreads;
+        // formulas are compiled on the first file of the task, so other files are not opened
+        task.chain->LoadTree(task.first);
+        for (size_t k = 0; k < expressions.size(); ++k) {
+            task.formulas.push_back(new TTreeFormula("tf", expressions[k].data(), task.chain));
+            task.formulas.back()->SetQuickLoad(true);
+        }
+        task.chain->SetNotify(0);
+    }
+    
+    if (nThreads > 1) {
+        TThread::Initialize();
+        std::vector<TThread*> threads;
+        for (G4int t = 0; t < nThreads; ++t) {
+            threads.push_back(new TThread(TString::Format("BxGeneratorTTreePrewarm%d", t), PrewarmThreadFunction, &tasks[t]));
+            threads.back()->Run();
+        }
+        for (G4int t = 0; t < nThreads; ++t) {
+            threads[t]->Join();
+            delete threads[t];
+        }
+    } else if (nThreads == 1) {
+        PrewarmThreadFunction(&tasks[0]);
+    }
+    
+    for (G4int t = 0; t < nThreads; ++t) {
+        codes.insert(tasks[t].codes.begin(), tasks[t].codes.end());
+        for (size_t k = 0; k < tasks[t].formulas.size(); ++k) delete tasks[t].formulas[k];
+        delete tasks[t].chain;
+    }
+    
+    // particle and ion tables are filled from this thread only
+    G4int nIons = 0, nUnknown = 0;
+    for (std::set<G4int>::const_iterator it = codes.begin(); it != codes.end(); ++it) {
+        const G4ParticleDefinition* definition = FindDefinition(*it);
+        if (!definition) ++nUnknown;
+        else if (definition->IsGeneralIon()) ++nIons;
+    }
+    stopwatch.Stop();
+    BxLog(routine) << "Prewarm: " << codes.size() << " PDG codes found in entries [" << first << ", " << last << ") by "
+                   << nThreads << " threads, " << nIons << " ions created, " << nUnknown << " unknown, "
+                   << stopwatch.RealTime() << " s" << endlog;
+}
+
+G4bool BxGeneratorTTree::PullNextEntry(EntryBatch& batch) {
+    if (fPrefetchBuffer) return fPrefetchBuffer->Pop(batch);
+    const G4bool ok = ReadNextEntry(batch);
+    PublishReaderStats();
+    return ok;
+}
+
+void BxGeneratorTTree::PublishReaderStats() {
+    G4AutoLock lock(&gStatsMutex);
+    fReaderTotals.Add(fReaderStats);
+    fReaderStats.Clear();
+}
+
+void BxGeneratorTTree::PublishThreadStats() {
+    G4AutoLock lock(&gStatsMutex);
+    BxGeneratorTTreeStats& stats = gThreadStats[G4Threading::G4GetThreadId()];
+    stats = fStats;
+    stats.Add(fReaderTotals);
+}
+
+BxGeneratorTTreeStats BxGeneratorTTree::GetStats(G4bool allThreads) const {
+    BxGeneratorTTreeStats stats;
+    stats.SetTiming(fStats.IsTiming());
+    G4AutoLock lock(&gStatsMutex);
+    if (!allThreads) {
+        stats = fStats;
+        stats.Add(fReaderTotals);
+        return stats;
+    }
+    for (std::map<G4int, BxGeneratorTTreeStats>::const_iterator it = gThreadStats.begin(); it != gThreadStats.end(); ++it) {
+        stats.Add(it->second);
+    }
+    return stats;
+}
+
+G4double BxGeneratorTTree::UniformRand() {
+    return fPrefetchEngine ? fPrefetchEngine->flat() : G4UniformRand();
+}
+
+void BxGeneratorTTree::UniformRandArray(G4int n, G4double* values) {
+    if (fPrefetchEngine) fPrefetchEngine->flatArray(n, values);
+    else                 CLHEP::HepRandom::getTheEngine()->flatArray(n, values);
+}
+
+G4RotationMatrix BxGeneratorTTree::RandomRotation() {
+    G4double u[3];
+    UniformRandArray(3, u);
+    return G4RotationMatrix(twopi*u[0], std::acos(2.*u[1] - 1.), twopi*u[2]);
+}
+
+void BxGeneratorTTree::StartPrefetch() {
+    // Background reader must not share random engine with tracking, so it gets its own one seeded from the main engine
+    fPrefetchEngine = new CLHEP::HepJamesRandom(static_cast<long>(G4UniformRand() * 900000000.));
+    fPrefetchBuffer = new BxRingBuffer<EntryBatch>(fPrefetchDepth);
+    TThread::Initialize();
+    fPrefetchThread = new TThread("BxGeneratorTTreePrefetch", &BxGeneratorTTree::PrefetchThreadFunction, this);
+    fPrefetchThread->Run();
+    BxLog(routine) << "BxGeneratorTTree: reading up to " << fPrefetchDepth << " entries ahead in background thread" << endlog;
+}
+
+void BxGeneratorTTree::StopPrefetch() {
+    if (!fPrefetchThread) return;
+    fPrefetchBuffer->Close();
+    fPrefetchThread->Join();
+    delete fPrefetchThread;
+    delete fPrefetchBuffer;
+    delete fPrefetchEngine;
+    fPrefetchThread = 0;
+    fPrefetchBuffer = 0;
+    fPrefetchEngine = 0;
+}
+
+void BxGeneratorTTree::ReleaseSharedReader() {
+    TMutex& mutex = SharedReaderMutex();
+    mutex.Lock();
+    if (gSharedReaderOwner == this) {
+        // Reader thread works with the chain and formulas of this generator, so it is kept running until
+        // the whole input is in the buffer or no other generator is left to take it. Entries left in
+        // the closed buffer are still popped by the other generators, the last one deletes the buffer.
+        while (gSharedReaderUsers > 1 && !gSharedReaderDone) SharedReaderCondition().Wait();
+        // reader thread takes the mutex when it is done, so it is joined without it;
+        // the buffer is not deleted meanwhile, since this generator is still counted as its user
+        mutex.UnLock();
+        fPrefetchBuffer->Close();
+        fPrefetchThread->Join();
+        delete fPrefetchThread;
+        delete fPrefetchEngine;
+        fPrefetchThread = 0;
+        fPrefetchEngine = 0;
+        mutex.Lock();
+        gSharedReaderOwner = 0;
+    }
+    fPrefetchBuffer = 0;
+    if (--gSharedReaderUsers == 0) {
+        delete gSharedReaderBuffer;
+        gSharedReaderBuffer = 0;
+    }
+    SharedReaderCondition().Broadcast(); // owner may wait for the other generators to leave
+    mutex.UnLock();
+}
+
+void BxGeneratorTTree::RunPrefetch() {
+    EntryBatch batch;
+    for (;;) {
+        const G4bool ok = ReadNextEntry(batch);
+        PublishReaderStats();
+        if (!ok) break;
+        if (!fPrefetchBuffer->Push(batch)) return; // consumer has stopped
+    }
+    if (fSharedReader) {
+        TLockGuard lock(&SharedReaderMutex());
+        gSharedReaderDone = true;
+        SharedReaderCondition().Broadcast();
+    }
+    fPrefetchBuffer->Close();
+}
+
+void* BxGeneratorTTree::PrefetchThreadFunction(void* generator) {
+    static_cast<BxGeneratorTTree*>(generator)->RunPrefetch();
+    return 0;
+}
+
+void BxGeneratorTTree::WriteSnapshot(const G4String& filename) {
+    if (!fIsInitialized)  Initialize();
+    
+    BxLog(routine) << "BxGeneratorTTree: writing primaries to snapshot \"" << filename << "\"" << endlog;
+    TStopwatch stopwatch;
+    BxGeneratorTTreeSnapshotWriter writer(filename);
+    EntryBatch batch;
+    while (PullNextEntry(batch)) writer.Write(batch);
+    writer.Close();
+    stopwatch.Stop();
+    
+    if (fEndOfChain) BxLog(routine) << "End of Tree(Chain) reached" << endlog;
+    BxLog(routine) << "BxGeneratorTTree: " << writer.GetNEntries() << " entries with " << writer.GetNParticles()
+                   << " particles written to snapshot in " << stopwatch.RealTime() << " s" << endlog;
+}
+
+void BxGeneratorTTree::BxGeneratePrimaries(G4Event* event) {
+    if (!fIsInitialized)  Initialize();
+    
+    while (fParticleQueue.empty()) {
+        Long64_t start = fStats.Start();
+        const G4bool pulled = PullNextEntry(fEntryBatch);
+        fStats.Stop(BxGeneratorTTreeStats::kPull, start);
+        if (!pulled) {
+            // RunManager cannot abort the event from inside UserGeneratePrimaries(), so we do a soft abort
+            // to the RunManager, and abort the event ourselves. The result is the same as a hard abort.
+            // Run manager of the current thread, i.e. of the worker in MT mode.
+            G4RunManager::GetRunManager()->AbortRun(true);
+            event->SetEventAborted();
+            fEndOfInput = true;
+            if (fEndOfChain) BxLog(routine) << "End of Tree(Chain) reached" << endlog;
+            if (G4Threading::IsWorkerThread()) PublishThreadStats();
+            if (fStatsEvery > 0 || fStats.IsTiming()) GetStats(false).Log();
+            return;
+        }
+        fCurrentEntry = fEntryBatch.entry;
+        ++fNPulledEntries;
+        start = fStats.Start();
+        for (size_t i = 0; i < fEntryBatch.particles.size(); ++i) PushBackParticleInfo(fEntryBatch.particles[i]);
+        fStats.Stop(BxGeneratorTTreeStats::kQueue, start);
+    }
+    
+    ++fNGeneratedEvents;
     fCurrentParticlesInfo.clear();
+    fStats.Count(BxGeneratorTTreeStats::kEvents);
+    if (fStatsEvery > 0 && fNGeneratedEvents % fStatsEvery == 0) GetStats(false).Log();
+    
+    // severity is checked once per event, not for each line of each particle
+    const G4bool logPrimaries = fLogPrimariesInfo && (fNGeneratedEvents - 1) % fLogPrimariesEvery == 0
+                             && (fTraceWriter || BxLogger::GetSeverity() <= BxLogger::trace);
+    const G4bool logToLog     = logPrimaries && !fTraceWriter;
     
-    std::sort(fDequeParticleInfo.begin(), fDequeParticleInfo.end(), particle_info_compare_by_time);
+    // postponed particles are grouped by coincidence window, their times are given relative to the first one
+    G4bool hasPostponed = false;
+    fPostponedTimeOffset = 0.;
     
     do {
-        fCurrentParticlesInfo.push_back(fDequeParticleInfo.front());
-        fDequeParticleInfo.pop_front();
+        Long64_t start = fStats.Start();
+        if (!hasPostponed && fParticleQueue.begin()->second.status != 0) {
+            fPostponedTimeOffset = fParticleQueue.begin()->first;
+            hasPostponed = true;
+        }
+        fCurrentParticlesInfo.push_back(fParticleQueue.begin()->second);
+        fParticleQueue.erase(fParticleQueue.begin());
+        fStats.Stop(BxGeneratorTTreeStats::kQueue, start);
         
-        const ParticleInfo& particle_info = fCurrentParticlesInfo.back();
+        ParticleInfo& particle_info = fCurrentParticlesInfo.back();
         
-        G4ParticleDefinition* fParticle = G4ParticleTable::GetParticleTable()->FindParticle(particle_info.pdg_code);
-        if (!fParticle) {
-            fParticle = G4IonTable::GetIonTable()->GetIon(particle_info.pdg_code);
-            if (!fParticle) { // Skip unknown particle
-                BxLog(warning)
-                    << "  Entry " << fCurrentEntry
-                    << ", event_id = " << particle_info.event_id
-                    << " : particle #" << particle_info.p_index
-                    << " : WARNING!" << endlog;
-                BxLog(warning) << "  Skipping unknown particle with PDG code " << particle_info.pdg_code << endlog;
-                continue;
-            }
+        if (!particle_info.definition) particle_info.definition = FindDefinition(particle_info.pdg_code);
+        G4ParticleDefinition* fParticle = const_cast<G4ParticleDefinition*>(particle_info.definition);
+        if (!fParticle) { // Skip unknown particle
+            BxLog(warning)
+                << "  Entry " << particle_info.entry
+                << ", event_id = " << particle_info.event_id
+                << " : particle #" << particle_info.p_index
+                << " : WARNING!" << endlog;
+            BxLog(warning) << "  Skipping unknown particle with PDG code " << particle_info.pdg_code << endlog;
+            fCurrentParticlesInfo.pop_back(); // keep indices of vertices and particles info the same
+            continue;
         }
         
+        if (particle_info.energy < 0.) {
+            G4double mass = fParticle->GetPDGMass();
+            particle_info.energy = std::sqrt(mass*mass + particle_info.energy*particle_info.energy) - mass;
+        }
+        
+        start = fStats.Start();
         fParticleGun->SetParticleDefinition(fParticle);
         //g4bx2 behaves wrong with particles with zero kinetic energy
         fParticleGun->SetParticleEnergy(particle_info.energy ? particle_info.energy : 1e-100*eV);
         fParticleGun->SetParticleMomentumDirection(particle_info.momentum);
         fParticleGun->SetParticlePosition(particle_info.position);
-        fParticleGun->SetParticleTime(particle_info.status == 0 ? particle_info.time : 0);
+        fParticleGun->SetParticleTime(particle_info.status == 0 ? particle_info.time : particle_info.time - fPostponedTimeOffset);
         fParticleGun->SetParticlePolarization(particle_info.polarization);
         
         fParticleGun->GeneratePrimaryVertex(event);
+        if (particle_info.weight != 1.) {
+            // track weight is the product of vertex and particle weights, so only the particle one is set
+            event->GetPrimaryVertex(event->GetNumberOfPrimaryVertex() - 1)->GetPrimary()->SetWeight(particle_info.weight);
+        }
+        fStats.Stop(BxGeneratorTTreeStats::kGun, start);
+        fStats.Count(BxGeneratorTTreeStats::kParticles);
+        if (particle_info.status != 0) fStats.Count(BxGeneratorTTreeStats::kPostponed);
         
-        BxOutputVertex::Get()->SetEventID(particle_info.event_id);
-        if (fSavePrimariesInfo) {
+        start = fStats.Start();
+        if (fUseOutputVertex) BxOutputVertex::Get()->SetEventID(particle_info.event_id);
+        if (fUseOutputVertex && fSavePrimariesInfo) {
             BxOutputVertex::Get()->SetDId(particle_info.p_index);
             BxOutputVertex::Get()->SetDPDG(particle_info.pdg_code);
             BxOutputVertex::Get()->SetDEnergy(particle_info.energy/MeV);
@@ -254,11 +1588,18 @@ void BxGeneratorTTree::BxGeneratePrimaries(G4Event* event) {
             BxOutputVertex::Get()->SetDaughters();
             BxOutputVertex::Get()->SetUserInt1(particle_info.p_index);
             BxOutputVertex::Get()->SetUserInt2(particle_info.status);
+            BxOutputVertex::Get()->SetUserDouble(particle_info.weight);
             BxOutputVertex::Get()->SetUsers();
+            // user double is kept once per G4Event, so particles grouped in one G4Event must share weight to be saved right
+            if (!fMixedWeightsWarned && particle_info.weight != fCurrentParticlesInfo.front().weight) {
+                BxLog(warning) << "Particles of one G4Event have different weights, only the last one is saved to BxOutputVertex. "
+                               << "Weights of primary tracks are right, per-particle weights are also in truth file" << endlog;
+                fMixedWeightsWarned = true;
+            }
         }
         
-        if (fLogPrimariesInfo) {
-            BxLog(trace) << "  Entry " << fCurrentEntry
+        if (logToLog) {
+            BxLog(trace) << "  Entry " << particle_info.entry
                          << ", event_id = " << particle_info.event_id
                          << " : particle #" << particle_info.p_index
                          << (particle_info.status != 0 ? TString::Format(", POSTPONED'%d", particle_info.status) : "")
@@ -269,7 +1610,41 @@ void BxGeneratorTTree::BxGeneratePrimaries(G4Event* event) {
             BxLog(trace) << "    position = " << G4BestUnit(particle_info.position, "Length") << endlog;
             BxLog(trace) << "    time = " << G4BestUnit(particle_info.time, "Time") << endlog;
         }
-    } while (!fDequeParticleInfo.empty() && (fCurrentParticlesInfo.back().status == 0 || fDequeParticleInfo.front().time == fCurrentParticlesInfo.back().time));
+        fStats.Stop(BxGeneratorTTreeStats::kOutput, start);
+    } while (!fParticleQueue.empty() && (fCurrentParticlesInfo.empty() || fCurrentParticlesInfo.back().status == 0
+             || (fParticleQueue.begin()->first - fCurrentParticlesInfo.back().time <= fCoincidenceWindow
+                 && (fCoincidenceGate < 0. || fParticleQueue.begin()->first - fPostponedTimeOffset <= fCoincidenceGate))));
+    
+    const Long64_t start = fStats.Start();
+    // event of postponed particles may group particles of several entries, the entry of its first particle is the event's one
+    const Long64_t entry = fCurrentParticlesInfo.empty() ? fCurrentEntry : fCurrentParticlesInfo.front().entry;
+    if (fTruthWriter) fTruthWriter->Write(event->GetEventID(), entry, fCurrentParticlesInfo);
+    if (logPrimaries && fTraceWriter) fTraceWriter->Write(event->GetEventID(), entry, fCurrentParticlesInfo);
+    fStats.Stop(BxGeneratorTTreeStats::kOutput, start);
+    
+    if (G4Threading::IsWorkerThread()) PublishThreadStats();
+    // Last event of run. In MT mode event ids are global, so the worker which generates it logs the sum of all workers.
+    const G4Run* run = G4RunManager::GetRunManager()->GetCurrentRun();
+    if ((fStatsEvery > 0 || fStats.IsTiming()) && run && event->GetEventID() + 1 == run->GetNumberOfEventToBeProcessed()) {
+        BxLog(routine) << "BxGeneratorTTree: end of run " << run->GetRunID() << endlog;
+        GetStats(G4Threading::IsWorkerThread()).Log();
+    }
+}
+
+void BxGeneratorTTree::ReportStats(const G4String& filename) {
+    // In MT mode the master generates nothing, it reports what worker generators have published
+    G4bool allThreads = false;
+    if (!G4Threading::IsWorkerThread()) {
+        G4AutoLock lock(&gStatsMutex);
+        allThreads = !gThreadStats.empty();
+    }
+    const BxGeneratorTTreeStats stats = GetStats(allThreads);
+    if (allThreads) BxLog(routine) << "BxGeneratorTTree: sum of worker generators" << endlog;
+    stats.Log();
+    if (filename.empty()) return;
+    const G4String threadFileName = ThreadFileName(filename);
+    if (stats.Dump(threadFileName)) BxLog(routine) << "BxGeneratorTTree: stats written to \"" << threadFileName << "\"" << endlog;
+    else                            BxLog(warning) << "Cannot write stats to \"" << threadFileName << "\"" << endlog;
 }
 
 
@@ -278,6 +1653,7 @@ void BxGeneratorTTree::PushFrontParticleInfo(G4int event_id, G4int p_index, G4in
     const G4ThreeVector& position, G4double time, const G4ThreeVector& polarization) {
         ParticleInfo particle_info;
         particle_info.event_id = event_id;
+        particle_info.entry = fCurrentEntry; // source is not known, entry of the current G4Event is taken
         particle_info.p_index = p_index;
         particle_info.status = status;
         particle_info.pdg_code = pdg_code;
@@ -286,7 +1662,9 @@ void BxGeneratorTTree::PushFrontParticleInfo(G4int event_id, G4int p_index, G4in
         particle_info.position = position;
         particle_info.time = time;
         particle_info.polarization = polarization;
-        fDequeParticleInfo.push_front(particle_info);
+        particle_info.definition = 0;
+        particle_info.weight = 1.;
+        PushFrontParticleInfo(particle_info);
 }
 
 void BxGeneratorTTree::PushBackParticleInfo(G4int event_id, G4int p_index, G4int status,
@@ -294,6 +1672,7 @@ void BxGeneratorTTree::PushBackParticleInfo(G4int event_id, G4int p_index, G4int
     const G4ThreeVector& position, G4double time, const G4ThreeVector& polarization) {
         ParticleInfo particle_info;
         particle_info.event_id = event_id;
+        particle_info.entry = fCurrentEntry; // source is not known, entry of the current G4Event is taken
         particle_info.p_index = p_index;
         particle_info.status = status;
         particle_info.pdg_code = pdg_code;
@@ -302,12 +1681,33 @@ void BxGeneratorTTree::PushBackParticleInfo(G4int event_id, G4int p_index, G4int
         particle_info.position = position;
         particle_info.time = time;
         particle_info.polarization = polarization;
-        fDequeParticleInfo.push_back(particle_info);
+        particle_info.definition = 0;
+        particle_info.weight = 1.;
+        PushBackParticleInfo(particle_info);
 }
 
 
+namespace {
+    /// Check that expression is just a number, like the defaults of all fields
+    G4bool IsNumericLiteral(const char* expression, Double_t& value) {
+        char* end = 0;
+        value = std::strtod(expression, &end);
+        if (end == expression) return false;
+        while (*end && std::isspace(*end)) ++end;
+        return *end == 0;
+    }
+}
+
 BxGeneratorTTree::SubEventConfigTTF::SubEventConfigTTF(TChain* pTreeChain)
 : fTreeChain(pTreeChain)
+, fJit(0)
+, fJitIndices(kNFormulas, -1)
+, fAllJit(false)
+, fFormulas()
+, fIsPlainLeaf()
+, fFieldKinds()
+, fConstants()
+, fNPerParticle(0)
 , fUnitEnergy(MeV)
 , fUnitMomentum(MeV)
 , fUnitPosition(m)
@@ -440,24 +1840,167 @@ void BxGeneratorTTree::SubEventConfigTTF::Initialize() {
     if (fFormulaPolarizationZ    ->GetMultiplicity()) fTTFmanager->Add(fFormulaPolarizationZ    );
     
     fTTFmanager->Sync();
+    
+    GetFormulas(fFormulas);
+    fIsPlainLeaf.assign(fFormulas.size(), false);
+    for (size_t k = 0; k < fFormulas.size(); ++k) {
+        TLeaf* leaf = (fFormulas[k]->GetNcodes() == 1) ? fFormulas[k]->GetLeaf(0) : 0;
+        if (!leaf || leaf->InheritsFrom("TLeafElement") || leaf->InheritsFrom("TLeafC")) continue;
+        const std::string title = fFormulas[k]->GetTitle();
+        fIsPlainLeaf[k] = (title == leaf->GetName() || title == leaf->GetBranch()->GetName() || title == std::string(leaf->GetBranch()->GetName()) + "." + leaf->GetName());
+    }
+    
+    fFieldKinds.assign(fFormulas.size(), kPerParticle);
+    fConstants.assign(fFormulas.size(), 0.);
+    fNPerParticle = 0;
+    for (size_t k = 0; k < fFormulas.size(); ++k) {
+             if (IsNumericLiteral(fFormulas[k]->GetTitle(), fConstants[k])) fFieldKinds[k] = kConstant;
+        else if (!fFormulas[k]->GetMultiplicity())                          fFieldKinds[k] = kEventScalar;
+        else                                                                ++fNPerParticle;
+    }
+}
+
+void BxGeneratorTTree::SubEventConfigTTF::GetFormulas(std::vector<TTreeFormula*>& formulas) const {
+    formulas.push_back(fFormulaSubEventRotateIso);
+    formulas.push_back(fFormulaNParticles       );
+    formulas.push_back(fFormulaParticleSkip     );
+    formulas.push_back(fFormulaParticleRotateIso);
+    formulas.push_back(fFormulaPdg              );
+    formulas.push_back(fFormulaEnergy           );
+    formulas.push_back(fFormulaMomentumX        );
+    formulas.push_back(fFormulaMomentumY        );
+    formulas.push_back(fFormulaMomentumZ        );
+    formulas.push_back(fFormulaPositionX        );
+    formulas.push_back(fFormulaPositionY        );
+    formulas.push_back(fFormulaPositionZ        );
+    formulas.push_back(fFormulaTime             );
+    formulas.push_back(fFormulaPolarizationX    );
+    formulas.push_back(fFormulaPolarizationY    );
+    formulas.push_back(fFormulaPolarizationZ    );
+}
+
+void BxGeneratorTTree::SubEventConfigTTF::SetupJit(BxGeneratorTTreeJit* jit) {
+    fJit = jit;
+    std::vector<TTreeFormula*> formulas;
+    GetFormulas(formulas);
+    fAllJit = true;
+    for (size_t k = 0; k < formulas.size(); ++k) {
+        fJitIndices[k] = fJit->Add(formulas[k]->GetTitle());
+        fAllJit &= (fJitIndices[k] >= 0);
+    }
+}
+
+Int_t BxGeneratorTTree::SubEventConfigTTF::GetNdata() {
+    if (!fNPerParticle) return 1;
+    // TTreeFormulaManager also loads branches of interpreted formulas
+    return fAllJit ? fJit->GetNdata(fJitIndices) : fTTFmanager->GetNdata();
 }
 
-Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalSubEventRotateIso(       ) const { return fFormulaSubEventRotateIso->EvalInstance64(0); }
-Long64_t BxGeneratorTTree::SubEventConfigTTF::EvalNParticles       (       ) const { return fFormulaNParticles       ->EvalInstance64(0); }
-Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalParticleSkip     (Int_t i) const { return fFormulaParticleSkip     ->EvalInstance64(i); }
-Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalParticleRotateIso(Int_t i) const { return fFormulaParticleRotateIso->EvalInstance64(i); }
-Long64_t BxGeneratorTTree::SubEventConfigTTF::EvalPdg              (Int_t i) const { return fFormulaPdg              ->EvalInstance64(i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalEnergy           (Int_t i) const { return fFormulaEnergy           ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumX        (Int_t i) const { return fFormulaMomentumX        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumY        (Int_t i) const { return fFormulaMomentumY        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumZ        (Int_t i) const { return fFormulaMomentumZ        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionX        (Int_t i) const { return fFormulaPositionX        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionY        (Int_t i) const { return fFormulaPositionY        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionZ        (Int_t i) const { return fFormulaPositionZ        ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalTime             (Int_t i) const { return fFormulaTime             ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationX    (Int_t i) const { return fFormulaPolarizationX    ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationY    (Int_t i) const { return fFormulaPolarizationY    ->EvalInstance  (i); }
-Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationZ    (Int_t i) const { return fFormulaPolarizationZ    ->EvalInstance  (i); }
+G4int BxGeneratorTTree::SubEventConfigTTF::CrossCheck() {
+    if (!fJit) return 0;
+    G4int mismatches = 0;
+    const Int_t ndata = fTTFmanager->GetNdata();
+    if (fAllJit && fJit->GetNdata(fJitIndices) != ndata) {
+        BxLog(warning) << "Backend cross-check: number of instances is " << fJit->GetNdata(fJitIndices) << " (compiled) vs " << ndata << " (interpreted)" << endlog;
+        ++mismatches;
+    }
+    std::vector<TTreeFormula*> formulas;
+    GetFormulas(formulas);
+    for (size_t k = 0; k < formulas.size(); ++k) {
+        if (fJitIndices[k] < 0) continue;
+        const Int_t n = formulas[k]->GetMultiplicity() ? ndata : 1;
+        for (Int_t i = 0; i < n; ++i) {
+            const Double_t interpreted = formulas[k]->EvalInstance(i);
+            const Double_t compiled    = fJit->Eval(fJitIndices[k], i);
+            if (!BxGeneratorTTreeJit::IsClose(interpreted, compiled)) {
+                BxLog(warning) << "Backend cross-check: \"" << formulas[k]->GetTitle() << "\" instance " << i
+                               << " is " << compiled << " (compiled) vs " << interpreted << " (interpreted)" << endlog;
+                ++mismatches;
+                break;
+            }
+        }
+    }
+    return mismatches;
+}
+
+namespace {
+    template <class T>
+    void CopyLeafColumn(const void* buffer, Int_t n, Double_t* column) {
+        const T* values = static_cast<const T*>(buffer);
+        for (Int_t i = 0; i < n; ++i) column[i] = values[i];
+    }
+    
+    /// Copy numeric leaf buffer to column, returns false for unsupported type
+    G4bool CopyLeafColumn(const TLeaf* leaf, Int_t n, Double_t* column) {
+        const void* buffer = leaf->GetValuePointer();
+        const std::string type = leaf->GetTypeName();
+        if (!buffer) return false;
+             if (type == "Double_t" ) CopyLeafColumn<Double_t >(buffer, n, column);
+        else if (type == "Float_t"  ) CopyLeafColumn<Float_t  >(buffer, n, column);
+        else if (type == "Int_t"    ) CopyLeafColumn<Int_t    >(buffer, n, column);
+        else if (type == "UInt_t"   ) CopyLeafColumn<UInt_t   >(buffer, n, column);
+        else if (type == "Long64_t" ) CopyLeafColumn<Long64_t >(buffer, n, column);
+        else if (type == "ULong64_t") CopyLeafColumn<ULong64_t>(buffer, n, column);
+        else if (type == "Short_t"  ) CopyLeafColumn<Short_t  >(buffer, n, column);
+        else if (type == "UShort_t" ) CopyLeafColumn<UShort_t >(buffer, n, column);
+        else if (type == "UChar_t"  ) CopyLeafColumn<UChar_t  >(buffer, n, column);
+        else if (type == "Bool_t"   ) CopyLeafColumn<Bool_t   >(buffer, n, column);
+        else return false;
+        return true;
+    }
+}
+
+void BxGeneratorTTree::SubEventConfigTTF::EvalColumn(EFormula k, Int_t n, Double_t* column) const {
+    TTreeFormula* formula = fFormulas[k];
+    if (n <= 0) return;
+    if (fFieldKinds[k] != kPerParticle) {
+        std::fill(column, column + n, Eval(k, formula, 0));
+        return;
+    }
+    // Leaf buffer of the current entry is copied as a whole. Bulk reading of baskets (TBranch::GetBulkRead)
+    // is available only in recent ROOT 6 releases, while the generator is built with ROOT 5.34 as well.
+    if (fIsPlainLeaf[k]) {
+        formula->EvalInstance(0); // loads branch of the current entry, if it is not loaded yet
+        const TLeaf* leaf = formula->GetLeaf(0);
+        const Int_t len = std::min(n, leaf ? leaf->GetLen() : 0);
+        if (leaf && CopyLeafColumn(leaf, len, column)) {
+            std::fill(column + len, column + n, 0.); // instances out of range, same as TTreeFormula
+            return;
+        }
+    }
+    if (fJitIndices[k] >= 0) {
+        for (Int_t i = 0; i < n; ++i) column[i] = fJit->Eval(fJitIndices[k], i);
+    } else {
+        for (Int_t i = 0; i < n; ++i) column[i] = formula->EvalInstance(i);
+    }
+}
+
+Double_t BxGeneratorTTree::SubEventConfigTTF::Eval(EFormula k, TTreeFormula* formula, Int_t i) const {
+    if (fFieldKinds[k] == kConstant) return fConstants[k];
+    return (fJitIndices[k] >= 0) ? fJit->Eval(fJitIndices[k], i) : formula->EvalInstance(i);
+}
+
+Long64_t BxGeneratorTTree::SubEventConfigTTF::Eval64(EFormula k, TTreeFormula* formula, Int_t i) const {
+    if (fFieldKinds[k] == kConstant) return Long64_t(fConstants[k]);
+    return (fJitIndices[k] >= 0) ? Long64_t(fJit->Eval(fJitIndices[k], i)) : formula->EvalInstance64(i);
+}
+
+Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalSubEventRotateIso(       ) const { return Eval64(kSubEventRotateIso, fFormulaSubEventRotateIso, 0); }
+Long64_t BxGeneratorTTree::SubEventConfigTTF::EvalNParticles       (       ) const { return Eval64(kNParticles       , fFormulaNParticles       , 0); }
+Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalParticleSkip     (Int_t i) const { return Eval64(kParticleSkip     , fFormulaParticleSkip     , i); }
+Bool_t   BxGeneratorTTree::SubEventConfigTTF::EvalParticleRotateIso(Int_t i) const { return Eval64(kParticleRotateIso, fFormulaParticleRotateIso, i); }
+Long64_t BxGeneratorTTree::SubEventConfigTTF::EvalPdg              (Int_t i) const { return Eval64(kPdg              , fFormulaPdg              , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalEnergy           (Int_t i) const { return Eval  (kEnergy           , fFormulaEnergy           , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumX        (Int_t i) const { return Eval  (kMomentumX        , fFormulaMomentumX        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumY        (Int_t i) const { return Eval  (kMomentumY        , fFormulaMomentumY        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalMomentumZ        (Int_t i) const { return Eval  (kMomentumZ        , fFormulaMomentumZ        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionX        (Int_t i) const { return Eval  (kPositionX        , fFormulaPositionX        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionY        (Int_t i) const { return Eval  (kPositionY        , fFormulaPositionY        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPositionZ        (Int_t i) const { return Eval  (kPositionZ        , fFormulaPositionZ        , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalTime             (Int_t i) const { return Eval  (kTime             , fFormulaTime             , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationX    (Int_t i) const { return Eval  (kPolarizationX    , fFormulaPolarizationX    , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationY    (Int_t i) const { return Eval  (kPolarizationY    , fFormulaPolarizationY    , i); }
+Double_t BxGeneratorTTree::SubEventConfigTTF::EvalPolarizationZ    (Int_t i) const { return Eval  (kPolarizationZ    , fFormulaPolarizationZ    , i); }
 
 const G4String& BxGeneratorTTree::SubEventConfigTTF::LogMessage() {
     std::stringstream ss;
@@ -486,6 +2029,16 @@ const G4String& BxGeneratorTTree::SubEventConfigTTF::LogMessage() {
 BxGeneratorTTree::EventConfigTTF::EventConfigTTF(TChain* pTreeChain)
 : fTreeChain(pTreeChain)
 , fEventIdIsSet(false)
+, fJit(0)
+, fJitEventId(-1)
+, fJitEventSkip(-1)
+, fJitEventRotateIso(-1)
+, fIsConstEventId(false)
+, fIsConstEventSkip(false)
+, fIsConstEventRotateIso(false)
+, fConstEventId(0.)
+, fConstEventSkip(0.)
+, fConstEventRotateIso(0.)
 , fStringEventId       ("0")
 , fStringEventSkip     ("0")
 , fStringEventRotateIso("0")
@@ -498,13 +2051,14 @@ BxGeneratorTTree::EventConfigTTF::~EventConfigTTF() {
     delete fFormulaEventId;
     delete fFormulaEventSkip;
     delete fFormulaEventRotateIso;
+    delete fJit;
 }
 
 void BxGeneratorTTree::EventConfigTTF::AddSubEvent() {
     fSubEvents.push_back(new SubEventConfigTTF(fTreeChain));
 }
 
-void BxGeneratorTTree::EventConfigTTF::Initialize() {
+void BxGeneratorTTree::EventConfigTTF::Initialize(G4bool useJit) {
     fFormulaEventId        = new TTreeFormula("tf", fStringEventId       .data(), fTreeChain);
     fFormulaEventSkip      = new TTreeFormula("tf", fStringEventSkip     .data(), fTreeChain);
     fFormulaEventRotateIso = new TTreeFormula("tf", fStringEventRotateIso.data(), fTreeChain);
@@ -523,24 +2077,76 @@ void BxGeneratorTTree::EventConfigTTF::Initialize() {
         BxLog(error) << "\"EventRotateIso\" variable has wrong multiplicity!" << endlog;
         BxLog(fatal) << "FATAL " << endlog;
     }
+    fIsConstEventId        = IsNumericLiteral(fFormulaEventId       ->GetTitle(), fConstEventId       );
+    fIsConstEventSkip      = IsNumericLiteral(fFormulaEventSkip     ->GetTitle(), fConstEventSkip     );
+    fIsConstEventRotateIso = IsNumericLiteral(fFormulaEventRotateIso->GetTitle(), fConstEventRotateIso);
     for (size_t i = 0; i < fSubEvents.size(); ++i) {
         fSubEvents[i].Initialize();
         fNotifyGroup->push_back(fSubEvents[i].GetManager());
     }
     fTreeChain->SetNotify(fNotifyGroup);
+    
+    if (useJit) {
+        fJit = new BxGeneratorTTreeJit(fTreeChain);
+        fJitEventId        = fJit->Add(fFormulaEventId       ->GetTitle());
+        fJitEventSkip      = fJit->Add(fFormulaEventSkip     ->GetTitle());
+        fJitEventRotateIso = fJit->Add(fFormulaEventRotateIso->GetTitle());
+        for (size_t i = 0; i < fSubEvents.size(); ++i) fSubEvents[i].SetupJit(fJit);
+        BxLog(routine) << fJit->GetNFunctions() << " of " << 3 + fSubEvents.size() * SubEventConfigTTF::kNFormulas
+                       << " expressions are compiled by JIT backend" << endlog;
+    }
 }
 
-Long64_t BxGeneratorTTree::EventConfigTTF::EvalEventId       () { return fFormulaEventId       ->EvalInstance64(0); }
-Bool_t   BxGeneratorTTree::EventConfigTTF::EvalEventSkip     () { return fFormulaEventSkip     ->EvalInstance64(0); }
-Bool_t   BxGeneratorTTree::EventConfigTTF::EvalEventRotateIso() { return fFormulaEventRotateIso->EvalInstance64(0); }
+void BxGeneratorTTree::EventConfigTTF::PrepareEntry() {
+    if (fJit) fJit->LoadEntry();
+}
+
+G4int BxGeneratorTTree::EventConfigTTF::CrossCheck() {
+    if (!fJit) return 0;
+    PrepareEntry();
+    G4int mismatches = 0;
+    TTreeFormula* formulas[3] = { fFormulaEventId, fFormulaEventSkip, fFormulaEventRotateIso };
+    G4int         indices [3] = { fJitEventId    , fJitEventSkip    , fJitEventRotateIso     };
+    for (G4int k = 0; k < 3; ++k) {
+        if (indices[k] < 0) continue;
+        formulas[k]->GetNdata();
+        const Double_t interpreted = formulas[k]->EvalInstance(0);
+        const Double_t compiled    = fJit->Eval(indices[k], 0);
+        if (!BxGeneratorTTreeJit::IsClose(interpreted, compiled)) {
+            BxLog(warning) << "Backend cross-check: \"" << formulas[k]->GetTitle() << "\" is "
+                           << compiled << " (compiled) vs " << interpreted << " (interpreted)" << endlog;
+            ++mismatches;
+        }
+    }
+    for (size_t i = 0; i < fSubEvents.size(); ++i) mismatches += fSubEvents[i].CrossCheck();
+    return mismatches;
+}
+
+Long64_t BxGeneratorTTree::EventConfigTTF::EvalEventId       () { if (fIsConstEventId       ) return Long64_t(fConstEventId       ); return (fJitEventId        >= 0) ? Long64_t(fJit->Eval(fJitEventId       , 0)) : fFormulaEventId       ->EvalInstance64(0); }
+Bool_t   BxGeneratorTTree::EventConfigTTF::EvalEventSkip     () { if (fIsConstEventSkip     ) return Long64_t(fConstEventSkip     ); return (fJitEventSkip      >= 0) ? Long64_t(fJit->Eval(fJitEventSkip     , 0)) : fFormulaEventSkip     ->EvalInstance64(0); }
+Bool_t   BxGeneratorTTree::EventConfigTTF::EvalEventRotateIso() { if (fIsConstEventRotateIso) return Long64_t(fConstEventRotateIso); return (fJitEventRotateIso >= 0) ? Long64_t(fJit->Eval(fJitEventRotateIso, 0)) : fFormulaEventRotateIso->EvalInstance64(0); }
 
-void BxGeneratorTTree::EventConfigTTF::CheckInOnEntry(G4int entry_number) {
+Bool_t BxGeneratorTTree::EventConfigTTF::EvalEventSkipOnEntry(Long64_t entry_number) {
+    fTreeChain->LoadTree(entry_number);
+    PrepareEntry();
+    if (fJitEventSkip < 0 && !fIsConstEventSkip) fFormulaEventSkip->GetNdata();
+    return EvalEventSkip();
+}
+
+void BxGeneratorTTree::EventConfigTTF::CheckInOnEntry(Long64_t entry_number) {
     fTreeChain->LoadTree(entry_number);
     for (size_t i = 0; i < fSubEvents.size(); ++i) {
-        fSubEvents[i].GetManager()->GetNdata();
+        fSubEvents[i].GetNdata();
     }
 }
 
+void BxGeneratorTTree::EventConfigTTF::GetFormulas(std::vector<TTreeFormula*>& formulas) const {
+    formulas.push_back(fFormulaEventId       );
+    formulas.push_back(fFormulaEventSkip     );
+    formulas.push_back(fFormulaEventRotateIso);
+    for (size_t i = 0; i < fSubEvents.size(); ++i) fSubEvents[i].GetFormulas(formulas);
+}
+
 void BxGeneratorTTree::EventConfigTTF::Log() {
     std::stringstream ss;
     ss << "\nTTreeFormula-s :"
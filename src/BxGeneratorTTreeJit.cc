@@ -0,0 +1,275 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "TChain.h"
+#include "TLeaf.h"
+#include "TBranch.h"
+#include "TInterpreter.h"
+#include "RVersion.h"
+
+#include "BxGeneratorTTreeJit.hh"
+#include "BxLogger.hh"
+
+#include <sstream>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+#include <climits>
+
+namespace {
+    G4int gNJitInstances = 0;
+
+    /// Functions which can be used in expressions and their C++ names
+    const char* const kFunctions[][2] = {
+        { "sqrt" , "std::sqrt"  }, { "TMath::Sqrt" , "std::sqrt"  },
+        { "exp"  , "std::exp"   }, { "TMath::Exp"  , "std::exp"   },
+        { "log"  , "std::log"   }, { "TMath::Log"  , "std::log"   },
+        { "log10", "std::log10" }, { "TMath::Log10", "std::log10" },
+        { "pow"  , "std::pow"   }, { "TMath::Power", "std::pow"   },
+        { "abs"  , "std::fabs"  }, { "TMath::Abs"  , "std::fabs"  },
+        { "fabs" , "std::fabs"  },
+        { "sin"  , "std::sin"   }, { "TMath::Sin"  , "std::sin"   },
+        { "cos"  , "std::cos"   }, { "TMath::Cos"  , "std::cos"   },
+        { "tan"  , "std::tan"   }, { "TMath::Tan"  , "std::tan"   },
+        { "asin" , "std::asin"  }, { "TMath::ASin" , "std::asin"  },
+        { "acos" , "std::acos"  }, { "TMath::ACos" , "std::acos"  },
+        { "atan" , "std::atan"  }, { "TMath::ATan" , "std::atan"  },
+        { "atan2", "std::atan2" }, { "TMath::ATan2", "std::atan2" },
+        { 0, 0 }
+    };
+
+    const char* FindFunction(const std::string& name) {
+        for (G4int i = 0; kFunctions[i][0]; ++i) if (name == kFunctions[i][0]) return kFunctions[i][1];
+        return 0;
+    }
+
+    /// Leaf types which compiled code can read directly
+    G4bool IsSupportedType(const std::string& type) {
+        static const char* const types[] = {
+            "Double_t", "Float_t", "Int_t", "UInt_t", "Long64_t", "ULong64_t",
+            "Short_t", "UShort_t", "UChar_t", "Bool_t", 0
+        };
+        for (G4int i = 0; types[i]; ++i) if (type == types[i]) return true;
+        return false;
+    }
+}
+
+BxGeneratorTTreeJit::BxGeneratorTTreeJit(TChain* chain)
+: fTreeChain(chain)
+, fId(gNJitInstances++)
+, fTreeNumber(-1)
+, fTree(0)
+, fLoadedEntry(-1)
+{
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,0,0)
+    BxLog(warning) << "JIT backend requires ROOT 6 (Cling), interpreted backend is used for all expressions" << endlog;
+#endif
+}
+
+BxGeneratorTTreeJit::~BxGeneratorTTreeJit() {
+    // compiled functions stay in interpreter, do NOT delete pointer to TreeChain
+}
+
+G4int BxGeneratorTTreeJit::Add(const G4String& expression) {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,0,0)
+    std::string code;
+    std::vector<G4int> leaves;
+    if (!Translate(expression.data(), code, leaves, 0)) {
+        BxLog(routine) << "Expression \"" << expression << "\" is not supported by JIT backend, it is interpreted" << endlog;
+        return -1;
+    }
+
+    std::stringstream name;
+    name << "bx_jit_" << fId << "_" << fFunctions.size();
+    std::stringstream src;
+    src << "namespace BxGeneratorTTreeJitCode {\n"
+        << "Double_t " << name.str() << "(const void* const* v, Int_t i) {\n"
+        << "    (void)v; (void)i;\n"
+        << "    return " << code << ";\n"
+        << "}\n"
+        << "}\n";
+    if (!gInterpreter->Declare(src.str().data())) {
+        BxLog(warning) << "Cannot compile expression \"" << expression << "\", it is interpreted" << endlog;
+        return -1;
+    }
+    Long_t address = gInterpreter->Calc(("(long)&BxGeneratorTTreeJitCode::" + name.str()).data());
+    if (!address) {
+        BxLog(warning) << "Cannot get compiled function of expression \"" << expression << "\", it is interpreted" << endlog;
+        return -1;
+    }
+
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+    fFunctions.push_back(reinterpret_cast<Function>(address));
+    fFunctionLeaves.push_back(leaves);
+    fNdata.push_back(leaves.empty() ? INT_MAX : 0);
+    fLoadedEntry = -1;
+    BxLog(debugging) << "Expression \"" << expression << "\" is compiled as " << code << endlog;
+    return fFunctions.size() - 1;
+#else
+    (void)expression;
+    return -1;
+#endif
+}
+
+G4bool BxGeneratorTTreeJit::Translate(const std::string& expression, std::string& code, std::vector<G4int>& leaves, G4int depth) {
+    if (depth > 10) return false; // recursive aliases
+
+    std::stringstream out;
+    size_t pos = 0;
+    const size_t size = expression.size();
+    while (pos < size) {
+        const char c = expression[pos];
+        if (std::isspace(c)) {
+            ++pos;
+        } else if (std::isdigit(c) || (c == '.' && pos + 1 < size && std::isdigit(expression[pos + 1]))) {
+            size_t end = pos;
+            G4bool isFloat = false;
+            while (end < size && (std::isdigit(expression[end]) || expression[end] == '.')) {
+                isFloat |= (expression[end] == '.');
+                ++end;
+            }
+            if (end < size && (expression[end] == 'e' || expression[end] == 'E')) {
+                isFloat = true;
+                ++end;
+                if (end < size && (expression[end] == '+' || expression[end] == '-')) ++end;
+                while (end < size && std::isdigit(expression[end])) ++end;
+            }
+            if (end < size && (std::isalnum(expression[end]) || expression[end] == '_')) return false; // suffixes, hex
+            // all numbers are double, as in TTreeFormula
+            out << expression.substr(pos, end - pos) << (isFloat ? "" : ".");
+            pos = end;
+        } else if (std::isalpha(c) || c == '_') {
+            size_t end = pos;
+            while (end < size) {
+                if (std::isalnum(expression[end]) || expression[end] == '_' || expression[end] == '.') ++end;
+                else if (expression.compare(end, 2, "::") == 0) end += 2;
+                else break;
+            }
+            const std::string name = expression.substr(pos, end - pos);
+            pos = end;
+            size_t next = pos;
+            while (next < size && std::isspace(expression[next])) ++next;
+            if (next < size && (expression[next] == '[' || expression[next] == '$')) return false; // explicit indices, special functions
+
+            if (name == "TMath::Pi") {
+                // constant, empty argument list is dropped
+                while (next < size && (std::isspace(expression[next]) || expression[next] == '(')) ++next;
+                if (next >= size || expression[next] != ')') return false;
+                pos = next + 1;
+                out << "3.14159265358979323846";
+            } else if (next < size && expression[next] == '(') {
+                const char* function = FindFunction(name);
+                if (!function) return false;
+                out << function;
+            } else if (fTreeChain->GetAlias(name.data())) {
+                std::string alias;
+                if (!Translate(fTreeChain->GetAlias(name.data()), alias, leaves, depth + 1)) return false;
+                out << "(" << alias << ")";
+            } else {
+                G4int leaf = AddLeaf(name);
+                if (leaf < 0) return false;
+                leaves.push_back(leaf);
+                out << "Double_t(((const " << fLeafTypes[leaf] << "*)v[" << leaf << "])[" << (fLeafIsArray[leaf] ? "i" : "0") << "])";
+            }
+        } else {
+            static const char* const operators2[] = { "<=", ">=", "==", "!=", "&&", "||", 0 };
+            G4bool found = false;
+            for (G4int i = 0; operators2[i]; ++i) {
+                if (expression.compare(pos, 2, operators2[i]) == 0) {
+                    out << " " << operators2[i] << " ";
+                    pos += 2;
+                    found = true;
+                    break;
+                }
+            }
+            if (found) continue;
+            if (expression.compare(pos, 2, "**") == 0) return false;
+            // ^ is power and % is integer modulo in TTreeFormula, bitwise operators are not supported
+            if (std::string("+-*/()<>!?:,").find(c) == std::string::npos) return false;
+            out << c;
+            ++pos;
+        }
+    }
+    code = out.str();
+    return !code.empty();
+}
+
+G4int BxGeneratorTTreeJit::AddLeaf(const std::string& name) {
+    std::map<std::string,G4int>::const_iterator it = fLeafIndex.find(name);
+    if (it != fLeafIndex.end()) return it->second;
+
+    TLeaf* leaf = fTreeChain->GetLeaf(name.data());
+    if (!leaf) return -1;
+    const std::string type = leaf->GetTypeName();
+    if (!IsSupportedType(type) || leaf->InheritsFrom("TLeafElement") || leaf->InheritsFrom("TLeafC")) return -1;
+    if (leaf->GetLeafCount() && leaf->GetLenStatic() > 1) return -1; // multidimensional arrays
+
+    G4int index = fLeafNames.size();
+    fLeafIndex[name] = index;
+    fLeafNames.push_back(name);
+    fLeafTypes.push_back(type);
+    fLeafIsArray.push_back(leaf->GetLeafCount() || leaf->GetLenStatic() > 1);
+    fLeaves.push_back(0);
+    fValues.push_back(0);
+    fTree = 0; // leaves are resolved again by the next LoadEntry()
+    return index;
+}
+
+void BxGeneratorTTreeJit::ResolveLeaves() {
+    fBranches.clear();
+    for (size_t j = 0; j < fLeaves.size(); ++j) {
+        fLeaves[j] = fTree->GetLeaf(fLeafNames[j].data());
+        if (!fLeaves[j] || fLeafTypes[j] != fLeaves[j]->GetTypeName()) {
+            BxLog(error) << "Leaf \"" << fLeafNames[j] << "\" is missing or has different type in tree " << fTreeNumber << " of chain" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        TBranch* branches[2] = { fLeaves[j]->GetBranch(), fLeaves[j]->GetLeafCount() ? fLeaves[j]->GetLeafCount()->GetBranch() : 0 };
+        for (G4int k = 0; k < 2; ++k) {
+            if (branches[k] && std::find(fBranches.begin(), fBranches.end(), branches[k]) == fBranches.end()) fBranches.push_back(branches[k]);
+        }
+    }
+    fLoadedEntry = -1;
+}
+
+void BxGeneratorTTreeJit::LoadEntry() {
+    if (fLeaves.empty()) return;
+    TTree* tree = fTreeChain->GetTree();
+    if (!tree) return;
+    if (tree != fTree || fTreeChain->GetTreeNumber() != fTreeNumber) {
+        fTree = tree;
+        fTreeNumber = fTreeChain->GetTreeNumber();
+        ResolveLeaves();
+    }
+
+    const Long64_t entry = tree->GetReadEntry();
+    if (entry == fLoadedEntry) return;
+    for (size_t j = 0; j < fBranches.size(); ++j) fBranches[j]->GetEntry(entry);
+    for (size_t j = 0; j < fLeaves.size(); ++j) fValues[j] = fLeaves[j]->GetValuePointer();
+    for (size_t k = 0; k < fFunctions.size(); ++k) {
+        Int_t ndata = INT_MAX;
+        for (size_t j = 0; j < fFunctionLeaves[k].size(); ++j) {
+            const G4int leaf = fFunctionLeaves[k][j];
+            if (fLeafIsArray[leaf]) ndata = std::min(ndata, fLeaves[leaf]->GetLen());
+        }
+        fNdata[k] = ndata;
+    }
+    fLoadedEntry = entry;
+}
+
+Int_t BxGeneratorTTreeJit::GetNdata(const std::vector<G4int>& expressions) const {
+    Int_t ndata = INT_MAX;
+    for (size_t k = 0; k < expressions.size(); ++k) {
+        if (expressions[k] >= 0) ndata = std::min(ndata, fNdata[expressions[k]]);
+    }
+    return ndata == INT_MAX ? 1 : ndata;
+}
+
+G4bool BxGeneratorTTreeJit::IsClose(Double_t a, Double_t b) {
+    if (a == b) return true;
+    return std::fabs(a - b) <= 1e-9 * std::max(1., std::max(std::fabs(a), std::fabs(b)));
+}
@@ -16,8 +16,10 @@
 #include "G4UIcmdWithABool.hh"
 #include "G4UIcmdWithoutParameter.hh"
 #include "G4AnalysisUtilities.hh"
+#include "G4SystemOfUnits.hh"
 
 #include <sstream>
+#include <cstdlib>
 
 BxGeneratorTTreeMessenger::BxGeneratorTTreeMessenger(BxGeneratorTTree* gen)
 : fGenerator(gen)
@@ -27,26 +29,156 @@ BxGeneratorTTreeMessenger::BxGeneratorTTreeMessenger(BxGeneratorTTree* gen)
     
     fAddTreeCmd = new G4UIcmdWithAString("/bx/generator/ttree/add_tree", this);
     fAddTreeCmd->SetGuidance("Add ROOT TTree (TTree name and path to ROOT file with extension");
+    fAddTreeCmd->SetGuidance("Optional third parameter is number of entries in TTree, then file is opened only when it is read");
+    
+    fMetadataFileCmd = new G4UIcmdWithAString("/bx/generator/ttree/metadata_file", this);
+    fMetadataFileCmd->SetGuidance("Text file with cached number of entries, size and modification time of input files");
+    fMetadataFileCmd->SetGuidance("It is created on first use and updated for new or modified files");
+    fMetadataFileCmd->SetGuidance("Default:    none (files with unknown number of entries are opened at initialization)");
     
     fSetAliasCmd = new G4UIcmdWithAString("/bx/generator/ttree/set_alias", this);
     fSetAliasCmd->SetGuidance("Set alias for TTree formula (see TTree::SetAlias)");
     
-    fFirstEntryCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/first_entry", this);
+    // entry numbers are 64-bit, so they are parsed from strings
+    fFirstEntryCmd = new G4UIcmdWithAString("/bx/generator/ttree/first_entry", this);
     fFirstEntryCmd->SetGuidance("Set first TTree(Chain) entry number to be processed");
     fFirstEntryCmd->SetGuidance("Default:    0");
     
-    fNEntriesCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/n_entries", this);
+    fNEntriesCmd = new G4UIcmdWithAString("/bx/generator/ttree/n_entries", this);
     fNEntriesCmd->SetGuidance("Set number of TTree(Chain) entries to be processed");
     fNEntriesCmd->SetGuidance("Default:    all");
     
+    fBeamOnCmd = new G4UIcmdWithAString("/bx/generator/ttree/beam_on", this);
+    fBeamOnCmd->SetGuidance("Start run(s) with number of events given by input, use instead of /run/beamOn 2147483647");
+    fBeamOnCmd->SetGuidance("exact: count events at initialization, so that run knows its length (progress, ETA)");
+    fBeamOnCmd->SetGuidance("stream: generate events until the end of input");
+    fBeamOnCmd->SetGuidance("Events of postponed particles take some of counted events, the rest of input is streamed by extra runs");
+    fBeamOnCmd->SetGuidance("Inputs with more than 2^31-1 events are processed in several runs. Sequential mode only, not with pool");
+    fBeamOnCmd->SetGuidance("Default:    exact");
+    fBeamOnCmd->SetParameterName("mode", true);
+    fBeamOnCmd->SetDefaultValue("exact");
+    fBeamOnCmd->SetCandidates("exact stream");
+    fBeamOnCmd->SetToBeBroadcasted(false);
+    
+    fShardCmd = new G4UIcmdWithAString("/bx/generator/ttree/shard", this);
+    fShardCmd->SetGuidance("Process only shard i of N of the entries to be processed (i, N and path to plan file)");
+    fShardCmd->SetGuidance("Shards are aligned to TTree clusters and balanced by number of entries and particles");
+    fShardCmd->SetGuidance("Plan is built and written to the file if it is missing");
+    fShardCmd->SetGuidance("Default:    none (all entries)");
+    
     fLogPrimariesInfoCmd = new G4UIcmdWithABool("/bx/generator/ttree/log_primaries_info", this);
     fLogPrimariesInfoCmd->SetGuidance("Log primaries info (only in '/bxlog trace' mode)");
     fLogPrimariesInfoCmd->SetGuidance("Default:    1");
     
+    fLogPrimariesEveryCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/log_primaries_every", this);
+    fLogPrimariesEveryCmd->SetGuidance("Log primaries info of every N-th event only");
+    fLogPrimariesEveryCmd->SetGuidance("Default:    1");
+    
+    fTraceFileCmd = new G4UIcmdWithAString("/bx/generator/ttree/trace_file", this);
+    fTraceFileCmd->SetGuidance("Write primaries info to text file by background thread instead of log ('/bxlog trace' is not needed)");
+    fTraceFileCmd->SetGuidance("Default:    none (primaries info goes to log)");
+    
     fSavePrimariesInfoCmd = new G4UIcmdWithABool("/bx/generator/ttree/save_primaries_info", this);
     fSavePrimariesInfoCmd->SetGuidance("Save primaries mctruth info to output file");
     fSavePrimariesInfoCmd->SetGuidance("Default:    1");
     
+    fPrefetchDepthCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/prefetch_depth", this);
+    fPrefetchDepthCmd->SetGuidance("Set number of TTree(Chain) entries to be read ahead in background thread");
+    fPrefetchDepthCmd->SetGuidance("Default:    0 (no background reading)");
+    
+    fSharedReaderCmd = new G4UIcmdWithABool("/bx/generator/ttree/shared_reader", this);
+    fSharedReaderCmd->SetGuidance("Read TTree(Chain) once for all worker threads of multithreaded run");
+    fSharedReaderCmd->SetGuidance("Workers take entries one by one from background reader of the first initialized generator");
+    fSharedReaderCmd->SetGuidance("Default:    0");
+    
+    fSamplingWeightCmd = new G4UIcmdWithAString("/bx/generator/ttree/sampling_weight", this);
+    fSamplingWeightCmd->SetGuidance("Draw entries with probability proportional to the expression (Walker alias table)");
+    fSamplingWeightCmd->SetGuidance("Primary particles get compensating weight: mean weight over the range divided by weight of entry");
+    fSamplingWeightCmd->SetGuidance("Default:    none (entries are read one by one)");
+    
+    fSamplingDrawsCmd = new G4UIcmdWithAString("/bx/generator/ttree/sampling_draws", this);
+    fSamplingDrawsCmd->SetGuidance("Set number of entries to be drawn in sampling mode");
+    fSamplingDrawsCmd->SetGuidance("Default:    0 (number of entries in range)");
+    
+    fSamplingCacheDirCmd = new G4UIcmdWithAString("/bx/generator/ttree/sampling_cache_dir", this);
+    fSamplingCacheDirCmd->SetGuidance("Directory for alias tables cached by Tree(Chain), range and weight expression");
+    fSamplingCacheDirCmd->SetGuidance("Default:    none (no cache)");
+    
+    fPoolSizeCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/pool_size", this);
+    fPoolSizeCmd->SetGuidance("Load the first N accepted entries into memory and generate events by cycling over them");
+    fPoolSizeCmd->SetGuidance("Input is not read after initialization, number of events is given by /run/beamOn");
+    fPoolSizeCmd->SetGuidance("Default:    0 (no pool)");
+    
+    fPoolRotateIsoCmd = new G4UIcmdWithABool("/bx/generator/ttree/pool_rotate_iso", this);
+    fPoolRotateIsoCmd->SetGuidance("Rotate each event served from pool isotropically as a whole (momenta and polarizations)");
+    fPoolRotateIsoCmd->SetGuidance("Default:    1");
+    
+    fPoolTimeShiftCmd = new G4UIcmdWithAString("/bx/generator/ttree/pool_time_shift", this);
+    fPoolTimeShiftCmd->SetGuidance("Shift times of each event served from pool by random value uniform in [0, T)");
+    fPoolTimeShiftCmd->SetGuidance("Default:    0 ns");
+    
+    fCoincidenceWindowCmd = new G4UIcmdWithAString("/bx/generator/ttree/coincidence_window", this);
+    fCoincidenceWindowCmd->SetGuidance("Generate postponed particles closer in time than T to the previous one in one G4Event, with relative times");
+    fCoincidenceWindowCmd->SetGuidance("Default:    0 ns (only equal times)");
+    
+    fCoincidenceGateCmd = new G4UIcmdWithAString("/bx/generator/ttree/coincidence_gate", this);
+    fCoincidenceGateCmd->SetGuidance("Maximal time span of G4Event of postponed particles grouped by coincidence window");
+    fCoincidenceGateCmd->SetGuidance("Default:    none");
+    
+    fPruneBranchesCmd = new G4UIcmdWithABool("/bx/generator/ttree/prune_branches", this);
+    fPruneBranchesCmd->SetGuidance("Disable all TTree(Chain) branches which are not used by formulas and aliases");
+    fPruneBranchesCmd->SetGuidance("Branches read only by user code or by expressions which formulas cannot resolve are disabled too");
+    fPruneBranchesCmd->SetGuidance("Default:    0");
+    
+    fCacheSizeCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/cache_size", this);
+    fCacheSizeCmd->SetGuidance("Set size of TTreeCache in MB for branches used by formulas");
+    fCacheSizeCmd->SetGuidance("Default:    0 (ROOT default)");
+    
+    fWriteSnapshotCmd = new G4UIcmdWithAString("/bx/generator/ttree/write_snapshot", this);
+    fWriteSnapshotCmd->SetGuidance("Evaluate all entries to be processed and write primaries to binary snapshot file");
+    fWriteSnapshotCmd->SetGuidance("Generator-only run, no event is simulated");
+    
+    fReadSnapshotCmd = new G4UIcmdWithAString("/bx/generator/ttree/read_snapshot", this);
+    fReadSnapshotCmd->SetGuidance("Replay primaries from binary snapshot file instead of TTree(Chain)");
+    
+    fTruthFileCmd = new G4UIcmdWithAString("/bx/generator/ttree/truth_file", this);
+    fTruthFileCmd->SetGuidance("Write truth of primaries (flat TTree per particle and index by G4 event) to separate ROOT file");
+    fTruthFileCmd->SetGuidance("File is written in background thread, workers of multithreaded run write files with suffix _t<thread id>");
+    fTruthFileCmd->SetGuidance("Default:    none");
+    
+    fStatsCmd = new G4UIcmdWithAString("/bx/generator/ttree/stats", this);
+    fStatsCmd->SetGuidance("Log generator counters, rates and per-stage times, optional parameter is text file to write them to");
+    fStatsCmd->SetGuidance("In MT mode the master reports the sum of worker generators, workers write \"_t<thread id>\" files");
+    fStatsCmd->SetParameterName("file", true);
+    fStatsCmd->SetDefaultValue("");
+    
+    fStatsTimingCmd = new G4UIcmdWithABool("/bx/generator/ttree/stats_timing", this);
+    fStatsTimingCmd->SetGuidance("Measure time of generator stages: load_tree, evaluate, pull, queue, gun, output");
+    fStatsTimingCmd->SetGuidance("Default:    0 (only counters)");
+    
+    fStatsEveryCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/stats_every", this);
+    fStatsEveryCmd->SetGuidance("Log generator stats every N events, at the end of each run and of input");
+    fStatsEveryCmd->SetGuidance("Default:    0 (only by /bx/generator/ttree/stats)");
+    
+    fSkipIndexDirCmd = new G4UIcmdWithAString("/bx/generator/ttree/skip_index_dir", this);
+    fSkipIndexDirCmd->SetGuidance("Directory for cached indices of entries which pass event_skip_if condition");
+    fSkipIndexDirCmd->SetGuidance("Default:    none (no index)");
+    
+    fBackendCmd = new G4UIcmdWithAString("/bx/generator/ttree/backend", this);
+    fBackendCmd->SetGuidance("Evaluation backend of expressions: TTreeFormula (interpreted) or compiled by Cling (jit)");
+    fBackendCmd->SetGuidance("Expressions not supported by jit backend are interpreted");
+    fBackendCmd->SetGuidance("Default:    interpreted");
+    fBackendCmd->SetCandidates("interpreted jit");
+    
+    fBackendCrossCheckCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/backend_cross_check", this);
+    fBackendCrossCheckCmd->SetGuidance("Compare values of compiled and interpreted expressions on the first N entries");
+    fBackendCrossCheckCmd->SetGuidance("Default:    0");
+    
+    fPrewarmIonsCmd = new G4UIcmdWithAnInteger("/bx/generator/ttree/prewarm_ions", this);
+    fPrewarmIonsCmd->SetGuidance("Scan PDG codes of entries to be processed by N threads at initialization and create all needed ions");
+    fPrewarmIonsCmd->SetGuidance("With ROOT older than 6.06 the scan is done by one thread");
+    fPrewarmIonsCmd->SetGuidance("Default:    0 (no scan, ions are created on the first use)");
+    
     fEventIdCmd = new G4UIcmdWithAString("/bx/generator/ttree/event_id", this);
     fEventIdCmd->SetGuidance("Event id");
     
@@ -108,10 +240,37 @@ BxGeneratorTTreeMessenger::~BxGeneratorTTreeMessenger() {
     delete fDirectory;
     delete fAddTreeCmd;
     delete fSetAliasCmd;
+    delete fMetadataFileCmd;
     delete fFirstEntryCmd;
     delete fNEntriesCmd;
+    delete fShardCmd;
+    delete fBeamOnCmd;
     delete fLogPrimariesInfoCmd;
+    delete fLogPrimariesEveryCmd;
+    delete fTraceFileCmd;
     delete fSavePrimariesInfoCmd;
+    delete fPrefetchDepthCmd;
+    delete fSharedReaderCmd;
+    delete fPruneBranchesCmd;
+    delete fPoolSizeCmd;
+    delete fPoolRotateIsoCmd;
+    delete fPoolTimeShiftCmd;
+    delete fCoincidenceWindowCmd;
+    delete fCoincidenceGateCmd;
+    delete fSamplingWeightCmd;
+    delete fSamplingDrawsCmd;
+    delete fSamplingCacheDirCmd;
+    delete fCacheSizeCmd;
+    delete fWriteSnapshotCmd;
+    delete fReadSnapshotCmd;
+    delete fTruthFileCmd;
+    delete fStatsCmd;
+    delete fStatsTimingCmd;
+    delete fStatsEveryCmd;
+    delete fSkipIndexDirCmd;
+    delete fBackendCmd;
+    delete fBackendCrossCheckCmd;
+    delete fPrewarmIonsCmd;
     delete fEventIdCmd;
     delete fEventSkipCmd;
     delete fEventRotateIsoCmd;
@@ -132,12 +291,17 @@ void BxGeneratorTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue)
     if (cmd == fAddTreeCmd) {
         std::vector<G4String> tokens;
         G4Analysis::Tokenize(newValue, tokens);
-        if (tokens.size() != 2) {
+        if (tokens.size() != 2 && tokens.size() != 3) {
             LogCmd(cmdName, newValue, 0, WrongTokensNumber);
             BxLog(fatal) << "FATAL " << endlog;
         }
-        fGenerator->AddTree(tokens[0], tokens[1]);
-        BxLog(routine) << "BxGeneratorTTreeMessenger: added TTree \"" << tokens[0] << "\" from ROOT file \"" << tokens[1] << "\"" << endlog;
+        Long64_t nEntries = tokens.size() == 3 ? ConvertToEntry(cmdName, tokens[2]) : -1;
+        fGenerator->AddTree(tokens[0], tokens[1], nEntries);
+        BxLog(routine) << "BxGeneratorTTreeMessenger: added TTree \"" << tokens[0] << "\" from ROOT file \"" << tokens[1] << "\""
+                       << (nEntries >= 0 ? TString::Format(" with %lld entries", nEntries).Data() : "") << endlog;
+    } else if (cmd == fMetadataFileCmd) {
+        fGenerator->SetMetadataFile(newValue);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: entry counts of input files are cached in \"" << newValue << "\"" << endlog;
     } else if (cmd == fSetAliasCmd) {
         std::vector<G4String> tokens;
         G4Analysis::Tokenize(newValue, tokens);
@@ -148,20 +312,143 @@ void BxGeneratorTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue)
         fGenerator->SetAlias(tokens[0], tokens[1]);
         BxLog(routine) << "BxGeneratorTTreeMessenger: added alias \"" << tokens[0] << "\" for formula \"" << tokens[1] << "\"" << endlog;
     } else if (cmd == fFirstEntryCmd) {
-        fGenerator->SetFirstEntry(fFirstEntryCmd->ConvertToInt(newValue));
+        fGenerator->SetFirstEntry(ConvertToEntry(cmdName, newValue));
 	    BxLog(routine) << "BxGeneratorTTreeMessenger: first entry to be processed is " << newValue  << endlog;
     } else if (cmd == fNEntriesCmd) {
-        G4int value = fNEntriesCmd->ConvertToInt(newValue);
+        Long64_t value = ConvertToEntry(cmdName, newValue);
         fGenerator->SetNEntries(value);
 	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of entries to be processed is " << value << (value == 0 ? ". Zero means \"all\"" : "") << endlog;
+    } else if (cmd == fBeamOnCmd) {
+        LogCmd(cmdName, newValue, 0, Standard);
+        fGenerator->BeamOn(newValue == "exact");
+    } else if (cmd == fShardCmd) {
+        std::vector<G4String> tokens;
+        G4Analysis::Tokenize(newValue, tokens);
+        if (tokens.size() != 3) {
+            LogCmd(cmdName, newValue, 0, WrongTokensNumber);
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        G4int index   = G4UIcommand::ConvertToInt(tokens[0]);
+        G4int nShards = G4UIcommand::ConvertToInt(tokens[1]);
+        fGenerator->SetShard(index, nShards, tokens[2]);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: shard " << index << " of " << nShards << " with plan file \"" << tokens[2] << "\"" << endlog;
     } else if (cmd == fLogPrimariesInfoCmd) {
         G4bool value = fLogPrimariesInfoCmd->ConvertToBool(newValue);
         fGenerator->SetLogPrimariesInfo(value);
 	    BxLog(routine) << "BxGeneratorTTreeMessenger: log primaries info? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fLogPrimariesEveryCmd) {
+        G4int value = fLogPrimariesEveryCmd->ConvertToInt(newValue);
+        fGenerator->SetLogPrimariesEvery(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: primaries info of every " << value << "-th event is logged" << endlog;
+    } else if (cmd == fTraceFileCmd) {
+        fGenerator->SetTraceFile(newValue);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: primaries info is traced to \"" << newValue << "\"" << endlog;
     } else if (cmd == fSavePrimariesInfoCmd) {
         G4bool value = fSavePrimariesInfoCmd->ConvertToBool(newValue);
         fGenerator->SetSavePrimariesInfo(value);
 	    BxLog(routine) << "BxGeneratorTTreeMessenger: save primaries mctruth info? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fPrefetchDepthCmd) {
+        G4int value = fPrefetchDepthCmd->ConvertToInt(newValue);
+        fGenerator->SetPrefetchDepth(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of entries to be read ahead is " << value << (value <= 0 ? ". Background reading is off" : "") << endlog;
+    } else if (cmd == fSharedReaderCmd) {
+        G4bool value = fSharedReaderCmd->ConvertToBool(newValue);
+        fGenerator->SetSharedReader(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: share reader between threads? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fSamplingWeightCmd) {
+        fGenerator->SetSamplingWeight(newValue);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: entries are drawn with weight \"" << newValue << "\"" << endlog;
+    } else if (cmd == fSamplingDrawsCmd) {
+        Long64_t value = ConvertToEntry(cmdName, newValue);
+        fGenerator->SetSamplingDraws(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of entries to be drawn is " << value << (value <= 0 ? ". Zero means number of entries in range" : "") << endlog;
+    } else if (cmd == fSamplingCacheDirCmd) {
+        fGenerator->SetSamplingCacheDir(newValue);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: alias tables are cached in \"" << newValue << "\"" << endlog;
+    } else if (cmd == fPoolSizeCmd) {
+        G4int value = fPoolSizeCmd->ConvertToInt(newValue);
+        fGenerator->SetPoolSize(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of entries in pool is " << value << (value <= 0 ? ". No pool" : "") << endlog;
+    } else if (cmd == fPoolRotateIsoCmd) {
+        G4bool value = fPoolRotateIsoCmd->ConvertToBool(newValue);
+        fGenerator->SetPoolRotateIso(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: rotate events served from pool? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fPoolTimeShiftCmd) {
+        std::vector<G4String> tokens;
+        G4Analysis::Tokenize(newValue, tokens);
+        if (tokens.size() < 1 || tokens.size() > 2) {
+            LogCmd(cmdName, newValue, 0, WrongTokensNumber);
+            BxLog(fatal) << "FATAL " << endlog;
+        } else if (tokens.size() == 2 && G4UIcommand::CategoryOf(tokens[1]) != "Time") {
+            LogCmd(cmdName, newValue, 0, WrongUnit);
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        G4double unit = tokens.size() == 2 ? G4UIcommand::ValueOf(tokens[1]) : ns;
+        fGenerator->SetPoolTimeShift(G4UIcommand::ConvertToDouble(tokens[0]) * unit);
+        LogCmd(cmdName, newValue, 0, Standard);
+    } else if (cmd == fCoincidenceWindowCmd || cmd == fCoincidenceGateCmd) {
+        std::vector<G4String> tokens;
+        G4Analysis::Tokenize(newValue, tokens);
+        if (cmd == fCoincidenceGateCmd && tokens.size() == 1 && (tokens[0] == "none" || tokens[0] == "-1")) {
+            fGenerator->SetCoincidenceGate(-1.);
+        } else if (tokens.size() < 1 || tokens.size() > 2) {
+            LogCmd(cmdName, newValue, 0, WrongTokensNumber);
+            BxLog(fatal) << "FATAL " << endlog;
+        } else if (tokens.size() == 2 && G4UIcommand::CategoryOf(tokens[1]) != "Time") {
+            LogCmd(cmdName, newValue, 0, WrongUnit);
+            BxLog(fatal) << "FATAL " << endlog;
+        } else {
+            G4double unit  = tokens.size() == 2 ? G4UIcommand::ValueOf(tokens[1]) : ns;
+            G4double value = G4UIcommand::ConvertToDouble(tokens[0]) * unit;
+            if (value < 0.) {
+                BxLog(error) << "BxGeneratorTTreeMessenger: " << cmdName << " must not be negative" << endlog;
+                BxLog(fatal) << "FATAL " << endlog;
+            }
+            if (cmd == fCoincidenceWindowCmd) fGenerator->SetCoincidenceWindow(value);
+            else                              fGenerator->SetCoincidenceGate(value);
+        }
+        LogCmd(cmdName, newValue, 0, Standard);
+    } else if (cmd == fPruneBranchesCmd) {
+        G4bool value = fPruneBranchesCmd->ConvertToBool(newValue);
+        fGenerator->SetPruneBranches(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: disable branches not used by formulas? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fCacheSizeCmd) {
+        G4int value = fCacheSizeCmd->ConvertToInt(newValue);
+        fGenerator->SetCacheSize(Long64_t(value) * 1024 * 1024);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: TTreeCache size is " << value << " MB" << (value <= 0 ? ". Zero means ROOT default" : "") << endlog;
+    } else if (cmd == fWriteSnapshotCmd) {
+        LogCmd(cmdName, newValue, 0, Standard);
+        fGenerator->WriteSnapshot(newValue);
+    } else if (cmd == fReadSnapshotCmd) {
+        fGenerator->SetSnapshotFile(newValue);
+        LogCmd(cmdName, newValue, 0, Standard);
+    } else if (cmd == fTruthFileCmd) {
+        fGenerator->SetTruthFile(newValue);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: truth of primaries is written to \"" << newValue << "\"" << endlog;
+    } else if (cmd == fStatsCmd) {
+        fGenerator->ReportStats(newValue);
+    } else if (cmd == fStatsTimingCmd) {
+        G4bool value = fStatsTimingCmd->ConvertToBool(newValue);
+        fGenerator->SetStatsTiming(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: measure time of generator stages? " << (value ? "Yes" : "No") << endlog;
+    } else if (cmd == fStatsEveryCmd) {
+        G4int value = fStatsEveryCmd->ConvertToInt(newValue);
+        fGenerator->SetStatsEvery(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: generator stats are logged every " << value << " events" << (value <= 0 ? ". Zero means only on request" : "") << endlog;
+    } else if (cmd == fSkipIndexDirCmd) {
+        fGenerator->SetSkipIndexDir(newValue);
+        LogCmd(cmdName, newValue, 0, Standard);
+    } else if (cmd == fBackendCmd) {
+        fGenerator->SetJitBackend(newValue == "jit");
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: expressions evaluation backend is " << newValue << endlog;
+    } else if (cmd == fBackendCrossCheckCmd) {
+        G4int value = fBackendCrossCheckCmd->ConvertToInt(newValue);
+        fGenerator->SetBackendCrossCheck(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of entries to cross-check backends on is " << value << endlog;
+    } else if (cmd == fPrewarmIonsCmd) {
+        G4int value = fPrewarmIonsCmd->ConvertToInt(newValue);
+        fGenerator->SetPrewarmIons(value);
+	    BxLog(routine) << "BxGeneratorTTreeMessenger: number of threads to prewarm ions is " << value << (value <= 0 ? ". No prewarming" : "") << endlog;
     } else if (cmd == fEventIdCmd) {
         fGenerator->GetEventConfigTTF()->SetEventId(newValue);
         LogCmd(cmdName, newValue, 0, Standard);
@@ -265,6 +552,16 @@ void BxGeneratorTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue)
     }
 }
 
+Long64_t BxGeneratorTTreeMessenger::ConvertToEntry(const G4String& cmdName, const G4String& value) {
+    char* end = 0;
+    const Long64_t entry = std::strtoll(value.data(), &end, 10);
+    if (end == value.data() || *end != '\0') {
+        BxLog(error) << "Command " << cmdName << ": \"" << value << "\" is not a number of entries" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    return entry;
+}
+
 void BxGeneratorTTreeMessenger::LogCmd(const G4String& cmdName, const G4String& cmdValue, G4int subEventNumber, LogMode mode) {
     std::stringstream ss;
     ss << " ";
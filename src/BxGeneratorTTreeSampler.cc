@@ -0,0 +1,129 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "BxGeneratorTTreeSampler.hh"
+#include "BxGeneratorTTreeTmpFile.hh"
+#include "BxLogger.hh"
+
+#include <stdint.h>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+    const char     kMagic[8] = { 'B','x','T','T','A','l','i','a' };
+    const uint32_t kVersion  = 1;
+    const size_t   kKeySize  = 32; ///< Length of MD5 hash string
+
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t padding;
+        char     key[kKeySize];
+        uint64_t nEntries;
+        int64_t  nRange;
+        double   totalWeight;
+    };
+
+    template <class T>
+    void WriteVector(std::ofstream& file, const std::vector<T>& v) {
+        if (!v.empty()) file.write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+    }
+
+    template <class T>
+    void ReadVector(std::ifstream& file, std::vector<T>& v, size_t n) {
+        v.resize(n);
+        if (n) file.read(reinterpret_cast<char*>(&v[0]), n * sizeof(T));
+    }
+}
+
+BxGeneratorTTreeSampler::BxGeneratorTTreeSampler()
+: fEntries()
+, fWeights()
+, fProbabilities()
+, fAliases()
+, fNRange(0)
+, fTotalWeight(0.)
+{}
+
+BxGeneratorTTreeSampler::~BxGeneratorTTreeSampler() {}
+
+void BxGeneratorTTreeSampler::Build(const std::vector<Long64_t>& entries, const std::vector<Double_t>& weights, Long64_t nRange) {
+    fEntries = entries;
+    fWeights = weights;
+    fNRange  = nRange;
+    const size_t n = fEntries.size();
+
+    fTotalWeight = 0.;
+    for (size_t i = 0; i < n; ++i) fTotalWeight += fWeights[i];
+
+    // Vose's method: columns with scaled probability < 1 are topped up by aliases with scaled probability >= 1
+    fProbabilities.resize(n);
+    fAliases.resize(n);
+    std::vector<Long64_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        fProbabilities[i] = fWeights[i] * n / fTotalWeight;
+        fAliases[i] = i;
+        if (fProbabilities[i] < 1.) small.push_back(i);
+        else                        large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        const Long64_t s = small.back(); small.pop_back();
+        const Long64_t l = large.back(); large.pop_back();
+        fAliases[s] = l;
+        fProbabilities[l] -= 1. - fProbabilities[s];
+        if (fProbabilities[l] < 1.) small.push_back(l);
+        else                        large.push_back(l);
+    }
+    // rounding leftovers
+    for (size_t i = 0; i < small.size(); ++i) fProbabilities[small[i]] = 1.;
+    for (size_t i = 0; i < large.size(); ++i) fProbabilities[large[i]] = 1.;
+}
+
+G4bool BxGeneratorTTreeSampler::Load(const G4String& filename, const G4String& key) {
+    std::ifstream file(filename.data(), std::ios::in | std::ios::binary);
+    if (!file) return false;
+    Header header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion
+        || key.size() != kKeySize || std::memcmp(header.key, key.data(), kKeySize) != 0) {
+        return false;
+    }
+    ReadVector(file, fEntries      , header.nEntries);
+    ReadVector(file, fWeights      , header.nEntries);
+    ReadVector(file, fProbabilities, header.nEntries);
+    ReadVector(file, fAliases      , header.nEntries);
+    if (!file) {
+        BxLog(warning) << "Alias table \"" << filename << "\" is truncated, it will be rebuilt" << endlog;
+        fEntries.clear();
+        return false;
+    }
+    fNRange      = header.nRange;
+    fTotalWeight = header.totalWeight;
+    return true;
+}
+
+G4bool BxGeneratorTTreeSampler::Save(const G4String& filename, const G4String& key) const {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version     = kVersion;
+    std::memcpy(header.key, key.data(), std::min(key.size(), kKeySize));
+    header.nEntries    = fEntries.size();
+    header.nRange      = fNRange;
+    header.totalWeight = fTotalWeight;
+
+    BxGeneratorTTreeTmpFile tmpFile(filename);
+    std::ofstream file(tmpFile.GetName().data(), std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WriteVector(file, fEntries);
+    WriteVector(file, fWeights);
+    WriteVector(file, fProbabilities);
+    WriteVector(file, fAliases);
+    file.close();
+    return tmpFile.Commit(bool(file));
+}
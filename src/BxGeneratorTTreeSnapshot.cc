@@ -0,0 +1,184 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "BxGeneratorTTreeSnapshot.hh"
+#include "BxLogger.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <limits>
+
+using namespace BxGeneratorTTreeSnapshot;
+
+BxGeneratorTTreeSnapshotWriter::BxGeneratorTTreeSnapshotWriter(const G4String& filename)
+: fFileName(filename)
+, fFile(filename.data(), std::ios::out | std::ios::binary | std::ios::trunc)
+, fEntries()
+, fRecords()
+, fNParticles(0)
+{
+    if (!fFile) {
+        BxLog(error) << "Cannot open snapshot file \"" << fFileName << "\" for writing" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    fFile.write(reinterpret_cast<const char*>(&header), sizeof(header)); // placeholder, rewritten by Close()
+}
+
+BxGeneratorTTreeSnapshotWriter::~BxGeneratorTTreeSnapshotWriter() {
+    if (fFile.is_open()) Close();
+}
+
+void BxGeneratorTTreeSnapshotWriter::Write(const BxGeneratorTTree::EntryBatch& batch) {
+    const std::vector<BxGeneratorTTree::ParticleInfo>& particles = batch.particles;
+    if (particles.empty()) return;
+
+    EntryRecord entry;
+    entry.entry         = batch.entry;
+    entry.event_id      = particles.front().event_id;
+    entry.firstParticle = fNParticles;
+    entry.nParticles    = particles.size();
+    fEntries.push_back(entry);
+
+    fRecords.resize(particles.size());
+    for (size_t i = 0; i < particles.size(); ++i) {
+        const BxGeneratorTTree::ParticleInfo& p = particles[i];
+        ParticleRecord& r = fRecords[i];
+        r.p_index  = p.p_index;
+        r.status   = p.status;
+        r.pdg_code = p.pdg_code;
+        r.padding  = 0;
+        r.energy   = p.energy;
+        r.time     = p.time;
+        r.weight   = p.weight;
+        for (G4int j = 0; j < 3; ++j) {
+            r.momentum[j]     = p.momentum[j];
+            r.position[j]     = p.position[j];
+            r.polarization[j] = p.polarization[j];
+        }
+    }
+    fFile.write(reinterpret_cast<const char*>(&fRecords[0]), fRecords.size() * sizeof(ParticleRecord));
+    fNParticles += particles.size();
+}
+
+void BxGeneratorTTreeSnapshotWriter::Close() {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.version            = kVersion;
+    header.particleRecordSize = sizeof(ParticleRecord);
+    header.entryRecordSize    = sizeof(EntryRecord);
+    header.nEntries           = fEntries.size();
+    header.nParticles         = fNParticles;
+    header.particlesOffset    = sizeof(Header);
+    header.entriesOffset      = sizeof(Header) + fNParticles * sizeof(ParticleRecord);
+
+    if (!fEntries.empty()) fFile.write(reinterpret_cast<const char*>(&fEntries[0]), fEntries.size() * sizeof(EntryRecord));
+    fFile.seekp(0);
+    fFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fFile.close();
+    if (fFile.fail()) {
+        BxLog(error) << "Failed to write snapshot file \"" << fFileName << "\"" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+}
+
+
+BxGeneratorTTreeSnapshotReader::BxGeneratorTTreeSnapshotReader(const G4String& filename)
+: fFileName(filename)
+, fMap(0)
+, fMapSize(0)
+, fHeader(0)
+, fEntries(0)
+, fParticles(0)
+, fCursor(0)
+, fEndEntry(0)
+{
+    int fd = open(filename.data(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+        if (fd >= 0) close(fd);
+        BxLog(error) << "Cannot open snapshot file \"" << fFileName << "\"" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    fMapSize = st.st_size;
+    fMap = mmap(0, fMapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // mapping stays valid
+    if (fMap == MAP_FAILED) {
+        fMap = 0;
+        BxLog(error) << "Cannot map snapshot file \"" << fFileName << "\" to memory" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+
+    const char* base = static_cast<const char*>(fMap);
+    fHeader = reinterpret_cast<const Header*>(base);
+    if (std::memcmp(fHeader->magic, kMagic, sizeof(kMagic)) != 0 || fHeader->version != kVersion
+        || fHeader->particleRecordSize != sizeof(ParticleRecord) || fHeader->entryRecordSize != sizeof(EntryRecord)
+        || fHeader->entriesOffset + fHeader->nEntries * sizeof(EntryRecord) > fMapSize
+        || fHeader->particlesOffset + fHeader->nParticles * sizeof(ParticleRecord) > fHeader->entriesOffset) {
+        BxLog(error) << "File \"" << fFileName << "\" is not a valid snapshot of version " << kVersion << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    fParticles = reinterpret_cast<const ParticleRecord*>(base + fHeader->particlesOffset);
+    fEntries   = reinterpret_cast<const EntryRecord*   >(base + fHeader->entriesOffset  );
+    madvise(fMap, fMapSize, MADV_SEQUENTIAL);
+
+    SetRange(0, 0);
+}
+
+BxGeneratorTTreeSnapshotReader::~BxGeneratorTTreeSnapshotReader() {
+    if (fMap) munmap(fMap, fMapSize);
+}
+
+void BxGeneratorTTreeSnapshotReader::SetRange(Long64_t first, Long64_t n) {
+    // entry records are sorted by entry number
+    uint64_t lo = 0, hi = fHeader->nEntries;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (fEntries[mid].entry < first) lo = mid + 1;
+        else hi = mid;
+    }
+    fCursor = lo;
+    fEndEntry = (n > 0) ? int64_t(first) + n : std::numeric_limits<int64_t>::max();
+}
+
+uint64_t BxGeneratorTTreeSnapshotReader::GetNEntriesLeft() const {
+    uint64_t n = 0;
+    for (uint64_t i = fCursor; i < fHeader->nEntries && fEntries[i].entry < fEndEntry; ++i) ++n;
+    return n;
+}
+
+G4bool BxGeneratorTTreeSnapshotReader::Next(BxGeneratorTTree::EntryBatch& batch, G4bool& endOfFile) {
+    batch.particles.clear();
+    endOfFile = (fCursor >= fHeader->nEntries);
+    if (endOfFile || fEntries[fCursor].entry >= fEndEntry) return false;
+
+    const EntryRecord& entry = fEntries[fCursor++];
+    batch.entry = entry.entry;
+    batch.particles.resize(entry.nParticles);
+    const ParticleRecord* r = fParticles + entry.firstParticle;
+    for (uint64_t i = 0; i < entry.nParticles; ++i, ++r) {
+        BxGeneratorTTree::ParticleInfo& p = batch.particles[i];
+        p.event_id = entry.event_id;
+        p.entry    = entry.entry;
+        p.p_index  = r->p_index;
+        p.status   = r->status;
+        p.pdg_code = r->pdg_code;
+        p.energy   = r->energy;
+        p.momentum    .set(r->momentum    [0], r->momentum    [1], r->momentum    [2]);
+        p.position    .set(r->position    [0], r->position    [1], r->position    [2]);
+        p.time     = r->time;
+        p.polarization.set(r->polarization[0], r->polarization[1], r->polarization[2]);
+        p.definition = 0;
+        p.weight   = r->weight;
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "TString.h"
+
+#include "BxGeneratorTTreeStats.hh"
+#include "BxLogger.hh"
+
+#include <fstream>
+#include <algorithm>
+
+namespace {
+    const char* const kStageNames  [BxGeneratorTTreeStats::kNStages  ] = { "load_tree", "evaluate", "pull", "queue", "gun", "output" };
+    const char* const kCounterNames[BxGeneratorTTreeStats::kNCounters] = { "entries_read", "entries_skipped", "events", "particles", "postponed" };
+}
+
+BxGeneratorTTreeStats::BxGeneratorTTreeStats()
+: fTiming(false)
+, fStartTime(0)
+{
+    Reset();
+}
+
+void BxGeneratorTTreeStats::Reset() {
+    fStartTime = Now();
+    Clear();
+}
+
+void BxGeneratorTTreeStats::Clear() {
+    for (G4int i = 0; i < kNStages; ++i)   fTime[i]  = 0;
+    for (G4int i = 0; i < kNCounters; ++i) fCount[i] = 0;
+}
+
+void BxGeneratorTTreeStats::Add(const BxGeneratorTTreeStats& other) {
+    fStartTime = std::min(fStartTime, other.fStartTime);
+    for (G4int i = 0; i < kNStages; ++i)   fTime[i]  += other.fTime[i];
+    for (G4int i = 0; i < kNCounters; ++i) fCount[i] += other.fCount[i];
+}
+
+void BxGeneratorTTreeStats::Log() const {
+    const G4double wall = std::max(1e-9, (Now() - fStartTime) * 1e-9);
+    BxLog(routine) << "BxGeneratorTTree stats for " << wall << " s: "
+                   << fCount[kEntriesRead] << " entries read (" << fCount[kEntriesRead] / wall << "/s), "
+                   << fCount[kEntriesSkipped] << " skipped, "
+                   << fCount[kEvents] << " events (" << fCount[kEvents] / wall << "/s), "
+                   << fCount[kParticles] << " particles (" << fCount[kParticles] / wall << "/s), "
+                   << fCount[kPostponed] << " postponed" << endlog;
+    if (!fTiming) return;
+    for (G4int i = 0; i < kNStages; ++i) {
+        BxLog(routine) << TString::Format("  %-10s %10.3f s  %5.1f%% of wall time", kStageNames[i], fTime[i] * 1e-9, 100. * fTime[i] * 1e-9 / wall) << endlog;
+    }
+}
+
+G4bool BxGeneratorTTreeStats::Dump(const G4String& filename) const {
+    std::ofstream file(filename.data());
+    if (!file) return false;
+    file << "wall_time " << (Now() - fStartTime) * 1e-9 << "\n";
+    for (G4int i = 0; i < kNCounters; ++i) file << kCounterNames[i] << " " << fCount[i] << "\n";
+    file << "timing " << (fTiming ? 1 : 0) << "\n";
+    for (G4int i = 0; i < kNStages; ++i) file << "time_" << kStageNames[i] << " " << fTime[i] * 1e-9 << "\n";
+    return bool(file);
+}
@@ -0,0 +1,28 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "TSystem.h"
+#include "TString.h"
+
+#include "BxGeneratorTTreeTmpFile.hh"
+
+BxGeneratorTTreeTmpFile::BxGeneratorTTreeTmpFile(const G4String& filename)
+: fFileName(filename)
+, fTmpName(filename + TString::Format(".%s.%d.tmp", gSystem->HostName(), gSystem->GetPid()).Data())
+, fIsDone(false)
+{}
+
+BxGeneratorTTreeTmpFile::~BxGeneratorTTreeTmpFile() {
+    if (!fIsDone) gSystem->Unlink(fTmpName.data());
+}
+
+G4bool BxGeneratorTTreeTmpFile::Commit(G4bool written) {
+    const G4bool published = written && gSystem->Rename(fTmpName.data(), fFileName.data()) == 0;
+    if (!published) gSystem->Unlink(fTmpName.data());
+    fIsDone = true;
+    return published;
+}
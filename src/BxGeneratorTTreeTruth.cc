@@ -0,0 +1,201 @@
+// -------------------------------------------------- //
+/**
+ * AUTHOR: V. Atroshchenko
+ * CONTACT: victor.atroshchenko@lngs.infn.it
+*/
+// -------------------------------------------------- //
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TThread.h"
+#include "TString.h"
+
+#include "BxGeneratorTTreeTruth.hh"
+#include "BxRingBuffer.hh"
+#include "BxLogger.hh"
+
+#include "G4ParticleDefinition.hh"
+#include "G4UnitsTable.hh"
+#include "G4SystemOfUnits.hh"
+
+BxGeneratorTTreeEventSink::BxGeneratorTTreeEventSink()
+: fBuffer(0)
+, fThread(0)
+, fBatch()
+{}
+
+BxGeneratorTTreeEventSink::~BxGeneratorTTreeEventSink() {
+    // writer thread is stopped by Close() in destructor of derived class
+}
+
+void BxGeneratorTTreeEventSink::Start(const char* name, G4int depth) {
+    fBuffer = new BxRingBuffer<BxGeneratorTTreeTruthEvent>(depth);
+    TThread::Initialize();
+    fThread = new TThread(name, &BxGeneratorTTreeEventSink::ThreadFunction, this);
+    fThread->Run();
+}
+
+void BxGeneratorTTreeEventSink::Write(G4int g4event, Long64_t entry, const std::vector<BxGeneratorTTree::ParticleInfo>& particles) {
+    if (!fBuffer) return;
+    fBatch.g4event = g4event;
+    fBatch.entry   = entry;
+    fBatch.particles.assign(particles.begin(), particles.end()); // keeps capacity of recycled batch
+    fBuffer->Push(fBatch);
+}
+
+void BxGeneratorTTreeEventSink::Close() {
+    if (!fThread) return;
+    fBuffer->Close();
+    fThread->Join();
+    delete fThread;
+    delete fBuffer;
+    fThread = 0;
+    fBuffer = 0;
+    Finish();
+}
+
+void BxGeneratorTTreeEventSink::Run() {
+    BxGeneratorTTreeTruthEvent batch;
+    while (fBuffer->Pop(batch)) WriteEvent(batch);
+}
+
+void* BxGeneratorTTreeEventSink::ThreadFunction(void* sink) {
+    static_cast<BxGeneratorTTreeEventSink*>(sink)->Run();
+    return 0;
+}
+
+
+BxGeneratorTTreeTruthWriter::BxGeneratorTTreeTruthWriter(const G4String& filename, G4int depth)
+: BxGeneratorTTreeEventSink()
+, fFileName(filename)
+, fFile(0)
+, fTruth(0)
+, fIndex(0)
+, fG4Event(0)
+, fEntry(0)
+, fEventId(0)
+, fPIndex(0)
+, fStatus(0)
+, fPdg(0)
+, fEnergy(0.)
+, fTime(0.)
+, fWeight(1.)
+, fFirstRow(0)
+, fNRows(0)
+{
+    fFile = TFile::Open(fFileName.data(), "RECREATE");
+    if (!fFile || fFile->IsZombie()) {
+        BxLog(error) << "Cannot open truth file \"" << fFileName << "\" for writing" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+
+    fTruth = new TTree("truth", "Primary particles of BxGeneratorTTree");
+    fTruth->SetDirectory(fFile);
+    fTruth->Branch("g4event"  , &fG4Event  , "g4event/I"     );
+    fTruth->Branch("entry"    , &fEntry    , "entry/L"       );
+    fTruth->Branch("event_id" , &fEventId  , "event_id/I"    );
+    fTruth->Branch("p_index"  , &fPIndex   , "p_index/I"     );
+    fTruth->Branch("status"   , &fStatus   , "status/I"      );
+    fTruth->Branch("pdg"      , &fPdg      , "pdg/I"         );
+    fTruth->Branch("energy"   , &fEnergy   , "energy/D"      );
+    fTruth->Branch("direction", fDirection , "direction[3]/D");
+    fTruth->Branch("position" , fPosition  , "position[3]/D" );
+    fTruth->Branch("time"     , &fTime     , "time/D"        );
+    fTruth->Branch("weight"   , &fWeight   , "weight/D"      );
+
+    fIndex = new TTree("truth_index", "G4 event number to input entry and rows in truth tree");
+    fIndex->SetDirectory(fFile);
+    fIndex->Branch("g4event"  , &fG4Event  , "g4event/I"     );
+    fIndex->Branch("entry"    , &fEntry    , "entry/L"       );
+    fIndex->Branch("first_row", &fFirstRow , "first_row/L"   );
+    fIndex->Branch("n_rows"   , &fNRows    , "n_rows/I"      );
+
+    // file and trees are touched only by writer thread until Finish()
+    Start("BxGeneratorTTreeTruth", depth);
+    BxLog(routine) << "BxGeneratorTTree: truth of primaries is written to \"" << fFileName << "\" in background thread" << endlog;
+}
+
+BxGeneratorTTreeTruthWriter::~BxGeneratorTTreeTruthWriter() {
+    Close();
+}
+
+void BxGeneratorTTreeTruthWriter::WriteEvent(const BxGeneratorTTreeTruthEvent& event) {
+    fG4Event  = event.g4event;
+    fFirstRow = fTruth->GetEntries();
+    fNRows    = event.particles.size();
+    for (size_t i = 0; i < event.particles.size(); ++i) {
+        const BxGeneratorTTree::ParticleInfo& p = event.particles[i];
+        fEntry        = p.entry;
+        fEventId      = p.event_id;
+        fPIndex       = p.p_index;
+        fStatus       = p.status;
+        fPdg          = p.pdg_code;
+        fEnergy       = p.energy/MeV;
+        fDirection[0] = p.momentum.x();
+        fDirection[1] = p.momentum.y();
+        fDirection[2] = p.momentum.z();
+        fPosition[0]  = p.position.x()/m;
+        fPosition[1]  = p.position.y()/m;
+        fPosition[2]  = p.position.z()/m;
+        fTime         = p.time/ns;
+        fWeight       = p.weight;
+        fTruth->Fill();
+    }
+    fEntry = event.entry;
+    fIndex->Fill();
+}
+
+void BxGeneratorTTreeTruthWriter::Finish() {
+    fFile->cd();
+    fTruth->Write();
+    fIndex->Write();
+    BxLog(routine) << "BxGeneratorTTree: " << fIndex->GetEntries() << " events with " << fTruth->GetEntries()
+                   << " primaries written to truth file \"" << fFileName << "\"" << endlog;
+    fFile->Close(); // trees are deleted with file
+    delete fFile;
+    fFile  = 0;
+    fTruth = 0;
+    fIndex = 0;
+}
+
+
+BxGeneratorTTreeTraceWriter::BxGeneratorTTreeTraceWriter(const G4String& filename, G4int depth)
+: BxGeneratorTTreeEventSink()
+, fFileName(filename)
+, fFile(filename.data(), std::ios::out | std::ios::trunc)
+, fNEvents(0)
+{
+    if (!fFile) {
+        BxLog(error) << "Cannot open trace file \"" << fFileName << "\" for writing" << endlog;
+        BxLog(fatal) << "FATAL " << endlog;
+    }
+    Start("BxGeneratorTTreeTrace", depth);
+    BxLog(routine) << "BxGeneratorTTree: primaries info is traced to \"" << fFileName << "\" in background thread" << endlog;
+}
+
+BxGeneratorTTreeTraceWriter::~BxGeneratorTTreeTraceWriter() {
+    Close();
+}
+
+void BxGeneratorTTreeTraceWriter::WriteEvent(const BxGeneratorTTreeTruthEvent& event) {
+    fFile << "G4 event " << event.g4event << "\n";
+    for (size_t i = 0; i < event.particles.size(); ++i) {
+        const BxGeneratorTTree::ParticleInfo& p = event.particles[i];
+        fFile << "  Entry " << p.entry
+              << ", event_id = " << p.event_id
+              << " : particle #" << p.p_index
+              << (p.status != 0 ? TString::Format(", POSTPONED'%d", p.status).Data() : "")
+              << " : " << (p.definition ? p.definition->GetParticleName() : G4String("unknown"))
+              << "\t=>\n";
+        fFile << "    Energy = " << G4BestUnit(p.energy, "Energy") << "\n";
+        fFile << "    direction = " << p.momentum << "\n";
+        fFile << "    position = " << G4BestUnit(p.position, "Length") << "\n";
+        fFile << "    time = " << G4BestUnit(p.time, "Time") << "\n";
+    }
+    ++fNEvents;
+}
+
+void BxGeneratorTTreeTraceWriter::Finish() {
+    fFile.close();
+    BxLog(routine) << "BxGeneratorTTree: primaries of " << fNEvents << " events traced to \"" << fFileName << "\"" << endlog;
+}
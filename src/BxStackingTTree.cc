@@ -5,34 +5,93 @@
 */
 // -------------------------------------------------- //
 
+#include "TString.h"
+
 #include "BxStackingTTree.hh"
 #include "BxStackingTTreeMessenger.hh"
 #include "BxPrimaryGeneratorAction.hh"
 #include "BxGeneratorTTree.hh"
 #include "BxOutputVertex.hh"
-#include "BxManager.hh"
 #include "BxLogger.hh"
 
+#include "G4RunManager.hh"
 #include "G4ParticleDefinition.hh"
 #include "G4Track.hh"
 #include "G4VProcess.hh"
+#include "G4ProcessTable.hh"
+#include "G4ProcessVector.hh"
+#include "G4ParticleTable.hh"
+#include "G4DynamicParticle.hh"
+#include "G4EventManager.hh"
+#include "G4TrackVector.hh"
+#include "Randomize.hh"
 
 #include "G4MuonMinus.hh"
 #include "G4Electron.hh"
 
 #include "G4UnitsTable.hh"
 
+#include <algorithm>
+
 using namespace std;
 
+namespace {
+    /// Match of whole name to pattern with wildcards '*' (any sequence) and '?' (any character)
+    G4bool MatchWildcard(const char* pattern, const char* name) {
+        const char* star = 0;
+        const char* resume = 0;
+        while (*name) {
+            if (*pattern == '*') {
+                star = pattern++;
+                resume = name;
+            } else if (*pattern == '?' || *pattern == *name) {
+                ++pattern;
+                ++name;
+            } else if (star) {
+                pattern = star + 1;
+                name = ++resume;
+            } else {
+                return false;
+            }
+        }
+        while (*pattern == '*') ++pattern;
+        return !*pattern;
+    }
+    
+    G4bool HasWildcard(const G4String& name) {
+        return name.find_first_of("*?") != std::string::npos;
+    }
+}
+
 BxStackingTTree::BxStackingTTree()
-: fIsFirst(true)
+: fGenerator(0)
+, fIsFirst(true)
 , fMode()
 , fKillMode()
 , fBlackListPdg()
+, fBlackListParticlePatterns()
 , fBlackListProcess()
-, fTrackParentIDs()
-, fTrackPDGs()
-, fTrackTimes()
+, fKilledPdgs()
+, fKilledLargePdgs()
+, fKilledIonZ()
+, fKilledIonA()
+, fHasIonRanges(false)
+, fUserRules()
+, fRulesChanged(true)
+, fHasRules(false)
+, fProcessIds()
+, fSubTypeProcessIds()
+, fProcessKilled()
+, fParticleClassPdgs()
+, fRules()
+, fUserBiasings()
+, fBiasings()
+, fHasBiasing(false)
+, fUnknownPrimaryWarned(false)
+, fIsSplitting(false)
+, fSplitClassification(fUrgent)
+, fTracks()
+, fMaxTrackID(0)
 , fAugerElectron()
 , fRadNucleiLifetimeThreshold(0.)
 {
@@ -45,124 +104,404 @@ BxStackingTTree::BxStackingTTree()
     BxLog(routine) << "BxStackingTTree built" << endlog;
 }
 
-BxStackingTTree::~BxStackingTTree() {}
+BxStackingTTree::~BxStackingTTree() {
+    delete fMessenger;
+}
+
+void BxStackingTTree::AddIonRangeToBlackList(G4bool isZ, G4int min, G4int max) {
+    std::bitset<1000>& bits = isZ ? fKilledIonZ : fKilledIonA;
+    for (G4int i = std::max(min, 0); i <= std::min(max, 999); ++i) bits.set(i);
+    fHasIonRanges = fKilledIonZ.any() || fKilledIonA.any();
+}
 
-G4int BxStackingTTree::GetPrimaryParentID(G4int trackID) {
-    G4int primaryID = 0;
-    G4int parentID = trackID;
-    while (parentID > 0) {
-        primaryID = parentID;
-        parentID = fTrackParentIDs.find(parentID)->second;
-        if (primaryID == parentID) return primaryID; // infinite loop protection 
+void BxStackingTTree::CompileBlackList() {
+    fKilledPdgs.reset();
+    fKilledLargePdgs.clear();
+    std::set<G4int> pdgs(fBlackListPdg);
+    
+    G4int nExpanded = 0;
+    if (!fBlackListParticlePatterns.empty()) {
+        G4ParticleTable::G4PTblDicIterator* iterator = G4ParticleTable::GetParticleTable()->GetIterator();
+        iterator->reset();
+        while ((*iterator)()) {
+            const G4ParticleDefinition* particle = iterator->value();
+            for (std::set<G4String>::const_iterator it = fBlackListParticlePatterns.begin(); it != fBlackListParticlePatterns.end(); ++it) {
+                if (!MatchWildcard(it->data(), particle->GetParticleName().data())) continue;
+                pdgs.insert(particle->GetPDGEncoding());
+                ++nExpanded;
+                break;
+            }
+        }
+    }
+    
+    for (std::set<G4int>::const_iterator it = pdgs.begin(); it != pdgs.end(); ++it) {
+        if (*it > -kPdgBitsHalf && *it < kPdgBitsHalf) fKilledPdgs.set(*it + kPdgBitsHalf);
+        else fKilledLargePdgs.push_back(*it); // set is ordered
+    }
+    if (!pdgs.empty() || fHasIonRanges) {
+        BxLog(routine) << "BxStackingTTree: black list of " << pdgs.size() << " particles (" << nExpanded << " from name patterns)"
+                       << (fHasIonRanges ? " and ion ranges" : "") << endlog;
+    }
+}
+
+void BxStackingTTree::RecordTrack(const G4Track* aTrack, G4int pdg_code) {
+    const G4int trackID = aTrack->GetTrackID();
+    if (trackID <= 0) return;
+    if (trackID >= G4int(fTracks.size())) {
+        TrackRecord empty = { 0, 0, 0, 0. };
+        fTracks.resize(std::max(2 * fTracks.size(), size_t(trackID) + 1), empty);
+    }
+    
+    TrackRecord& record = fTracks[trackID];
+    record.parentID = aTrack->GetParentID();
+    record.pdg      = pdg_code;
+    record.time     = aTrack->GetGlobalTime();
+    // parent is classified before its secondaries, so its primary is already known
+    if (record.parentID <= 0) {
+        record.primaryID = trackID;
+    } else {
+        const TrackRecord* parent = FindTrack(record.parentID);
+        record.primaryID = parent ? parent->primaryID : -1; // parent is not recorded, e.g. optical photon
     }
-    return primaryID;
+    fMaxTrackID = std::max(fMaxTrackID, trackID);
+}
+
+G4int BxStackingTTree::GetPrimaryParentID(G4int trackID) const {
+    const TrackRecord* record = FindTrack(trackID);
+    return record ? record->primaryID : -1;
 }
 
-void BxStackingTTree::PostponeTrack(const G4Track* aTrack, G4int status) {
-    BxGeneratorTTree::ParticleInfo particle_info = fGenerator->GetCurrentPrimaryParticlesInfo()[GetPrimaryParentID(aTrack->GetTrackID()) - 1];
+G4bool BxStackingTTree::PostponeTrack(const G4Track* aTrack, G4int status) {
+    // optical photons are not recorded, so neither they nor their secondaries can be traced to primary
+    const std::vector<BxGeneratorTTree::ParticleInfo>& primaries = fGenerator->GetCurrentPrimaryParticlesInfo();
+    const G4int primaryID = GetPrimaryParentID(aTrack->GetTrackID());
+    if (primaryID < 1 || primaryID > G4int(primaries.size())) {
+        if (!fUnknownPrimaryWarned) {
+            BxLog(warning) << "Primary of " << aTrack->GetParticleDefinition()->GetParticleName() << " track " << aTrack->GetTrackID()
+                           << " is unknown, such tracks are not postponed (warning is given once)" << endlog;
+            fUnknownPrimaryWarned = true;
+        }
+        return false;
+    }
+    BxGeneratorTTree::ParticleInfo particle_info = primaries[primaryID - 1];
     
     particle_info.pdg_code = aTrack->GetParticleDefinition()->GetPDGEncoding();
+    particle_info.definition = aTrack->GetParticleDefinition();
     particle_info.energy = aTrack->GetKineticEnergy();
     particle_info.momentum = aTrack->GetMomentumDirection();
     particle_info.position = aTrack->GetPosition();
-    particle_info.time = (particle_info.status == 0) ? aTrack->GetGlobalTime() : particle_info.time + aTrack->GetGlobalTime();
+    // postponed primaries are shot relative to the first postponed particle of the event
+    particle_info.time = aTrack->GetGlobalTime() + (particle_info.status == 0 ? 0. : fGenerator->GetPostponedTimeOffset());
     particle_info.polarization = aTrack->GetPolarization();
     particle_info.status = status;
+    particle_info.weight = aTrack->GetWeight(); // includes weight of primary and biasing
     
     fGenerator->PushFrontParticleInfo(particle_info);
+    return true;
 }
 
-G4ClassificationOfNewTrack BxStackingTTree::BxClassifyNewTrack (const G4Track* aTrack) {
-    const G4ParticleDefinition* particleDef = aTrack->GetParticleDefinition();
-    G4int pdg_code = particleDef->GetPDGEncoding();
-    
-    if (fBlackListPdg.count(pdg_code)) return fKill;
+void BxStackingTTree::AddRule(const G4String& processName, G4int pdg_code, G4bool allParticles, ERuleAction action, G4int status) {
+    UserRule userRule;
+    userRule.process           = processName;
+    userRule.pdg               = pdg_code;
+    userRule.allParticles      = allParticles;
+    userRule.rule.condition    = kAlways;
+    userRule.rule.action       = action;
+    userRule.rule.status       = status;
+    fUserRules.push_back(userRule);
+    fRulesChanged = true;
+}
+
+void BxStackingTTree::AddBiasing(const G4String& processName, G4int pdg_code, G4bool allParticles, G4double eMin, G4double eMax, G4double probability, G4int nSplit) {
+    UserBiasing userBiasing;
+    userBiasing.process             = processName;
+    userBiasing.pdg                 = pdg_code;
+    userBiasing.allParticles        = allParticles;
+    userBiasing.biasing.eMin        = eMin;
+    userBiasing.biasing.eMax        = eMax;
+    userBiasing.biasing.probability = probability;
+    userBiasing.biasing.nSplit      = nSplit;
+    fUserBiasings.push_back(userBiasing);
+    fRulesChanged = true;
+}
+
+G4int BxStackingTTree::ProcessId(const G4String& processName, G4bool create) {
+    std::map<G4String, G4int>::const_iterator it = fProcessIds.find(processName);
+    if (it != fProcessIds.end()) return it->second;
+    if (!create) return 0;
+    const G4int id = fProcessKilled.size();
+    fProcessIds[processName] = id;
+    fProcessKilled.push_back(false);
+    return id;
+}
+
+void BxStackingTTree::AddCompiledRule(G4int process, G4int particleClass, G4int condition, G4int action, G4int status) {
+    Rule rule = { condition, action, status };
+    fRules[process * (fParticleClassPdgs.size() + 1) + particleClass].push_back(rule);
+}
+
+void BxStackingTTree::CompileRules() {
+    // particles with own rules: user ones and those of modes
+    std::set<G4int> pdgs;
+    pdgs.insert(22); pdgs.insert(11); pdgs.insert(-11); pdgs.insert(14); pdgs.insert(-12);
+    for (size_t i = 0; i < fUserRules.size(); ++i) {
+        if (!fUserRules[i].allParticles) pdgs.insert(fUserRules[i].pdg);
+    }
+    for (size_t i = 0; i < fUserBiasings.size(); ++i) {
+        if (!fUserBiasings[i].allParticles) pdgs.insert(fUserBiasings[i].pdg);
+    }
+    fParticleClassPdgs.assign(pdgs.begin(), pdgs.end());
+    const G4int nClasses = fParticleClassPdgs.size() + 1;
     
-    const G4VProcess* creatorProcess = aTrack->GetCreatorProcess();
-    G4String creatorProcessName = creatorProcess ? creatorProcess->GetProcessName() : "";
+    G4ProcessVector* processes = G4ProcessTable::GetProcessTable()->FindProcesses();
+    const G4int nProcesses = processes ? processes->entries() : 0;
     
-    if (fBlackListProcess.count(creatorProcessName)) return fKill;
+    fProcessIds.clear();
+    fProcessKilled.assign(1, false); // id 0: processes without rules
+    for (size_t i = 0; i < fUserRules.size(); ++i) ProcessId(fUserRules[i].process, true);
+    for (size_t i = 0; i < fUserBiasings.size(); ++i) {
+        if (fUserBiasings[i].process != "all") ProcessId(fUserBiasings[i].process, true);
+    }
+    for (std::set<G4String>::const_iterator it = fBlackListProcess.begin(); it != fBlackListProcess.end(); ++it) {
+        if (!HasWildcard(*it)) {
+            fProcessKilled[ProcessId(*it, true)] = true;
+            continue;
+        }
+        // patterns are expanded over known processes only
+        for (G4int i = 0; i < nProcesses; ++i) {
+            const G4String& name = (*processes)[i]->GetProcessName();
+            if (MatchWildcard(it->data(), name.data())) fProcessKilled[ProcessId(name, true)] = true;
+        }
+    }
+    if (fMode.test(0) || fKillMode.test(0)) ProcessId("nCapture", true);
+    if (fMode.test(1) || fKillMode.test(1)) ProcessId("RadioactiveDecay", true);
+    if (fMode.test(2) || fKillMode.test(2)) ProcessId("muMinusCaptureAtRest", true);
+    if (fMode.test(2) || fKillMode.test(2) || fMode.test(3) || fKillMode.test(3)) {
+        ProcessId("Decay", true);
+        ProcessId("DecayWithSpin", true);
+    }
+    fRules.assign(fProcessKilled.size() * nClasses, std::vector<Rule>());
     
-    if (fMode.any() || fKillMode.any()) {
-        if (pdg_code != 50) {
-            fTrackParentIDs.insert(std::pair<G4int, G4int>(aTrack->GetTrackID(), aTrack->GetParentID()));
-            fTrackPDGs.insert(std::pair<G4int, G4int>(aTrack->GetTrackID(), pdg_code));
-            fTrackTimes[aTrack->GetTrackID()] = aTrack->GetGlobalTime();
+    // user rules go first
+    for (size_t i = 0; i < fUserRules.size(); ++i) {
+        const UserRule& userRule = fUserRules[i];
+        const G4int process = ProcessId(userRule.process, false);
+        for (G4int c = 0; c < nClasses; ++c) {
+            if (userRule.allParticles || (c > 0 && fParticleClassPdgs[c - 1] == userRule.pdg)) {
+                AddCompiledRule(process, c, userRule.rule.condition, userRule.rule.action, userRule.rule.status);
+            }
         }
-        
-        if (!creatorProcess) return fUrgent; //particle from event generator
-        
-        
+    }
+    
+    // modes, in order of former cascade of checks
+    for (G4int c = 0; c < nClasses; ++c) {
+        const G4int pdg_code = c > 0 ? fParticleClassPdgs[c - 1] : 0; // 0: any other particle
         if (fMode.test(0) || fKillMode.test(0)) {
-            if (pdg_code == 22 && creatorProcessName == "nCapture") {
-                if (!fKillMode.test(0)) PostponeTrack(aTrack, 1);
-                return fKill;
-            }
+            const G4int action = fKillMode.test(0) ? kKill : kPostpone;
+            if (pdg_code == 22) AddCompiledRule(ProcessId("nCapture", false), c, kAlways, action, 1);
         }
         if (fMode.test(1) || fKillMode.test(1)) {
-            if (creatorProcessName == "RadioactiveDecay" && fTrackTimes[aTrack->GetParentID()] >= 0.) {
-                if (!fKillMode.test(1)) PostponeTrack(aTrack, 2);
-                return fKill;
-            }
+            const G4int action = fKillMode.test(1) ? kKill : kPostpone;
+            AddCompiledRule(ProcessId("RadioactiveDecay", false), c, kParentTimeNotNegative, action, 2);
         }
         if (fMode.test(2) || fKillMode.test(2)) {
-            if (creatorProcessName == "muMinusCaptureAtRest") {
-                //mean lifetime of muonic carbon is 2.026 mus, of muonic hydrogen is almost equal to free muon lifetime
-                if (pdg_code == 11) {
-                    //Decay in orbit: 93.6318% of mu- captures for Borexino scintillator
-                    //Processes "Decay" and "DecayWithSpin" seem to do not give any significant delay time between mu- and e-
-                    //For mu- with uniformly distributed kinetic energies from 0 to 1000 MeV, delay times from "Decay" are up to 20 ns
-                    //They are only decays in flight
-                    //Stopped mu- are captured by nuclei into muonic atoms, bound mu- decays are handled by "muMinusCaptureAtRest" process
-                    //But there are two types of electrons from it:
-                    //  1) Auger electrons with tiny energies and times about few ns
-                    //  2) electron from bound muon decay (decay in orbit), which we interested in
-                    //The first electron from "muMinusCaptureAtRest" is always Auger electron, even if it is the only electron
-                    //All Auger electrons have the same track time, not equal to track time of electron from decay
-                    //If electron from decay is appear, it is the last electron
-                    
-                    G4double trackTime = aTrack->GetGlobalTime();
-                    if (fAugerElectron.parentID != aTrack->GetParentID()) {
-                        fAugerElectron.Set(aTrack->GetParentID(), aTrack->GetTrackID(), trackTime);
-                    } else {
-                        if (fAugerElectron.parentID == aTrack->GetParentID()) {
-                            if (fAugerElectron.time != trackTime && fAugerElectron.trackID != aTrack->GetTrackID()) {
-                                if (!fKillMode.test(2)) PostponeTrack(aTrack, 3);
-                                return fKill;
-                            }
-                        }
-                    }
-                } else if (aTrack->GetGlobalTime() != fAugerElectron.time && pdg_code != 14 && pdg_code != -12) {
-                    //Nuclear capture: 6.3682% of mu- captures for Borexino scintillator
-                    //by    mu- + p -> n + nu_mu    or    mu- + (A,Z) -> (A,Z-1) + nu_mu
-                    //WARNING! There is a bug in Geant4 versions lower than 10.0.p04 and 10.1.p01: http://bugzilla-geant4.kek.jp/show_bug.cgi?id=1695
-                    //         Gammas, protons, neutrons, deutrons, tritons, alphas and residual nuclei with delay time ~ 0.1-10 mus can be produced
-                    //         but because of bug they have the same time as Auger electrons
-                    if (!fKillMode.test(2)) PostponeTrack(aTrack, 3);
-                    return fKill;
-                }
-            }  else if (pdg_code == -11 && (creatorProcessName == "Decay" || creatorProcessName == "DecayWithSpin")
-                && (fTrackPDGs.count(aTrack->GetParentID()) && fTrackPDGs[aTrack->GetParentID()] == -13) && aTrack->GetKineticEnergy() <= fEkinMaxMuonDecay) {
-                //There is only free muon decay for mu+, no capture
-                if (!fKillMode.test(2)) PostponeTrack(aTrack, -3);
-                return fKill;
+            const G4int action = fKillMode.test(2) ? kKill : kPostpone;
+            if (pdg_code == 11) AddCompiledRule(ProcessId("muMinusCaptureAtRest", false), c, kMuCaptureDecayElectron, action, 3);
+            else if (pdg_code != 14 && pdg_code != -12) AddCompiledRule(ProcessId("muMinusCaptureAtRest", false), c, kMuCaptureNuclear, action, 3);
+            if (pdg_code == -11) {
+                AddCompiledRule(ProcessId("Decay"        , false), c, kMuPlusDecayPositron, action, -3);
+                AddCompiledRule(ProcessId("DecayWithSpin", false), c, kMuPlusDecayPositron, action, -3);
             }
         }
         if (fMode.test(3) || fKillMode.test(3)) {
-            if (creatorProcessName == "Decay" || creatorProcessName == "DecayWithSpin") {
-                if (!fKillMode.test(3)) PostponeTrack(aTrack, 4);
-                return fKill;
+            const G4int action = fKillMode.test(3) ? kKill : kPostpone;
+            AddCompiledRule(ProcessId("Decay"        , false), c, kAlways, action, 4);
+            AddCompiledRule(ProcessId("DecayWithSpin", false), c, kAlways, action, 4);
+        }
+    }
+    fHasRules = false;
+    for (size_t i = 0; i < fRules.size(); ++i) fHasRules = fHasRules || !fRules[i].empty();
+    
+    // biasing, after process ids are known
+    fBiasings.assign(fRules.size(), std::vector<Biasing>());
+    for (size_t i = 0; i < fUserBiasings.size(); ++i) {
+        const UserBiasing& userBiasing = fUserBiasings[i];
+        const G4bool allProcesses = (userBiasing.process == "all");
+        const G4int  process      = allProcesses ? 0 : ProcessId(userBiasing.process, false);
+        for (G4int p = 0; p < G4int(fProcessKilled.size()); ++p) {
+            if (!allProcesses && p != process) continue;
+            for (G4int c = 0; c < nClasses; ++c) {
+                if (userBiasing.allParticles || (c > 0 && fParticleClassPdgs[c - 1] == userBiasing.pdg)) {
+                    fBiasings[p * nClasses + c].push_back(userBiasing.biasing);
+                }
+            }
+        }
+    }
+    fHasBiasing = !fUserBiasings.empty();
+    
+    // subtypes of processes known now, names are compared only for processes which share subtype with a process of other id
+    fSubTypeProcessIds.clear();
+    G4int nShared = 0;
+    for (G4int i = 0; i < nProcesses; ++i) {
+        const G4VProcess* process = (*processes)[i];
+        const G4int subType = process->GetProcessSubType();
+        if (subType < 0) continue;
+        if (subType >= G4int(fSubTypeProcessIds.size())) fSubTypeProcessIds.resize(subType + 1, -2);
+        const G4int id = ProcessId(process->GetProcessName(), false);
+        G4int& subTypeId = fSubTypeProcessIds[subType];
+        if (subTypeId == -2) subTypeId = id;
+        else if (subTypeId >= 0 && subTypeId != id) {
+            subTypeId = -1;
+            ++nShared;
+        }
+    }
+    delete processes;
+    for (size_t i = 0; i < fSubTypeProcessIds.size(); ++i) if (fSubTypeProcessIds[i] == -2) fSubTypeProcessIds[i] = -1;
+    CompileBlackList();
+    fRulesChanged = false;
+    
+    BxLog(routine) << "BxStackingTTree: rules compiled for " << fProcessKilled.size() - 1 << " processes and "
+                   << nClasses << " particle classes, " << nShared << " process subtypes are resolved by name"
+                   << (fHasBiasing ? TString::Format(", %d biasings", G4int(fUserBiasings.size())).Data() : "") << endlog;
+}
+
+G4int BxStackingTTree::GetProcessId(const G4VProcess* process) const {
+    const G4int subType = process->GetProcessSubType();
+    if (subType >= 0 && subType < G4int(fSubTypeProcessIds.size()) && fSubTypeProcessIds[subType] >= 0) return fSubTypeProcessIds[subType];
+    // shared subtype or process created after compilation of rules
+    std::map<G4String, G4int>::const_iterator it = fProcessIds.find(process->GetProcessName());
+    return it != fProcessIds.end() ? it->second : 0;
+}
+
+G4int BxStackingTTree::GetParticleClass(G4int pdg_code) const {
+    std::vector<G4int>::const_iterator it = std::lower_bound(fParticleClassPdgs.begin(), fParticleClassPdgs.end(), pdg_code);
+    return (it != fParticleClassPdgs.end() && *it == pdg_code) ? (it - fParticleClassPdgs.begin()) + 1 : 0;
+}
+
+G4bool BxStackingTTree::TestCondition(G4int condition, const G4Track* aTrack) {
+    switch (condition) {
+        case kAlways:
+            return true;
+        case kParentTimeNotNegative: {
+            const TrackRecord* parent = FindTrack(aTrack->GetParentID());
+            return !parent || parent->time >= 0.;
+        }
+        case kMuCaptureDecayElectron: {
+            //mean lifetime of muonic carbon is 2.026 mus, of muonic hydrogen is almost equal to free muon lifetime
+            //Decay in orbit: 93.6318% of mu- captures for Borexino scintillator
+            //Processes "Decay" and "DecayWithSpin" seem to do not give any significant delay time between mu- and e-
+            //For mu- with uniformly distributed kinetic energies from 0 to 1000 MeV, delay times from "Decay" are up to 20 ns
+            //They are only decays in flight
+            //Stopped mu- are captured by nuclei into muonic atoms, bound mu- decays are handled by "muMinusCaptureAtRest" process
+            //But there are two types of electrons from it:
+            //  1) Auger electrons with tiny energies and times about few ns
+            //  2) electron from bound muon decay (decay in orbit), which we interested in
+            //The first electron from "muMinusCaptureAtRest" is always Auger electron, even if it is the only electron
+            //All Auger electrons have the same track time, not equal to track time of electron from decay
+            //If electron from decay is appear, it is the last electron
+            const G4double trackTime = aTrack->GetGlobalTime();
+            if (fAugerElectron.parentID != aTrack->GetParentID()) {
+                fAugerElectron.Set(aTrack->GetParentID(), aTrack->GetTrackID(), trackTime);
+                return false;
+            }
+            return fAugerElectron.time != trackTime && fAugerElectron.trackID != aTrack->GetTrackID();
+        }
+        case kMuCaptureNuclear:
+            //Nuclear capture: 6.3682% of mu- captures for Borexino scintillator
+            //by    mu- + p -> n + nu_mu    or    mu- + (A,Z) -> (A,Z-1) + nu_mu
+            //WARNING! There is a bug in Geant4 versions lower than 10.0.p04 and 10.1.p01: http://bugzilla-geant4.kek.jp/show_bug.cgi?id=1695
+            //         Gammas, protons, neutrons, deutrons, tritons, alphas and residual nuclei with delay time ~ 0.1-10 mus can be produced
+            //         but because of bug they have the same time as Auger electrons
+            return aTrack->GetGlobalTime() != fAugerElectron.time;
+        case kMuPlusDecayPositron: {
+            //There is only free muon decay for mu+, no capture
+            const TrackRecord* parent = FindTrack(aTrack->GetParentID());
+            return parent && parent->pdg == -13 && aTrack->GetKineticEnergy() <= fEkinMaxMuonDecay;
+        }
+    }
+    return false;
+}
+
+G4ClassificationOfNewTrack BxStackingTTree::ApplyBiasing(const G4Track* aTrack, const std::vector<Biasing>& biasings, G4ClassificationOfNewTrack classification) {
+    const G4double energy = aTrack->GetKineticEnergy();
+    for (size_t i = 0; i < biasings.size(); ++i) {
+        const Biasing& biasing = biasings[i];
+        if (energy < biasing.eMin || energy >= biasing.eMax) continue;
+        
+        // track is not stacked yet, so its weight is changed in place
+        G4Track* track = const_cast<G4Track*>(aTrack);
+        if (biasing.probability < 1.) {
+            if (G4UniformRand() >= biasing.probability) return fKill;
+            track->SetWeight(track->GetWeight() / biasing.probability);
+        }
+        if (biasing.nSplit > 1) {
+            track->SetWeight(track->GetWeight() / biasing.nSplit);
+            // copies are siblings of the track: event manager gives them new track IDs,
+            // they are recorded with the same parent, so their secondaries are traced to the same primary
+            G4TrackVector copies;
+            for (G4int k = 1; k < biasing.nSplit; ++k) {
+                G4Track* copy = new G4Track(new G4DynamicParticle(*aTrack->GetDynamicParticle()), aTrack->GetGlobalTime(), aTrack->GetPosition());
+                copy->SetParentID(aTrack->GetParentID());
+                copy->SetCreatorProcess(aTrack->GetCreatorProcess());
+                copy->SetTouchableHandle(aTrack->GetTouchableHandle());
+                copy->SetWeight(aTrack->GetWeight());
+                copies.push_back(copy);
             }
+            fIsSplitting = true;
+            fSplitClassification = classification;
+            G4EventManager::GetEventManager()->StackTracks(&copies);
+            fIsSplitting = false;
         }
+        return classification;
     }
-    return fUrgent;
+    return classification;
+}
+
+G4ClassificationOfNewTrack BxStackingTTree::BxClassifyNewTrack (const G4Track* aTrack) {
+    const G4ParticleDefinition* particleDef = aTrack->GetParticleDefinition();
+    G4int pdg_code = particleDef->GetPDGEncoding();
+    
+    if (fIsSplitting) { // copy of split track
+        if (fHasRules && pdg_code != 50) RecordTrack(aTrack, pdg_code);
+        return fSplitClassification;
+    }
+    
+    if (IsBlackListed(pdg_code)) return fKill;
+    
+    const G4VProcess* creatorProcess = aTrack->GetCreatorProcess();
+    const G4int process = creatorProcess ? GetProcessId(creatorProcess) : 0;
+    
+    if (fProcessKilled[process]) return fKill;
+    
+    if (!fHasRules && !fHasBiasing) return fUrgent;
+    if (fHasRules && pdg_code != 50) RecordTrack(aTrack, pdg_code);
+    
+    if (!creatorProcess) return fUrgent; //particle from event generator
+    
+    const size_t cell = process * (fParticleClassPdgs.size() + 1) + GetParticleClass(pdg_code);
+    G4ClassificationOfNewTrack classification = fUrgent;
+    const std::vector<Rule>& rules = fRules[cell];
+    for (size_t i = 0; i < rules.size(); ++i) {
+        const Rule& rule = rules[i];
+        if (!TestCondition(rule.condition, aTrack)) continue;
+        if (rule.action == kKill) return fKill;
+        if (rule.action == kPostpone) {
+            if (PostponeTrack(aTrack, rule.status)) return fKill;
+            break; // tracked in this event
+        }
+        if (rule.action == kWaiting) classification = fWaiting;
+        break;
+    }
+    
+    if (fHasBiasing) return ApplyBiasing(aTrack, fBiasings[cell], classification);
+    return classification;
 }
 
 void BxStackingTTree::BxNewStage() {}
 
 void BxStackingTTree::BxPrepareNewEvent() {
     if (fIsFirst) {
-        const BxPrimaryGeneratorAction* primGen = static_cast<const BxPrimaryGeneratorAction*>(BxManager::Get()->GetUserPrimaryGeneratorAction());
+        const BxPrimaryGeneratorAction* primGen = static_cast<const BxPrimaryGeneratorAction*>(G4RunManager::GetRunManager()->GetUserPrimaryGeneratorAction());
         fGenerator = dynamic_cast<BxGeneratorTTree*>(primGen->GetBxGenerator());
         if (!fGenerator) {
             BxLog(error) << "TTree stacking can be used only with TTree generator!" << endlog;
@@ -170,8 +509,11 @@ void BxStackingTTree::BxPrepareNewEvent() {
         }
         fIsFirst = false;
     }
-    fTrackParentIDs.clear();
-    fTrackPDGs.clear();
-    fTrackTimes.clear();
+    if (fRulesChanged) CompileRules();
+    if (!fTracks.empty()) {
+        TrackRecord empty = { 0, 0, 0, 0. };
+        std::fill(fTracks.begin(), fTracks.begin() + std::min(size_t(fMaxTrackID) + 1, fTracks.size()), empty);
+    }
+    fMaxTrackID = 0;
     fAugerElectron.Set(0,0,0.);
 }
\ No newline at end of file
@@ -18,6 +18,48 @@
 #include "G4ParticleDefinition.hh"
 
 #include <cstdlib>
+#include <cfloat>
+
+namespace {
+    /// Particle of rule: PDG code, name or "all"
+    G4bool ParseParticle(const G4String& token, G4int& pdg_code, G4bool& allParticles) {
+        allParticles = (token == "all");
+        pdg_code = 0;
+        if (allParticles) return true;
+        char* end;
+        pdg_code = strtol(token.data(), &end, 10);
+        if (!*end) return true;
+        G4ParticleDefinition* particle = G4ParticleTable::GetParticleTable()->FindParticle(token);
+        if (!particle) return false;
+        pdg_code = particle->GetPDGEncoding();
+        return true;
+    }
+    
+    /// Ion range of black list: Z>N, Z>=N, Z<N, Z<=N, Z=N or Z=N-M (same for A)
+    G4bool ParseIonRange(const G4String& token, G4bool& isZ, G4int& min, G4int& max) {
+        if (token.size() < 3 || (token[0] != 'Z' && token[0] != 'A')) return false;
+        isZ = (token[0] == 'Z');
+        const char* op = token.data() + 1;
+        const G4bool orEqual = (op[1] == '=') && (op[0] == '>' || op[0] == '<');
+        const char* number = op + (orEqual ? 2 : 1);
+        char* end;
+        const G4int value = strtol(number, &end, 10);
+        if (end == number) return false;
+        min = 0;
+        max = 999;
+        if      (op[0] == '>') min = orEqual ? value : value + 1;
+        else if (op[0] == '<') max = orEqual ? value : value - 1;
+        else if (op[0] == '=') {
+            min = max = value;
+            if (*end == '-') {
+                const char* second = end + 1;
+                max = strtol(second, &end, 10);
+                if (end == second) return false;
+            }
+        } else return false;
+        return !*end && min <= max;
+    }
+}
 
 BxStackingTTreeMessenger::BxStackingTTreeMessenger(BxStackingTTree* stack)
 : fStacking(stack)
@@ -30,35 +72,110 @@ BxStackingTTreeMessenger::BxStackingTTreeMessenger(BxStackingTTree* stack)
     
     fBlackListParticleCmd = new G4UIcmdWithAString("/bx/stack/ttree/black_list", this);
     fBlackListParticleCmd->SetGuidance("Kill particles by their pdg codes or names");
+    fBlackListParticleCmd->SetGuidance("Names may have wildcards '*' and '?', ions can be given by ranges Z>N, Z>=N, Z<N, Z<=N, Z=N, Z=N-M (same for A)");
     
     fBlackListProcessCmd = new G4UIcmdWithAString("/bx/stack/ttree/process_black_list", this);
     fBlackListProcessCmd->SetGuidance("Kill particles by their creator process name");
+    fBlackListProcessCmd->SetGuidance("Names may have wildcards '*' and '?'");
+    
+    fRuleCmd = new G4UIcmdWithAString("/bx/stack/ttree/rule", this);
+    fRuleCmd->SetGuidance("Classify particles created by process: process particle action [status]");
+    fRuleCmd->SetGuidance("  particle: PDG code, name or 'all'");
+    fRuleCmd->SetGuidance("  action:   urgent, waiting, kill or postpone (to the next event with given status)");
+    fRuleCmd->SetGuidance("Rules are applied in order they are given, before modes");
+    fRuleCmd->SetGuidance("Optical photons cannot be postponed, they are tracked in the current event if matched by 'all'");
+    fRuleCmd->SetGuidance("Default:    status 5");
+    
+    fRouletteCmd = new G4UIcmdWithAString("/bx/stack/ttree/roulette", this);
+    fRouletteCmd->SetGuidance("Russian roulette: particle process E_min E_max unit probability");
+    fRouletteCmd->SetGuidance("Particles (PDG code, name or 'all') created by process (or 'all') with kinetic energy in [E_min, E_max)");
+    fRouletteCmd->SetGuidance("survive with probability, their weight is divided by it. E_max can be 'inf'");
+    fRouletteCmd->SetGuidance("Default:    none");
+    
+    fSplitCmd = new G4UIcmdWithAString("/bx/stack/ttree/split", this);
+    fSplitCmd->SetGuidance("Splitting: particle process E_min E_max unit n");
+    fSplitCmd->SetGuidance("Particles (PDG code, name or 'all') created by process (or 'all') with kinetic energy in [E_min, E_max)");
+    fSplitCmd->SetGuidance("are split into n copies, weight of each is divided by n. E_max can be 'inf'");
+    fSplitCmd->SetGuidance("Default:    none");
     
     BxLog(routine) << "BxStackingTTreeMessenger built" << endlog;
 }
 
 BxStackingTTreeMessenger::~BxStackingTTreeMessenger() {
-    delete fDirectory;
     delete fModeCmd;
+    delete fBlackListParticleCmd;
+    delete fBlackListProcessCmd;
+    delete fRuleCmd;
+    delete fRouletteCmd;
+    delete fSplitCmd;
+    delete fDirectory;
 }
 
 void BxStackingTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue) {
     G4String cmdName = "/ttree/" + cmd->GetCommandName();
-    newValue.toLower();
+    if (cmd == fRuleCmd) {
+        // process and particle names are case sensitive
+        BxLog(routine) << cmdName << "  command is set to  \"" << newValue << "\"" << endlog;
+        std::vector<G4String> tokens;
+        G4Analysis::Tokenize(newValue, tokens);
+        if (tokens.size() < 3 || tokens.size() > 4) {
+            BxLog(error) << cmdName << ":  expected \"process particle action [status]\", got \"" << newValue << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        
+        G4int  pdg_code;
+        G4bool allParticles;
+        if (!ParseParticle(tokens[1], pdg_code, allParticles)) {
+            BxLog(error) << cmdName << ":  unknown particle with name \"" << tokens[1] << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        
+        G4String action = tokens[2];
+        action.toLower();
+        BxStackingTTree::ERuleAction ruleAction = BxStackingTTree::kUrgent;
+        if      (action == "urgent")   ruleAction = BxStackingTTree::kUrgent;
+        else if (action == "waiting")  ruleAction = BxStackingTTree::kWaiting;
+        else if (action == "kill")     ruleAction = BxStackingTTree::kKill;
+        else if (action == "postpone") ruleAction = BxStackingTTree::kPostpone;
+        else {
+            BxLog(error) << cmdName << ":  unknown action \"" << tokens[2] << "\", use urgent, waiting, kill or postpone" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        
+        // optical photons are not recorded, so they cannot be traced to primary to be postponed
+        if (ruleAction == BxStackingTTree::kPostpone && !allParticles && (pdg_code == 50 || tokens[1] == "opticalphoton")) {
+            BxLog(error) << cmdName << ":  optical photons cannot be postponed" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        
+        G4int status = 5;
+        if (tokens.size() == 4) {
+            char* end;
+            status = strtol(tokens[3].data(), &end, 10);
+            if (*end || status == 0) {
+                BxLog(error) << cmdName << ":  status must be non-zero integer, got \"" << tokens[3] << "\"" << endlog;
+                BxLog(fatal) << "FATAL " << endlog;
+            }
+        }
+        fStacking->AddRule(tokens[0], pdg_code, allParticles, ruleAction, status);
+        return;
+    }
+    // names of particles and processes are case sensitive, only mode is not
     std::vector<G4String> tokens;
     G4Analysis::Tokenize(newValue, tokens);
     if (cmd == fModeCmd) {
         BxLog(routine) << cmdName << "  command is set to  \"" << newValue << "\"" << endlog;
-        if (tokens[0] == "all") fStacking->SetMode(true);
-        else if (tokens[0] == "!all") fStacking->SetKillMode(true);
-        else if (tokens[0] == "none" || tokens[0] == "") {
+        for (size_t i = 0; i < tokens.size(); ++i) tokens[i].toLower();
+        if (tokens.empty() || tokens[0] == "none" || tokens[0] == "") {
             fStacking->SetMode(false);
             fStacking->SetKillMode(false);
         }
+        else if (tokens[0] == "all") fStacking->SetMode(true);
+        else if (tokens[0] == "!all") fStacking->SetKillMode(true);
         else {
             for (size_t i = 0; i < tokens.size(); ++i) {
                 if (tokens[i] == "neutron" || tokens[i] == "1") fStacking->SetMode(0, true);
-                if (tokens[i] == "!neutron" || tokens[i] == "!1") fStacking->SetKillMode(0, true);
+                else if (tokens[i] == "!neutron" || tokens[i] == "!1") fStacking->SetKillMode(0, true);
                 else if (tokens[i] == "ra_decay" || tokens[i] == "2") fStacking->SetMode(1, true);
                 else if (tokens[i] == "!ra_decay" || tokens[i] == "!2") fStacking->SetKillMode(1, true);
                 else if (tokens[i] == "muon" || tokens[i] == "3") fStacking->SetMode(2, true);
@@ -71,6 +188,17 @@ void BxStackingTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue)
     } else if (cmd == fBlackListParticleCmd) {
         BxLog(routine) << cmdName << "  command is set to  \"" << newValue << "\"" << endlog;
         for (size_t i = 0; i < tokens.size(); ++i) {
+            G4bool isZ;
+            G4int  min, max;
+            if (ParseIonRange(tokens[i], isZ, min, max)) {
+                fStacking->AddIonRangeToBlackList(isZ, min, max);
+                continue;
+            }
+            if (tokens[i].find_first_of("*?") != std::string::npos) {
+                // expanded over particle table at the start of event
+                fStacking->AddParticlePatternToBlackList(tokens[i]);
+                continue;
+            }
             char* end;
             G4int pdg_code = strtol(tokens[i].data(), &end, 10);
             G4bool isInteger = (!*end) ? true : false;
@@ -94,7 +222,41 @@ void BxStackingTTreeMessenger::SetNewValue(G4UIcommand* cmd, G4String newValue)
     }  else if (cmd == fBlackListProcessCmd) {
         BxLog(routine) << cmdName << "  command is set to  \"" << newValue << "\"" << endlog;
         for (size_t i = 0; i < tokens.size(); ++i) {
-            fStacking->AddProcessToBlackList(newValue);
+            fStacking->AddProcessToBlackList(tokens[i]);
+        }
+    } else if (cmd == fRouletteCmd || cmd == fSplitCmd) {
+        BxLog(routine) << cmdName << "  command is set to  \"" << newValue << "\"" << endlog;
+        if (tokens.size() != 6) {
+            BxLog(error) << cmdName << ":  expected \"particle process E_min E_max unit " << (cmd == fRouletteCmd ? "probability" : "n") << "\", got \"" << newValue << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        G4int  pdg_code;
+        G4bool allParticles;
+        if (!ParseParticle(tokens[0], pdg_code, allParticles)) {
+            BxLog(error) << cmdName << ":  unknown particle with name \"" << tokens[0] << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        if (G4UIcommand::CategoryOf(tokens[4]) != "Energy") {
+            BxLog(error) << cmdName << ":  wrong energy unit \"" << tokens[4] << "\"" << endlog;
+            BxLog(fatal) << "FATAL " << endlog;
+        }
+        const G4double unit = G4UIcommand::ValueOf(tokens[4]);
+        const G4double eMin = G4UIcommand::ConvertToDouble(tokens[2]) * unit;
+        const G4double eMax = (tokens[3] == "inf") ? DBL_MAX : G4UIcommand::ConvertToDouble(tokens[3]) * unit;
+        if (cmd == fRouletteCmd) {
+            const G4double probability = G4UIcommand::ConvertToDouble(tokens[5]);
+            if (probability <= 0. || probability > 1.) {
+                BxLog(error) << cmdName << ":  survival probability must be in (0, 1], got " << tokens[5] << endlog;
+                BxLog(fatal) << "FATAL " << endlog;
+            }
+            fStacking->AddBiasing(tokens[1], pdg_code, allParticles, eMin, eMax, probability, 1);
+        } else {
+            const G4int n = G4UIcommand::ConvertToInt(tokens[5]);
+            if (n < 1) {
+                BxLog(error) << cmdName << ":  number of copies must be positive, got " << tokens[5] << endlog;
+                BxLog(fatal) << "FATAL " << endlog;
+            }
+            fStacking->AddBiasing(tokens[1], pdg_code, allParticles, eMin, eMax, 1., n);
         }
     }
 }